@@ -0,0 +1,411 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "asm.h"
+#include "asmlog.h"
+#include "tsblock.h"
+
+#define ARCHIVE_SUFFIX ".asa"
+
+// The samples of one instance that are not in a segment file yet
+struct series
+{
+	int                id;
+	uint64_t           seen;  // time of the last sample
+	int                fd;    // the segment file of day, or -1
+	uint32_t           day;
+	off_t              end;   // where the next block goes
+	struct asm_tsblock block;
+};
+
+static char                     archive_dir[PATH_MAX - 32]; // room for the file name
+static struct series          **series = NULL;  // in id order
+static int                      series_count = 0;
+static int                      series_room = 0;
+static struct asm_archive_stats stats;
+
+// The UTC day of a time in ms since the epoch, as YYYYMMDD
+static uint32_t day_of(uint64_t time)
+{
+	time_t t = time / 1000;
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	return (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+}
+
+static void segment_path(char *path, size_t size, int id, uint32_t day)
+{
+	snprintf(path, size, "%s/%d-%08u" ARCHIVE_SUFFIX, archive_dir, id, day);
+}
+
+static int segment_header_ok(const unsigned char *p, int id, uint32_t day)
+{
+	return *((const unsigned int *)p) == ASM_ARCHIVE_MAGIC &&
+	       *((const unsigned int *)(p + 4)) == ASM_ARCHIVE_VERSION &&
+	       *((const unsigned int *)(p + 8)) == (unsigned int)id &&
+	       *((const unsigned int *)(p + 12)) == day;
+}
+
+/*
+ * The end of the last whole block of a mapped segment file. A daemon
+ * that died while writing a block leaves the rest of it behind.
+ */
+static size_t segment_end(const unsigned char *map, size_t size)
+{
+	size_t end = ASM_ARCHIVE_HEADER, len;
+
+	while ((len = asm_tsblock_check(map + end, size - end)) > 0) {
+		end += len;
+	}
+	return end;
+}
+
+/*
+ * Open the segment file of a day for appending blocks, creating it or
+ * cutting off a partly written block at its end
+ */
+static int segment_open(struct series *s, uint32_t day)
+{
+	unsigned char header[ASM_ARCHIVE_HEADER];
+	char path[PATH_MAX];
+	struct stat st;
+	void *map;
+	int fd;
+
+	segment_path(path, sizeof(path), s->id, day);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0640)) == -1) {
+		asmlog_error("archive: %s, %s", path, strerror(errno));
+		return 1;
+	}
+	if (fstat(fd, &st) == -1) {
+		asmlog_error("archive: %s, %s", path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	if (st.st_size < ASM_ARCHIVE_HEADER) {
+		*((unsigned int *)header)        = ASM_ARCHIVE_MAGIC;
+		*((unsigned int *)(header + 4))  = ASM_ARCHIVE_VERSION;
+		*((unsigned int *)(header + 8))  = s->id;
+		*((unsigned int *)(header + 12)) = day;
+		if (pwrite(fd, header, sizeof(header), 0) != sizeof(header) || ftruncate(fd, sizeof(header)) == -1) {
+			asmlog_error("archive: %s, %s", path, strerror(errno));
+			close(fd);
+			return 1;
+		}
+		s->end = sizeof(header);
+	} else {
+		if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			asmlog_error("archive: mmap %s, %s", path, strerror(errno));
+			close(fd);
+			return 1;
+		}
+		if (!segment_header_ok(map, s->id, day)) {
+			asmlog_error("archive: %s is not a segment file of this version, left alone", path);
+			munmap(map, st.st_size);
+			close(fd);
+			return 1;
+		}
+		s->end = segment_end(map, st.st_size);
+		munmap(map, st.st_size);
+		if (s->end < st.st_size) {
+			asmlog_warning("archive: %s, dropped %ld bytes of a partly written block", path, (long)(st.st_size - s->end));
+			if (ftruncate(fd, s->end) == -1) {
+				asmlog_error("archive: %s, %s", path, strerror(errno));
+			}
+		}
+	}
+	s->fd  = fd;
+	s->day = day;
+	return 0;
+}
+
+static void segment_close(struct series *s)
+{
+	if (s->fd != -1) {
+		close(s->fd);
+		s->fd = -1;
+	}
+}
+
+// Append the block of samples to the segment file of its day, and start a new one
+static void series_flush(struct series *s)
+{
+	unsigned char out[ASM_TSBLOCK_MAX_SIZE];
+	uint32_t day;
+	size_t len;
+
+	if (s->block.count == 0) return;
+
+	day = day_of(s->block.first);
+	if (s->fd == -1 || s->day != day) {
+		segment_close(s);
+		if (segment_open(s, day) != 0) {
+			stats.errors++;
+			asm_tsblock_init(&s->block, ASM_ARCHIVE_FIELDS);
+			return;
+		}
+	}
+	len = asm_tsblock_write(&s->block, out);
+	if (pwrite(s->fd, out, len, s->end) != (ssize_t)len) {
+		asmlog_error("archive: instance %d, write, %s", s->id, strerror(errno));
+		stats.errors++;
+		// Do not leave a partial block for the next one to be written after
+		if (ftruncate(s->fd, s->end) == -1) segment_close(s);
+	} else {
+		s->end += len;
+		stats.blocks++;
+		stats.bytes += len;
+	}
+	asm_tsblock_init(&s->block, ASM_ARCHIVE_FIELDS);
+}
+
+// The position of the series of an instance, or where it would go
+static int series_find(int id)
+{
+	int lo = 0, hi = series_count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (series[mid]->id < id) lo = mid + 1; else hi = mid;
+	}
+	return lo;
+}
+
+static struct series *series_get(int id)
+{
+	struct series **grown, *s;
+	int i = series_find(id);
+
+	if (i < series_count && series[i]->id == id) {
+		return series[i];
+	}
+	if (series_count == series_room) {
+		if ((grown = realloc(series, (series_room + 16) * sizeof(*series))) == NULL) return NULL;
+		series = grown;
+		series_room += 16;
+	}
+	if ((s = malloc(sizeof(*s))) == NULL) return NULL;
+	s->id = id;
+	s->fd = -1;
+	asm_tsblock_init(&s->block, ASM_ARCHIVE_FIELDS);
+	memmove(series + i + 1, series + i, (series_count - i) * sizeof(*series));
+	series[i] = s;
+	series_count++;
+	return s;
+}
+
+static void series_drop(int i)
+{
+	series_flush(series[i]);
+	segment_close(series[i]);
+	free(series[i]);
+	memmove(series + i, series + i + 1, (series_count - i - 1) * sizeof(*series));
+	series_count--;
+}
+
+int asm_archive_open(const char *dir)
+{
+	if (snprintf(archive_dir, sizeof(archive_dir), "%s", dir) >= (int)sizeof(archive_dir)) {
+		asmlog_error("archive: %s, name too long", dir);
+		return 1;
+	}
+	if (mkdir(archive_dir, 0750) == -1 && errno != EEXIST) {
+		asmlog_error("archive: %s, %s", archive_dir, strerror(errno));
+		return 1;
+	}
+	asmlog_info("Archiving samples to %s", archive_dir);
+	return 0;
+}
+
+// Write out what is left, and forget all instances
+void asm_archive_close(void)
+{
+	while (series_count > 0) {
+		series_drop(series_count - 1);
+	}
+	free(series);
+	series = NULL;
+	series_room = 0;
+}
+
+/*
+ * Add a sample of an instance, taken at time ms since the epoch, with
+ * the values of the ASM_ARCHIVE_FIELDS in field order (see asi_fields())
+ */
+void asm_archive_add(int id, uint64_t time, const uint64_t *values)
+{
+	struct series *s;
+
+	if ((s = series_get(id)) == NULL) {
+		asmlog_error("archive: instance %d, out of memory", id);
+		stats.errors++;
+		return;
+	}
+	// A block is one day's, and goes forward in time
+	if (s->block.count > 0 && (time < s->block.last || day_of(time) != day_of(s->block.first))) {
+		series_flush(s);
+	}
+	if (asm_tsblock_append(&s->block, time, values)) {
+		series_flush(s);
+	}
+	s->seen = time;
+	stats.samples++;
+}
+
+// Write out and forget the instances that were not sampled at time
+void asm_archive_sweep(uint64_t time)
+{
+	int i;
+
+	for (i = series_count - 1; i >= 0; i--) {
+		if (series[i]->seen != time) {
+			series_drop(i);
+		}
+	}
+}
+
+static int compare_day(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * The days from ... to that instance id has segment files of, in order.
+ * Returns the number of days, or -1.
+ */
+static int segment_days(int id, uint32_t from, uint32_t to, uint32_t **days)
+{
+	char prefix[16];
+	struct dirent *entry;
+	uint32_t day, *grown;
+	size_t len;
+	int count = 0, room = 0;
+	DIR *dir;
+
+	*days = NULL;
+	if ((dir = opendir(archive_dir)) == NULL) {
+		asmlog_error("archive: %s, %s", archive_dir, strerror(errno));
+		return -1;
+	}
+	len = snprintf(prefix, sizeof(prefix), "%d-", id);
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, prefix, len) != 0 ||
+		    strlen(entry->d_name) != len + 8 + strlen(ARCHIVE_SUFFIX) ||
+		    strcmp(entry->d_name + len + 8, ARCHIVE_SUFFIX) != 0) {
+			continue;
+		}
+		day = strtoul(entry->d_name + len, NULL, 10);
+		if (day < from || day > to) continue;
+		if (count == room) {
+			if ((grown = realloc(*days, (room + 32) * sizeof(**days))) == NULL) break;
+			*days = grown;
+			room += 32;
+		}
+		(*days)[count++] = day;
+	}
+	closedir(dir);
+	qsort(*days, count, sizeof(**days), compare_day);
+	return count;
+}
+
+// Decode the samples from ... to of a mapped segment file, as asm_archive_query()
+static int segment_query(const unsigned char *map, size_t size, uint32_t mask, uint64_t from, uint64_t to,
+                         uint64_t *times, uint64_t *values, int max)
+{
+	size_t offset = ASM_ARCHIVE_HEADER, len;
+	int fields = __builtin_popcount(mask), n = 0, got;
+
+	while (n < max && (len = asm_tsblock_check(map + offset, size - offset)) > 0) {
+		if (*((const uint64_t *)(map + offset + 8)) > to) break;
+		got = asm_tsblock_decode(map + offset, mask, from, to, times + n, values + n * fields, max - n);
+		if (got < 0) break;
+		n += got;
+		offset += len;
+	}
+	return n;
+}
+
+/*
+ * Find the samples of an instance from ... to ms since the epoch, in the
+ * segment files and then in the block that is not written yet. For up
+ * to max samples, times gets the time and values the value of each
+ * field in mask, in field order. Returns the number of samples, or -1.
+ */
+int asm_archive_query(int id, uint32_t mask, uint64_t from, uint64_t to,
+                      uint64_t *times, uint64_t *values, int max)
+{
+	static unsigned char block[ASM_TSBLOCK_MAX_SIZE];
+	char path[PATH_MAX];
+	struct stat st;
+	uint32_t *days;
+	void *map;
+	int count, i, fd, fields = __builtin_popcount(mask), n = 0, got;
+
+	stats.queries++;
+	if (from > to) return 0;
+	if ((count = segment_days(id, day_of(from), day_of(to), &days)) < 0) {
+		return -1;
+	}
+	for (i = 0; i < count && n < max; i++) {
+		segment_path(path, sizeof(path), id, days[i]);
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) continue;
+		if (fstat(fd, &st) == 0 && st.st_size >= ASM_ARCHIVE_HEADER &&
+		    (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+			if (segment_header_ok(map, id, days[i])) {
+				n += segment_query(map, st.st_size, mask, from, to, times + n, values + n * fields, max - n);
+			}
+			munmap(map, st.st_size);
+		}
+		close(fd);
+	}
+	free(days);
+
+	i = series_find(id);
+	if (n < max && i < series_count && series[i]->id == id && series[i]->block.count > 0) {
+		asm_tsblock_write(&series[i]->block, block);
+		got = asm_tsblock_decode(block, mask, from, to, times + n, values + n * fields, max - n);
+		if (got > 0) n += got;
+	}
+	return n;
+}
+
+const struct asm_archive_stats *asm_archive_stats(void)
+{
+	return &stats;
+}
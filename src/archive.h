@@ -0,0 +1,68 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASMARCHIVE_H_
+#define ASMARCHIVE_H_
+
+#include <stdint.h>
+
+#include "asm.h"
+
+/*
+ * The archive of samples on disk, see -a.
+ *
+ * The daemon samples every active instance each ASM_ARCHIVE_INTERVAL ms
+ * and appends the samples, in compressed blocks (see tsblock.h), to one
+ * segment file per instance and UTC day, <dir>/<id>-<YYYYMMDD>.asa. A
+ * segment file starts with a header, in the same byte order as the
+ * blocks that follow it:
+ *
+ *   uint32  ASM_ARCHIVE_MAGIC
+ *   uint32  ASM_ARCHIVE_VERSION
+ *   uint32  instance id
+ *   uint32  the day, YYYYMMDD
+ *
+ * A block is written once it is full, so a crash loses the samples of
+ * up to ASM_TSBLOCK_SAMPLES intervals. Queries map the segment files
+ * and decode only the blocks and the columns they ask for.
+ */
+#define ASM_ARCHIVE_MAGIC    ASM_FOURCC('A', 'S', 'M', 'A')
+#define ASM_ARCHIVE_VERSION  1
+#define ASM_ARCHIVE_HEADER   16
+#define ASM_ARCHIVE_INTERVAL 1000
+
+struct asm_archive_stats
+{
+	uint64_t samples;
+	uint64_t blocks;
+	uint64_t bytes;   // written to segment files
+	uint64_t errors;
+	uint64_t queries;
+};
+
+int  asm_archive_open(const char *dir);
+void asm_archive_close(void);
+void asm_archive_add(int id, uint64_t time, const uint64_t *values);
+void asm_archive_sweep(uint64_t time);
+int  asm_archive_query(int id, uint32_t mask, uint64_t from, uint64_t to,
+                       uint64_t *times, uint64_t *values, int max);
+const struct asm_archive_stats *asm_archive_stats(void);
+
+#endif /* ASMARCHIVE_H_ */
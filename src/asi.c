@@ -0,0 +1,348 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "asm.h"
+#include "asi.h"
+
+// Spin this many times before yielding the CPU to a preempted writer
+#define ASI_READ_SPINS   64
+// Give up on a slot whose writer seems to have died in the middle of an update
+#define ASI_READ_RETRIES 1000
+
+// The generation counter of the shared memory area, see asi_set_generation()
+static uint32_t *asi_generation = NULL;
+static uint32_t *asi_waiting = NULL;
+
+/*
+ * Have asi_write_end() bump a generation counter, so readers can tell
+ * that nothing changed since they last looked, and wake a reader that
+ * waits for it to move, see asi_notify()
+ */
+void asi_set_generation(uint32_t *generation, uint32_t *waiting)
+{
+	asi_generation = generation;
+	asi_waiting    = waiting;
+}
+
+/*
+ * Bump the generation counter, and wake the readers blocked on it with
+ * FUTEX_WAIT if one of them set the waiting flag. Only the first writer
+ * after the flag was set takes it down and makes the system call, so a
+ * reader gets at most one wakeup each time it waits, and writers make no
+ * system calls at all while nobody does.
+ *
+ * The flag and the counter are both sequentially consistent: either the
+ * writer sees the flag, or the reader sees the new generation before it
+ * goes to sleep.
+ */
+void asi_notify(uint32_t *generation, uint32_t *waiting)
+{
+	__atomic_fetch_add(generation, 1, __ATOMIC_SEQ_CST);
+	if (waiting != NULL && __atomic_load_n(waiting, __ATOMIC_SEQ_CST) != 0 &&
+	    __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST) != 0) {
+		syscall(SYS_futex, generation, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+void asi_write_begin(struct ASM_INSTANCE *asi, enum asi_writer writer)
+{
+	uint32_t seq = __atomic_load_n(&asi->SEQUENCE[writer], __ATOMIC_RELAXED);
+
+	__atomic_store_n(&asi->SEQUENCE[writer], seq + 1, __ATOMIC_RELAXED);
+	// The odd sequence number must be visible before any of the field updates
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void asi_write_end(struct ASM_INSTANCE *asi, enum asi_writer writer)
+{
+	uint32_t seq = __atomic_load_n(&asi->SEQUENCE[writer], __ATOMIC_RELAXED);
+
+	__atomic_store_n(&asi->SEQUENCE[writer], seq + 1, __ATOMIC_RELEASE);
+	if (asi_generation != NULL) {
+		asi_notify(asi_generation, asi_waiting);
+	}
+}
+
+/*
+ * Take a consistent copy of a slot.
+ *
+ * Returns 0 on success, or 1 if no consistent copy could be made.
+ */
+int asi_read(const struct ASM_INSTANCE *asi, struct ASM_INSTANCE *copy)
+{
+	int retries, writer, busy;
+	uint32_t seq[ASI_WRITERS];
+
+	for (retries = 0; retries < ASI_READ_RETRIES; retries++) {
+		if (retries >= ASI_READ_SPINS) {
+			sched_yield();
+		}
+		busy = 0;
+		for (writer = 0; writer < ASI_WRITERS; writer++) {
+			seq[writer] = __atomic_load_n(&asi->SEQUENCE[writer], __ATOMIC_ACQUIRE);
+			busy |= seq[writer] & 1;
+		}
+		if (busy) {
+			// An update is in progress
+			continue;
+		}
+
+		memcpy(copy, (const void *)asi, sizeof(*copy));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		for (writer = 0; writer < ASI_WRITERS; writer++) {
+			if (__atomic_load_n(&asi->SEQUENCE[writer], __ATOMIC_RELAXED) != seq[writer]) {
+				break;
+			}
+		}
+		if (writer == ASI_WRITERS) {
+			copy->MISSION[SMALSTRINGSIZE - 1] = '\0';
+			copy->PROFILE[SMALSTRINGSIZE - 1] = '\0';
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+struct ASI_HISTORY *asi_history(const struct ASM_SLOT *slot)
+{
+	return (struct ASI_HISTORY *)&slot->HISTORY;
+}
+
+// Forget all samples. Must not run concurrently with asi_history_append().
+void asi_history_reset(struct ASM_SLOT *slot, uint32_t interval)
+{
+	struct ASI_HISTORY *history = asi_history(slot);
+
+	__atomic_store_n(&history->HEAD, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&history->INTERVAL, interval, __ATOMIC_RELEASE);
+}
+
+void asi_history_append(struct ASM_SLOT *slot, const struct ASI_SAMPLE *sample)
+{
+	struct ASI_HISTORY *history = asi_history(slot);
+	uint32_t head = __atomic_load_n(&history->HEAD, __ATOMIC_RELAXED);
+
+	history->SAMPLES[head % ASI_HISTORY_SIZE] = *sample;
+	// Publish the sample
+	__atomic_store_n(&history->HEAD, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy the history, oldest sample first, into samples (which must have
+ * room for ASI_HISTORY_SIZE entries).
+ *
+ * Returns the number of samples copied.
+ */
+int asi_history_read(const struct ASM_SLOT *slot, struct ASI_SAMPLE *samples, uint32_t *interval)
+{
+	const struct ASI_HISTORY *history = asi_history(slot);
+	uint32_t head, first, last, n;
+
+	head = __atomic_load_n(&history->HEAD, __ATOMIC_ACQUIRE);
+	*interval = __atomic_load_n(&history->INTERVAL, __ATOMIC_RELAXED);
+	first = head > ASI_HISTORY_SIZE ? head - ASI_HISTORY_SIZE : 0;
+	for (n = first; n != head; n++) {
+		samples[n - first] = history->SAMPLES[n % ASI_HISTORY_SIZE];
+	}
+
+	// The writer may have moved on while we were copying. Sample last is
+	// the one it may be writing now, which overwrites sample last - SIZE.
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	last = __atomic_load_n(&history->HEAD, __ATOMIC_RELAXED);
+	if (last - first >= ASI_HISTORY_SIZE) {
+		uint32_t skip = last - first - ASI_HISTORY_SIZE + 1;
+
+		if (skip >= head - first) return 0;
+		memmove(samples, samples + skip, (head - first - skip) * sizeof(*samples));
+		return head - first - skip;
+	}
+	return head - first;
+}
+
+static inline uint16_t clamp16(uint32_t v)
+{
+	return v > UINT16_MAX ? UINT16_MAX : v;
+}
+
+static inline uint32_t clamp32(uint64_t v)
+{
+	return v > UINT32_MAX ? UINT32_MAX : v;
+}
+
+/*
+ * Convert a (consistent copy of an) instance to the legacy record that
+ * ArmaServerMonitor.exe understands. Counters that no longer fit are
+ * clamped rather than wrapped.
+ */
+void asi_legacy(const struct ASM_INSTANCE *asi, struct ARMA_SERVER_INFO *legacy)
+{
+	legacy->PID           = asi->PID;	// only used as a liveness flag and label
+	legacy->OBJ_COUNT_0   = clamp16(asi->OBJ_COUNT_0);
+	legacy->OBJ_COUNT_1   = clamp16(asi->OBJ_COUNT_1);
+	legacy->OBJ_COUNT_2   = clamp16(asi->OBJ_COUNT_2);
+	legacy->PLAYER_COUNT  = clamp16(asi->PLAYER_COUNT);
+	legacy->AI_LOC_COUNT  = clamp16(asi->AI_LOC_COUNT);
+	legacy->AI_REM_COUNT  = clamp16(asi->AI_REM_COUNT);
+	legacy->SERVER_FPS    = clamp16(asi->SERVER_FPS);
+	legacy->SERVER_FPSMIN = clamp16(asi->SERVER_FPSMIN);
+	legacy->FSM_CE_FREQ   = clamp16(asi->FSM_CE_FREQ);
+	legacy->MEM           = clamp32(asi->MEM);
+	legacy->NET_RECV      = clamp32(asi->NET_RECV);
+	legacy->NET_SEND      = clamp32(asi->NET_SEND);
+	legacy->DISC_READ     = clamp32(asi->DISC_READ / 1024);
+	legacy->TICK_COUNT    = asi->UPDATED / 1000000;
+	memcpy(legacy->MISSION, asi->MISSION, SMALSTRINGSIZE);
+	memcpy(legacy->PROFILE, asi->PROFILE, SMALSTRINGSIZE);
+}
+
+// Where a numeric field is in struct ASM_INSTANCE
+static const struct {
+	unsigned short offset;
+	unsigned short size;  // 4 or 8, 0 for strings
+} asi_numbers[ASM_FIELDS] = {
+	[ASM_FIELD_PID]           = { offsetof(struct ASM_INSTANCE, PID),           4 },
+	[ASM_FIELD_OBJ_COUNT_0]   = { offsetof(struct ASM_INSTANCE, OBJ_COUNT_0),   4 },
+	[ASM_FIELD_OBJ_COUNT_1]   = { offsetof(struct ASM_INSTANCE, OBJ_COUNT_1),   4 },
+	[ASM_FIELD_OBJ_COUNT_2]   = { offsetof(struct ASM_INSTANCE, OBJ_COUNT_2),   4 },
+	[ASM_FIELD_PLAYER_COUNT]  = { offsetof(struct ASM_INSTANCE, PLAYER_COUNT),  4 },
+	[ASM_FIELD_AI_LOC_COUNT]  = { offsetof(struct ASM_INSTANCE, AI_LOC_COUNT),  4 },
+	[ASM_FIELD_AI_REM_COUNT]  = { offsetof(struct ASM_INSTANCE, AI_REM_COUNT),  4 },
+	[ASM_FIELD_SERVER_FPS]    = { offsetof(struct ASM_INSTANCE, SERVER_FPS),    4 },
+	[ASM_FIELD_SERVER_FPSMIN] = { offsetof(struct ASM_INSTANCE, SERVER_FPSMIN), 4 },
+	[ASM_FIELD_FSM_CE_FREQ]   = { offsetof(struct ASM_INSTANCE, FSM_CE_FREQ),   4 },
+	[ASM_FIELD_CPU_LOAD]      = { offsetof(struct ASM_INSTANCE, CPU_LOAD),      4 },
+	[ASM_FIELD_MEM]           = { offsetof(struct ASM_INSTANCE, MEM),           8 },
+	[ASM_FIELD_NET_RECV]      = { offsetof(struct ASM_INSTANCE, NET_RECV),      8 },
+	[ASM_FIELD_NET_SEND]      = { offsetof(struct ASM_INSTANCE, NET_SEND),      8 },
+	[ASM_FIELD_DISC_READ]     = { offsetof(struct ASM_INSTANCE, DISC_READ),     8 },
+	[ASM_FIELD_DISC_WRITE]    = { offsetof(struct ASM_INSTANCE, DISC_WRITE),    8 },
+	[ASM_FIELD_IO_READ]       = { offsetof(struct ASM_INSTANCE, IO_READ),       8 },
+	[ASM_FIELD_IO_WRITE]      = { offsetof(struct ASM_INSTANCE, IO_WRITE),      8 },
+	[ASM_FIELD_STARTED]       = { offsetof(struct ASM_INSTANCE, STARTED),       8 },
+	[ASM_FIELD_UPDATED]       = { offsetof(struct ASM_INSTANCE, UPDATED),       8 },
+};
+
+/*
+ * The numeric fields of an instance that are in mask, bit n for field
+ * n of enum asm_field, as 64-bit values in field order. Returns how many.
+ */
+int asi_fields(const struct ASM_INSTANCE *asi, uint32_t mask, uint64_t *values)
+{
+	const unsigned char *p;
+	int field, n = 0;
+
+	for (field = 0; field < ASM_FIELDS; field++) {
+		if (!(mask & (1u << field)) || asi_numbers[field].size == 0) continue;
+		p = (const unsigned char *)asi + asi_numbers[field].offset;
+		values[n++] = asi_numbers[field].size == 4 ? *((const uint32_t *)p) : *((const uint64_t *)p);
+	}
+	return n;
+}
+
+static unsigned profile_bucket(uint64_t ns)
+{
+	unsigned e;
+
+	if (ns < 4) return ns;
+	e = 63 - __builtin_clzll(ns);
+	if (e > 32) return ASI_PROFILE_BUCKETS - 1;
+	return 4 * (e - 1) + ((ns >> (e - 2)) & 3);
+}
+
+// The lowest call time, in nanoseconds, that goes into a bucket
+uint64_t asi_profile_bucket_ns(unsigned bucket)
+{
+	if (bucket < 4) return bucket;
+	return (uint64_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+// Count a call that was not timed. Only called by the Arma server thread.
+void asi_profile_count(struct ASI_PROFILE_COMMAND *command)
+{
+	__atomic_store_n(&command->COUNT, command->COUNT + 1, __ATOMIC_RELAXED);
+}
+
+// Add a timed call to a command's profile. Only called by the Arma server thread.
+void asi_profile_record(struct ASI_PROFILE_COMMAND *command, uint64_t ns)
+{
+	uint32_t *bucket = &command->BUCKETS[profile_bucket(ns)];
+
+	__atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&command->SUM, command->SUM + ns, __ATOMIC_RELAXED);
+	if (ns > command->MAX) {
+		__atomic_store_n(&command->MAX, ns, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&command->COUNT, command->COUNT + 1, __ATOMIC_RELAXED);
+}
+
+// The number of calls of a command that were timed
+static uint64_t profile_timed(const struct ASI_PROFILE_COMMAND *command)
+{
+	uint64_t count = 0;
+	unsigned b;
+
+	for (b = 0; b < ASI_PROFILE_BUCKETS; b++) {
+		count += __atomic_load_n(&command->BUCKETS[b], __ATOMIC_RELAXED);
+	}
+	return count;
+}
+
+/*
+ * Estimate the total time of all calls of a command, in nanoseconds, from
+ * the calls that were timed. Returns 0 if none were.
+ */
+uint64_t asi_profile_total(const struct ASI_PROFILE_COMMAND *command)
+{
+	uint64_t timed = profile_timed(command);
+
+	if (timed == 0) return 0;
+	return (double)__atomic_load_n(&command->SUM, __ATOMIC_RELAXED) / timed *
+	       __atomic_load_n(&command->COUNT, __ATOMIC_RELAXED);
+}
+
+/*
+ * Estimate the pct:th percentile of a command's call times, as the lower
+ * bound of the bucket it falls in. Returns 0 if there have been no calls.
+ */
+uint64_t asi_profile_percentile(const struct ASI_PROFILE_COMMAND *command, unsigned pct)
+{
+	uint64_t count = profile_timed(command), rank, seen = 0;
+	unsigned b;
+
+	if (count == 0) return 0;
+
+	rank = (count * pct + 99) / 100;
+	for (b = 0; b < ASI_PROFILE_BUCKETS; b++) {
+		seen += __atomic_load_n(&command->BUCKETS[b], __ATOMIC_RELAXED);
+		if (seen >= rank) break;
+	}
+	return asi_profile_bucket_ns(b < ASI_PROFILE_BUCKETS ? b : ASI_PROFILE_BUCKETS - 1);
+}
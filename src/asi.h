@@ -0,0 +1,66 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASI_H_
+#define ASI_H_
+
+#include "asm.h"
+
+/*
+ * Seqlock publication of ASM_INSTANCE slots
+ *
+ * Each writer thread makes its own SEQUENCE counter odd before it changes
+ * any of its fields and even again when it is done. A reader copies the
+ * slot and retries if any counter was odd or changed while it was copying.
+ * Writers never wait on readers or on each other.
+ */
+
+void asi_set_generation(uint32_t *generation, uint32_t *waiting);
+void asi_notify(uint32_t *generation, uint32_t *waiting);
+void asi_write_begin(struct ASM_INSTANCE *asi, enum asi_writer writer);
+void asi_write_end(struct ASM_INSTANCE *asi, enum asi_writer writer);
+
+int asi_read(const struct ASM_INSTANCE *asi, struct ASM_INSTANCE *copy);
+
+// Compatibility with the 16-bit ARMA_SERVER_INFO record
+void asi_legacy(const struct ASM_INSTANCE *asi, struct ARMA_SERVER_INFO *legacy);
+
+int asi_fields(const struct ASM_INSTANCE *asi, uint32_t mask, uint64_t *values);
+
+/*
+ * The rolling history has a single writer, the sampler thread. Readers
+ * only keep the samples that cannot have been overwritten while they
+ * were copying.
+ */
+struct ASI_HISTORY *asi_history(const struct ASM_SLOT *slot);
+void asi_history_reset(struct ASM_SLOT *slot, uint32_t interval);
+void asi_history_append(struct ASM_SLOT *slot, const struct ASI_SAMPLE *sample);
+int  asi_history_read(const struct ASM_SLOT *slot, struct ASI_SAMPLE *samples, uint32_t *interval);
+
+/*
+ * Extension call time histograms, written by the Arma server thread only
+ */
+void     asi_profile_count(struct ASI_PROFILE_COMMAND *command);
+void     asi_profile_record(struct ASI_PROFILE_COMMAND *command, uint64_t ns);
+uint64_t asi_profile_bucket_ns(unsigned bucket);
+uint64_t asi_profile_total(const struct ASI_PROFILE_COMMAND *command);
+uint64_t asi_profile_percentile(const struct ASI_PROFILE_COMMAND *command, unsigned pct);
+
+#endif /* ASI_H_ */
@@ -32,13 +32,12 @@
 #include "asm.h"
 #include "asmlog.h"
 #include "client.h"
+#include "rollup.h"
 #include "server.h"
 
 #define LOG_PREFIX_DEFAULT "ASMlog"
 
 char*  prog_name;
-char** args;
-int    argsc;
 
 char*  log_prefix;
 int    log_interval;
@@ -54,10 +53,26 @@ int    port = 24000;
 
 volatile sig_atomic_t running = 0;
 int    once = 1;  // Client: display stats once, not continuously. TODO: add option
+int    history = 0; // Client: show the rolling history instead of the current stats
+int    profile = 0; // Client: show the extension call times instead of the current stats
+int    stats = 0;   // Client: show the daemon's own counters instead of the current stats
+int    subscribe = -1; // Client: have the server push snapshots, at most one per this many ms
+int    delta_encoding = 0; // Client: have the server send delta-encoded snapshots
+char   broadcast_group[INET6_ADDRSTRLEN]; // Server: broadcast snapshots to, client: listen to
+int    broadcast_interval = ASM_BROADCAST_INTERVAL; // Server: ms between broadcasts
+int    metrics_port = 0; // Server: serve /metrics for Prometheus on this port, if set
+char   local_socket[PATH_MAX]; // Unix-domain socket to listen on or to connect to, if set
+int    map_shm = 0;         // Client: read the shared memory directly, over local_socket
+char  *upstreams[ASM_RELAY_MAX_UPSTREAMS]; // Server: relay the instances of these daemons
+int    upstream_count = 0;
+char   archive[PATH_MAX]; // Server: archive samples in this directory, client: query it, see -a
+int    resolution = 0;    // Client: show the rollups of this many seconds instead of the archive
+int    write_timeout = ASM_WRITE_TIMEOUT; // Server: seconds before a client that takes no output is dropped
+int    idle_timeout = 0;  // Server: seconds before a client that sends no requests is dropped, if set
 
 void usage(const char* prog_name)
 {
-	fprintf(stderr, "\nUsage: %s [-s|-c] [-n <max #clients>] [-h host] [-p port] [-l logfile] [-t <log interval>]\n", prog_name);
+	fprintf(stderr, "\nUsage: %s [-s|-c] [-n <max #clients>] [-h host] [-p port] [-l logfile] [-t <log interval>] [-H|-P|-S|-u <ms>] [-D] [-m group] [-M port] [-U socket [-z]] [-r host[:port] ...] [-a dir|n[:from[:to]] [-g s]] [-k n,n,n,n] [-w s] [-i s]\n", prog_name);
 }
 
 // Handle a few termination signals
@@ -92,6 +107,31 @@ void handle_signal(int s)
  *  -l      prefix for and activation of client-side logfile (default: ./asm.log)
  *  -t      interval for logging, in seconds (default: 1)
  *  -o      When running as a client, Which set of four instances shall be reported? range 0..3, (default: 0)
+ *  -H      (client) Show the rolling history of all active instances
+ *  -P      (client) Show how much time the extension spends in each command
+ *  -S      (client) Show the daemon's own counters
+ *  -u      (client) Have the server push snapshots as they change, at most one per <ms>
+ *          milliseconds (0: as often as the server looks for changes)
+ *  -D      (client) Have the server send only what changed since the previous snapshot
+ *  -m      (server) Also broadcast snapshots over UDP to a multicast or unicast address,
+ *          on the same port number, at most one per -u <ms> milliseconds (default: 1000)
+ *          (client) Show the snapshots broadcast to that address instead of connecting
+ *  -M      (server) Also serve /metrics for Prometheus, over HTTP on this port
+ *  -U      (server) Also listen on this Unix-domain socket, for local clients
+ *          (client) Connect to this Unix-domain socket instead of -h/-p
+ *  -z      (client, with -U) Map the shared memory and read the instances from it
+ *  -r      (server) Relay the instances of the daemon at host[:port] instead of the local
+ *          ones. Repeat for up to 64 daemons; their instance ids are set apart by 1024.
+ *  -a      (server) Archive a sample of every instance each second, in this directory
+ *          (client) Show the archived samples of server n, from ... to seconds since
+ *          the epoch, or relative to now if negative (default: the last hour)
+ *  -g      (client, with -a) Show the rollups of s seconds instead of the samples
+ *  -k      (server) Keep this many buckets of the 1 s, 10 s, 1 min and 1 h rollups
+ *          (default: 600,360,1440,168)
+ *  -w      (server) Disconnect a client that has taken none of its output for s seconds,
+ *          0 for never (default: 30)
+ *  -i      (server) Disconnect a client that has sent no request for s seconds, unless it
+ *          is subscribed (default: never)
  *
  *  -d      Enable debug-level log messages
  *  -y      (server) Run as a systemd service, logging to stdout
@@ -104,6 +144,7 @@ int main(int argc, char** argv)
 	int s_seen = 0;
 	int usage_error = 0;
 	int status = EXIT_SUCCESS;
+	int i;
 	struct sigaction sa;
 
 	if (argc > 0) {
@@ -112,11 +153,11 @@ int main(int argc, char** argv)
 		prog_name = strdup("armaservermonitor");
 	}
 
-	args  = argv;
-	argsc = argc;
-
-	while (usage_error == 0 && (option = getopt(argc, argv, "cdh:l::n:o:p:st:y")) != -1) {
+	while (usage_error == 0 && (option = getopt(argc, argv, "a:cdDg:h:Hi:k:l::m:M:n:o:p:Pr:sSt:u:U:w:yz")) != -1) {
 		switch (option) {
+			case 'a':
+				snprintf(archive, sizeof(archive), "%s", optarg);
+				break;
 			case 'c':
 				server = 0;
 				client = 1;
@@ -126,9 +167,77 @@ int main(int argc, char** argv)
 			case 'd':
 				asmlog_enable_debug();
 				break;
+			case 'g':
+				if (isdigit(*optarg)) {
+					resolution = atoi(optarg);
+				} else {
+					usage_error = 1;
+				}
+				break;
+			case 'i':
+				if (isdigit(*optarg)) {
+					idle_timeout = atoi(optarg);
+				} else {
+					usage_error = 1;
+				}
+				break;
+			case 'w':
+				if (isdigit(*optarg)) {
+					write_timeout = atoi(optarg);
+				} else {
+					usage_error = 1;
+				}
+				break;
+			case 'k':
+				if (asm_rollup_configure(optarg) != 0) {
+					usage_error = 1;
+				}
+				break;
 			case 'h':
 				snprintf(host, sizeof(host), "%s", optarg);
 				break;
+			case 'H':
+				history = 1;
+				break;
+			case 'P':
+				profile = 1;
+				break;
+			case 'S':
+				stats = 1;
+				break;
+			case 'D':
+				delta_encoding = 1;
+				break;
+			case 'u':
+				subscribe = atoi(optarg);
+				if (subscribe < 0) {
+					subscribe = 0;
+				}
+				broadcast_interval = subscribe;
+				break;
+			case 'm':
+				snprintf(broadcast_group, sizeof(broadcast_group), "%s", optarg);
+				break;
+			case 'M':
+				if (isdigit(*optarg)) {
+					metrics_port = atoi(optarg);
+				} else {
+					usage_error = 1;
+				}
+				break;
+			case 'r':
+				if (upstream_count < ASM_RELAY_MAX_UPSTREAMS) {
+					upstreams[upstream_count++] = strdup(optarg);
+				} else {
+					usage_error = 1;
+				}
+				break;
+			case 'U':
+				snprintf(local_socket, sizeof(local_socket), "%s", optarg);
+				break;
+			case 'z':
+				map_shm = 1;
+				break;
 			case 'l':
 				log_prefix = strdup(optarg);
 				if (log_interval == 0) log_interval = 1;
@@ -188,6 +297,10 @@ int main(int argc, char** argv)
 		}
 	}
 
+	if (map_shm && local_socket[0] == '\0') {
+		usage_error = 1;
+	}
+
 	if (usage_error == 1) {
 		usage(prog_name);
 		status = EXIT_FAILURE;
@@ -240,6 +353,9 @@ cleanup:
 
 	free(log_prefix);
 	free(prog_name);
+	for (i = 0; i < upstream_count; i++) {
+		free(upstreams[i]);
+	}
 
 	return status;
 }
@@ -31,11 +31,20 @@
 #define SMALSTRINGSIZE 32
 #define FUNCTIONSIZE 2048
 #define OUTPUTSIZE 4096
-#define PAGESIZE sysconf(_SC_PAGESIZE)
+// Number of instances in the legacy snapshot, and the initial number of slots
 #define MAX_ARMA_INSTANCES 16
-#define FILEMAPSIZE (size_t)(PAGESIZE * MAX_ARMA_INSTANCES)
 
+// An instance is considered dead if it has not reported for this long
+#define DEAD_TIMEOUT_NS (10 * 1000000000ULL)
 
+#define ASM_FOURCC(a, b, c, d) \
+	((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+/*
+ * The legacy ARMA_SERVER_INFO record, as sent to ArmaServerMonitor.exe
+ * by send_asi(). Only used on the wire; see struct ASM_INSTANCE for
+ * what is kept in shared memory.
+ */
 struct ARMA_SERVER_INFO
 {
 	uint16_t	PID;
@@ -57,4 +66,300 @@ struct ARMA_SERVER_INFO
 	char		PROFILE[SMALSTRINGSIZE];
 };
 
+// Size of one ARMA_SERVER_INFO record as serialized by send_asi()
+#define ASI_WIRE_SIZE 104
+
+
+/*
+ * Shared memory layout, version 3
+ *
+ * The region starts with an ASM_SHM_HEADER, followed by up to SLOT_COUNT
+ * slots of SLOT_STRIDE bytes each, starting at SLOT_OFFSET. Only the first
+ * CAPACITY slots are backed by the shared memory object; it grows by
+ * ASM_SLOT_GROWTH slots at a time when they are all in use. A slot is in
+ * use while its bit in OCCUPIED is set.
+ *
+ * Every slot begins on a cache line of its own, so instances never share
+ * one. asmdll.so may be a 32-bit build while armaservermonitor is 64-bit,
+ * so all 64-bit fields are explicitly 8-byte aligned and the layout is
+ * checked at compile time below.
+ */
+#define ASM_SHM_NAME     "/ASM_MapFile_v2"
+// The Arma servers and armaservermonitor must share the owner or the group.
+// Other local readers get a read-only descriptor from ASM_REQUEST_SHM_FD.
+#define ASM_SHM_MODE     (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
+#define ASM_SHM_MAGIC    ASM_FOURCC('A', 'S', 'M', 'S')
+#define ASM_SHM_VERSION  3
+#define ASM_CACHELINE    64
+#define ASM_MAX_SLOTS    1024
+#define ASM_SLOT_GROWTH  MAX_ARMA_INSTANCES
+#define ASM_SLOT_WORDS   (ASM_MAX_SLOTS / 32)
+
+typedef uint64_t asm_u64 __attribute__((aligned(8)));
+
+struct ASM_SHM_HEADER
+{
+	uint32_t	MAGIC;		// ASM_SHM_MAGIC, set last when the region is initialized
+	uint32_t	SCHEMA;		// ASM_SHM_VERSION
+	uint32_t	SLOT_COUNT;	// ASM_MAX_SLOTS
+	uint32_t	SLOT_STRIDE;
+	uint32_t	SLOT_OFFSET;
+	uint32_t	CAPACITY;	// slots backed by the object, only ever grows
+	uint32_t	GENERATION;	// bumped after every change to an instance or to OCCUPIED
+	uint32_t	WAITING;	// set by a reader in FUTEX_WAIT on GENERATION, see asi_notify()
+	// Occupancy bitmap, slot n is bit n % 32 of OCCUPIED[n / 32]
+	uint32_t	OCCUPIED[ASM_SLOT_WORDS] __attribute__((aligned(ASM_CACHELINE)));
+} __attribute__((aligned(ASM_CACHELINE)));
+
+// Threads in asmdll.so that update a slot. Each one owns a disjoint set of fields.
+enum asi_writer {
+	ASI_WRITER_GAME,    // RVExtension(), called from the Arma server
+	ASI_WRITER_SAMPLER, // the /proc sampler thread: MEM, DISC_*, CPU_LOAD, IO_*
+	ASI_WRITERS
+};
+
+// The current state of an instance
+struct ASM_INSTANCE
+{
+	uint32_t	PID;
+	uint32_t	OBJ_COUNT_0;
+	uint32_t	OBJ_COUNT_1;
+	uint32_t	OBJ_COUNT_2;
+	uint32_t	PLAYER_COUNT;
+	uint32_t	AI_LOC_COUNT;
+	uint32_t	AI_REM_COUNT;
+	uint32_t	SERVER_FPS;	// 1/1000 frames per second
+	uint32_t	SERVER_FPSMIN;	// 1/1000 frames per second
+	uint32_t	FSM_CE_FREQ;	// condition evaluations per second
+	uint32_t	CPU_LOAD;	// 1/100 percent of one CPU core
+	uint32_t	reserved;
+	asm_u64		MEM;		// bytes, resident set size
+	asm_u64		NET_RECV;	// bytes per second
+	asm_u64		NET_SEND;	// bytes per second
+	asm_u64		DISC_READ;	// bytes per second read from storage
+	asm_u64		DISC_WRITE;	// bytes per second written to storage
+	asm_u64		IO_READ;	// bytes read from storage since the process started
+	asm_u64		IO_WRITE;	// bytes written to storage since the process started
+	// Times are monotonic_ns(): CLOCK_MONOTONIC nanoseconds, accurate to a few ms
+	asm_u64		STARTED;	// "9:" init
+	asm_u64		UPDATED;	// last FPS update
+	char		MISSION[SMALSTRINGSIZE];
+	char		PROFILE[SMALSTRINGSIZE];
+	// Seqlock sequence numbers, one per writer thread.
+	// Odd while that writer is updating its fields.
+	uint32_t	SEQUENCE[ASI_WRITERS];
+};
+
+/*
+ * Rolling history of an instance.
+ *
+ * The sampler thread appends one sample every INTERVAL milliseconds.
+ * HEAD counts the samples written so far; sample n is stored in
+ * SAMPLES[n % ASI_HISTORY_SIZE].
+ */
+#define ASI_HISTORY_SIZE   180
+
+struct ASI_SAMPLE
+{
+	asm_u64		TIME;		// monotonic_ns(), see STARTED
+	uint32_t	SERVER_FPS;
+	uint32_t	SERVER_FPSMIN;
+	uint32_t	FSM_CE_FREQ;
+	uint32_t	PLAYER_COUNT;
+	uint32_t	AI_LOC_COUNT;
+	uint32_t	AI_REM_COUNT;
+	asm_u64		MEM;
+};
+
+struct ASI_HISTORY
+{
+	uint32_t	HEAD;
+	uint32_t	INTERVAL;
+	struct ASI_SAMPLE SAMPLES[ASI_HISTORY_SIZE];
+};
+
+/*
+ * Time spent in RVExtension() and RVExtensionArgs(), per command.
+ *
+ * Call times go into log-linear buckets, four per power of two: bucket
+ * b < 4 holds b nanoseconds, bucket b >= 4 starts at (4 + b % 4) << (b / 4 - 1)
+ * nanoseconds. Only one call in ASI_PROFILE_SAMPLE of each command is
+ * timed: COUNT counts every call, the buckets, SUM and MAX only the timed
+ * ones. Only the Arma server thread writes these, and readers take them
+ * as they are; a bucket may be one call ahead of COUNT.
+ */
+#define ASI_PROFILE_UPDATE   10	// RVExtensionArgs("update"), after the "0:" - "9:" commands
+#define ASI_PROFILE_COMMANDS 11
+#define ASI_PROFILE_BUCKETS  128
+#define ASI_PROFILE_SAMPLE   16
+
+struct ASI_PROFILE_COMMAND
+{
+	asm_u64		COUNT;
+	asm_u64		SUM;		// nanoseconds, timed calls
+	asm_u64		MAX;		// nanoseconds
+	uint32_t	BUCKETS[ASI_PROFILE_BUCKETS];
+};
+
+struct ASI_PROFILE
+{
+	asm_u64		OVER_BUDGET;	// timed calls that took longer than extensionbudget
+	asm_u64		SKIPPED;	// optional /proc reads skipped because of that
+	struct ASI_PROFILE_COMMAND COMMANDS[ASI_PROFILE_COMMANDS];
+};
+
+struct ASM_SLOT
+{
+	struct ASM_INSTANCE INFO __attribute__((aligned(ASM_CACHELINE)));
+	struct ASI_HISTORY HISTORY __attribute__((aligned(ASM_CACHELINE)));
+	struct ASI_PROFILE PROFILE __attribute__((aligned(ASM_CACHELINE)));
+} __attribute__((aligned(ASM_CACHELINE)));
+
+#define ASM_SLOT_STRIDE  sizeof(struct ASM_SLOT)
+#define ASM_SLOT_OFFSET  sizeof(struct ASM_SHM_HEADER)
+#define ASM_SHM_SIZE(slots) (size_t)(ASM_SLOT_OFFSET + (size_t)(slots) * ASM_SLOT_STRIDE)
+
+// The layout must be identical in 32-bit and 64-bit builds
+_Static_assert(sizeof(struct ASM_SHM_HEADER) == 192, "ASM_SHM_HEADER layout");
+_Static_assert(sizeof(struct ASM_INSTANCE) == 192, "ASM_INSTANCE layout");
+_Static_assert(sizeof(struct ASI_SAMPLE) == 40, "ASI_SAMPLE layout");
+_Static_assert(sizeof(struct ASI_PROFILE_COMMAND) == 536, "ASI_PROFILE_COMMAND layout");
+_Static_assert(sizeof(struct ASM_SLOT) == 13376, "ASM_SLOT layout");
+
+// Size of one sample as serialized in a history response
+#define ASI_SAMPLE_WIRE_SIZE 20
+// Size of one command as serialized in a profile response
+#define ASI_PROFILE_WIRE_SIZE 32
+
+/*
+ * Client requests. A request is a 32-bit little-endian word.
+ */
+
+// Snapshot of all instances, as used by ArmaServerMonitor.exe
+#define ASM_REQUEST_SNAPSHOT 0
+// Rolling history of all active instances
+#define ASM_REQUEST_HISTORY  ASM_FOURCC('H', 'I', 'S', 'T')
+// Extension call times of all active instances
+#define ASM_REQUEST_PROFILE  ASM_FOURCC('P', 'R', 'O', 'F')
+// Counters of the daemon itself
+#define ASM_REQUEST_STATS    ASM_FOURCC('S', 'T', 'A', 'T')
+// Push a snapshot whenever it changes. Followed by a 32-bit little-endian
+// interval: at most one push per interval milliseconds, 0 for every change.
+#define ASM_REQUEST_SUBSCRIBE ASM_FOURCC('S', 'U', 'B', 'S')
+
+// The shortest interval between pushes to a client, in milliseconds
+#define ASM_PUSH_MIN_INTERVAL 10
+// Seconds a client may leave its output untaken before it is disconnected
+#define ASM_WRITE_TIMEOUT     30
+// Send snapshots, pushed or not, delta-encoded (see delta.h). Followed by
+// a 32-bit little-endian keyframe interval in frames, 0 for the default.
+// Sending it again makes the next frame a keyframe.
+#define ASM_REQUEST_DELTA    ASM_FOURCC('D', 'L', 'T', 'A')
+#define ASM_DELTA_KEYFRAME_INTERVAL 60
+// Snapshot of all active instances in the extensible v2 format
+#define ASM_REQUEST_V2       ASM_FOURCC('A', 'S', 'M', '2')
+#define ASM_PROTOCOL_VERSION 2
+// A read-only descriptor of the shared memory object, to map it and read
+// the slots directly. Only on the Unix-domain socket, see -U. The reply is
+// a 32-bit length (4) and the 32-bit size to map, ASM_SHM_SIZE(ASM_MAX_SLOTS),
+// with the descriptor attached as SCM_RIGHTS.
+#define ASM_REQUEST_SHM_FD   ASM_FOURCC('S', 'H', 'M', 'F')
+// Samples of one instance from the archive, see -a and archive.h. Followed
+// by six 32-bit little-endian words: the instance id, a mask of the fields
+// (bit n for field n, see ASM_ARCHIVE_FIELDS), and the first and the last
+// time in ms since the epoch, 64 bits each, low word first. The reply is
+//
+//   uint32  number of bytes that follow
+//   uint32  mask of the fields in the reply
+//   uint32  number of samples, at most ASM_ARCHIVE_MAX_SAMPLES
+//   for each sample:
+//     uint64  time, ms since the epoch
+//     uint64  for each field in the mask, in field order, its value
+//
+// A full reply is continued by asking again from the last time + 1.
+#define ASM_REQUEST_ARCHIVE  ASM_FOURCC('A', 'R', 'C', 'H')
+#define ASM_ARCHIVE_MAX_SAMPLES 3600
+// Aggregates of one instance over buckets of a resolution, see rollup.h.
+// Followed by seven 32-bit little-endian words: the instance id, a mask
+// of the fields as for ASM_REQUEST_ARCHIVE, the resolution in seconds,
+// and the first and the last time as for ASM_REQUEST_ARCHIVE. The
+// buckets are made from the coarsest rollup tier whose resolution
+// divides the one asked for, and go back as far as that tier does.
+// The reply is
+//
+//   uint32  number of bytes that follow
+//   uint32  mask of the fields in the reply
+//   uint32  resolution, seconds
+//   uint32  number of buckets, at most ASM_ROLLUP_MAX_BUCKETS
+//   for each bucket, oldest first:
+//     uint64  start time, ms since the epoch
+//     uint64  number of samples
+//     for each field in the mask, in field order:
+//       uint64  minimum, maximum, sum and last value
+#define ASM_REQUEST_ROLLUP   ASM_FOURCC('R', 'O', 'L', 'L')
+#define ASM_ROLLUP_MAX_BUCKETS 1440
+
+/*
+ * The fields of an instance in a v2 snapshot. Numbers are 64-bit, rates
+ * are per second, times are nanoseconds on the daemon's CLOCK_MONOTONIC
+ * (read coarsely, so STARTED and UPDATED are accurate to a few ms).
+ * A field keeps its number forever; new fields get new numbers, and
+ * clients skip the fields they do not know.
+ */
+enum asm_field {
+	ASM_FIELD_PID           = 1,
+	ASM_FIELD_OBJ_COUNT_0   = 2,
+	ASM_FIELD_OBJ_COUNT_1   = 3,
+	ASM_FIELD_OBJ_COUNT_2   = 4,
+	ASM_FIELD_PLAYER_COUNT  = 5,
+	ASM_FIELD_AI_LOC_COUNT  = 6,
+	ASM_FIELD_AI_REM_COUNT  = 7,
+	ASM_FIELD_SERVER_FPS    = 8,  // 1/1000 frames per second
+	ASM_FIELD_SERVER_FPSMIN = 9,  // 1/1000 frames per second
+	ASM_FIELD_FSM_CE_FREQ   = 10,
+	ASM_FIELD_CPU_LOAD      = 11, // 1/100 percent of one CPU core
+	ASM_FIELD_MEM           = 12, // bytes
+	ASM_FIELD_NET_RECV      = 13, // bytes per second
+	ASM_FIELD_NET_SEND      = 14, // bytes per second
+	ASM_FIELD_DISC_READ     = 15, // bytes per second
+	ASM_FIELD_DISC_WRITE    = 16, // bytes per second
+	ASM_FIELD_IO_READ       = 17, // bytes
+	ASM_FIELD_IO_WRITE      = 18, // bytes
+	ASM_FIELD_STARTED       = 19, // ns
+	ASM_FIELD_UPDATED       = 20, // ns
+	ASM_FIELD_MISSION       = 21, // string
+	ASM_FIELD_PROFILE       = 22, // string
+	ASM_FIELD_HOST          = 23, // string, the upstream daemon, from a relay
+	ASM_FIELDS
+};
+
+// The fields kept in the archive: the numbers, but not STARTED and
+// UPDATED, which are on the daemon's monotonic clock
+#define ASM_ARCHIVE_FIELDS (((1u << (ASM_FIELD_IO_WRITE + 1)) - 1) & ~1u)
+
+/*
+ * A relay (-r) serves the instances of several upstream daemons. The
+ * instance id of a relayed instance is ASM_RELAY_ID(upstream, id), with
+ * upstream the position of the daemon on the relay's command line and
+ * id the instance id on that daemon.
+ */
+#define ASM_RELAY_MAX_UPSTREAMS 64
+#define ASM_RELAY_ID(upstream, id) ((upstream) * ASM_MAX_SLOTS + (id))
+
+/*
+ * Snapshots broadcast over UDP, see -m. Each datagram holds a whole
+ * snapshot, so a listener can start with any of them:
+ *
+ *   uint32  ASM_BROADCAST_MAGIC
+ *   uint32  sequence number, one more than in the previous datagram
+ *   uint32  snapshot serial number, as in a push
+ *   a delta keyframe, see delta.h
+ */
+#define ASM_BROADCAST_MAGIC    ASM_FOURCC('A', 'S', 'M', 'B')
+#define ASM_BROADCAST_HEADER   12
+// Milliseconds between broadcasts, unless set with -u
+#define ASM_BROADCAST_INTERVAL 1000
+// An unchanged snapshot is broadcast again after this many milliseconds
+#define ASM_BROADCAST_REPEAT   5000
+
 #endif /* ASM_H_ */
@@ -18,11 +18,10 @@
  * <http://www.gnu.org/licenses/>.
  */
 
-#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <glib.h>
-#include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,84 +35,57 @@
 #include <unistd.h>
 
 #include "asm.h"
+#include "asi.h"
 #include "asmlog.h"
 #include "settings.h"
 #include "asmdll.h"
 #include "gettickcount.h"
+#include "parse.h"
+#include "sampler.h"
+#include "shm.h"
 #include "util.h"
 
 static long pagesize;
-static int firstload = 0;
-static int FileMapHandle = -1;
-static void* FileMap;
+static struct asm_shm Shm = { -1, 0, NULL };
 static uint32_t InstanceID;
+static int sampling = 0;
+static int over_budget = 0;
+static uint32_t profile_calls[ASI_PROFILE_COMMANDS];
 
-static struct ARMA_SERVER_INFO *ArmaServerInfo = NULL;
-static struct stat filestat;
+static struct ASM_SLOT *ArmaSlot = NULL;
+static struct ASM_INSTANCE *ArmaServerInfo = NULL;
 static struct timespec T0;
 
 void __attribute ((constructor)) libasm_open(void)
 {
-	mode_t orig_umask;
 	char *debug = getenv("ASM_DEBUG");
 
 	if (debug && !strcmp(debug, "1")) {
 		asmlog_enable_debug();
 	}
 	asmlog_stdout("asmdll");
+	// Keep console I/O off the Arma server threads
+	asmlog_async();
 
 	asmlog_info(PACKAGE_STRING);
 
 	pagesize = sysconf(_SC_PAGESIZE);
 
-	orig_umask = umask(0);
-	FileMapHandle = shm_open("/ASM_MapFile", O_CREAT|O_RDWR, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
-	(void)umask(orig_umask);
-
-	if (FileMapHandle < 0) {
-		asmlog_error("Could not create shared memory object: %s", strerror(errno));
-		return;
-	}
-	memset(&filestat, 0, sizeof(filestat));
-	if (fstat(FileMapHandle, &filestat) != 0) {
-		asmlog_error("Could not fstat() the shared memory object: %s", strerror(errno));
-		shm_unlink("/ASM_MapFile");
-		close(FileMapHandle);
-		return;
-	}
-	if (filestat.st_size == 0) {
-		// First load of the extension - resize the shared memory for our needs
-		if (ftruncate(FileMapHandle, FILEMAPSIZE) != 0) {
-			asmlog_error("Could not set shared memory object size: %s", strerror(errno));
-			shm_unlink("/ASM_MapFile");
-			close(FileMapHandle);
-			return;
-		}
-		firstload = 1;
-	}
-
-	FileMap = mmap(NULL, FILEMAPSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, FileMapHandle, 0);
-	if (FileMap == MAP_FAILED) {
-		FileMap = NULL;
-		if (firstload == 1) {
-			shm_unlink("/ASM_MapFile");
-		}
-		close(FileMapHandle);
-		asmlog_error("Could not memory map the object: %s", strerror(errno));
+	if (asm_shm_open(&Shm) != 0) {
 		return;
 	}
-
-	if (firstload) {
-		asmlog_debug("first load - clearing shared memory area.");
-		memset(FileMap, 0, FILEMAPSIZE);
-	} else {
-		asmlog_debug("using existing shared memory area");
-	}
+	asi_set_generation(asm_shm_generation(&Shm), asm_shm_waiting(&Shm));
 
 	memset(&T0, 0, sizeof(T0));
 	clock_gettime(CLOCK_MONOTONIC, &T0);
 
 	read_settings(); // ASM.ini
+	cycles_calibrate(); // for timing the RVExtension() calls
+
+	// Collect /proc metrics in the background instead of on the Arma server thread
+	if (settings.samplingInterval > 0) {
+		sampling = sampler_start(settings.samplingInterval, 1000L * settings.historyInterval) == 0;
+	}
 
 	asmlog_debug("extension loaded");
 }
@@ -121,24 +93,123 @@ void __attribute ((constructor)) libasm_open(void)
 
 void __attribute ((destructor)) libasm_close(void)
 {
-	if (ArmaServerInfo != NULL) {
-		memset(ArmaServerInfo, 0, pagesize);
-		msync(ArmaServerInfo, pagesize, MS_ASYNC|MS_INVALIDATE);
+	if (sampling) {
+		sampler_stop();
+		sampling = 0;
 	}
-	if (FileMap != NULL) {
-		munmap(FileMap, FILEMAPSIZE);
-	}
-	if (FileMapHandle > -1) {
-		if (firstload == 1) {
-			shm_unlink("/ASM_MapFile");
-		}
-		close(FileMapHandle);
+	if (ArmaServerInfo != NULL) {
+		// A zero PID keeps other processes from taking over the slot
+		// as a dead one while it is being cleared
+		__atomic_store_n(&ArmaServerInfo->PID, 0, __ATOMIC_RELAXED);
+		asi_write_begin(ArmaServerInfo, ASI_WRITER_GAME);
+		memset(ArmaServerInfo, 0, offsetof(struct ASM_INSTANCE, SEQUENCE));
+		asi_write_end(ArmaServerInfo, ASI_WRITER_GAME);
+		asi_history_reset(ArmaSlot, 0);
+		memset(&ArmaSlot->PROFILE, 0, sizeof(ArmaSlot->PROFILE));
+		msync(ArmaSlot, sizeof(*ArmaSlot), MS_ASYNC|MS_INVALIDATE);
+		asm_shm_release(&Shm, InstanceID);
 	}
+	asi_set_generation(NULL, NULL);
+	asm_shm_close(&Shm);
 	asmlog_debug("extension unloaded");
 	asmlog_close();
 }
 
 
+/*
+ * Condition evaluations per second, from the number of conditions
+ * evaluated since the previous CPS update
+ */
+static unsigned cps_rate(unsigned conditionNo)
+{
+	struct timespec T1;
+	double tnsec;
+
+	memset(&T1, 0, sizeof(T1));
+	clock_gettime(CLOCK_MONOTONIC, &T1);
+	tnsec = (1e9 * (T1.tv_sec - T0.tv_sec) + (T1.tv_nsec - T0.tv_nsec)) / 1e9;
+	T0 = T1;
+
+	return conditionNo * 1000 / tnsec + 0.5;
+}
+
+/*
+ * Resident set size of the process, in bytes. Only used when the sampler
+ * thread is disabled.
+ */
+static uint64_t read_mem(void)
+{
+	FILE* f = NULL;
+	long rss = 0L;
+
+	// ASMdll.dll for Windows gets the "Commit Charge" value here,
+	// the total memory that the memory manager has committed
+	// for a running process. (unit: bytes)
+	if ((f = fopen("/proc/self/statm", "r")) != NULL) {
+		// The second number in statm is the size of the in-memory
+		// working set (RSS). TODO: is this the value we want?
+		if (fscanf(f, "%*s%8ld", &rss) != 1) {
+			rss = 0L;
+		}
+		fclose(f);
+	}
+	return (uint64_t)rss * pagesize;
+}
+
+/*
+ * Read MEM on the Arma server thread, unless the previous call went over
+ * the time budget. Returns 1 if mem was read.
+ */
+static int optional_read_mem(uint64_t *mem)
+{
+	if (over_budget) {
+		__atomic_fetch_add(&ArmaSlot->PROFILE.SKIPPED, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	*mem = read_mem();
+	return 1;
+}
+
+/*
+ * Start timing a call, if it is the one in every ASI_PROFILE_SAMPLE
+ * calls of the command that gets timed. Returns 0 if it does not.
+ */
+static uint64_t profile_start(unsigned command)
+{
+	if (profile_calls[command]++ % ASI_PROFILE_SAMPLE != 0) return 0;
+	return cycles();
+}
+
+/*
+ * Add a call that started at t0 to the profile of a command. A timed call
+ * is checked against extensionbudget: optional work on this thread is
+ * skipped after a timed call that went over the budget, until one comes
+ * in under it again.
+ */
+static void profile_call(unsigned command, uint64_t t0)
+{
+	uint64_t ns;
+	int over;
+
+	if (ArmaSlot == NULL) return;
+
+	if (t0 == 0) {
+		asi_profile_count(&ArmaSlot->PROFILE.COMMANDS[command]);
+		return;
+	}
+
+	ns = (cycles() - t0) * ns_per_cycle;
+	asi_profile_record(&ArmaSlot->PROFILE.COMMANDS[command], ns);
+
+	if (settings.extensionBudget > 0) {
+		over = ns > 1000ULL * settings.extensionBudget;
+		if (over) {
+			__atomic_fetch_add(&ArmaSlot->PROFILE.OVER_BUDGET, 1, __ATOMIC_RELAXED);
+		}
+		over_budget = over;
+	}
+}
+
 void RVExtensionVersion(char *output, int outputSize)
 {
 	if (output == NULL || outputSize <= 0) return;
@@ -147,20 +218,187 @@ void RVExtensionVersion(char *output, int outputSize)
 }
 
 
+/*
+ * Command handlers for RVExtension("<n>:<data>")
+ *
+ * data is the text after the colon. For commands with numeric fields,
+ * fields holds the already parsed and validated values.
+ */
+typedef void (*command_handler)(char *output, int outputSize, const char *data, const uint32_t *fields, int index);
+
+// FPS update, "ASMdll" callExtension format ["0:%1:%2", round (diag_fps*1000), round (diag_fpsmin*1000)]
+static void command_fps(char *output, int outputSize, const char *data, const uint32_t *fields, int index)
+{
+	(void)output; (void)outputSize; (void)data; (void)index;
+
+	if (ArmaServerInfo == NULL) return;
+
+	asi_write_begin(ArmaServerInfo, ASI_WRITER_GAME);
+	ArmaServerInfo->SERVER_FPS    = fields[0];
+	ArmaServerInfo->SERVER_FPSMIN = fields[1];
+	ArmaServerInfo->UPDATED       = monotonic_ns();
+	asi_write_end(ArmaServerInfo, ASI_WRITER_GAME);
+
+	asmlog_debug("0: FPS update");
+}
+
+// CPS update, "ASMdll" callExtension format ["1:%1", _c]
+static void command_cps(char *output, int outputSize, const char *data, const uint32_t *fields, int index)
+{
+	unsigned cps;
+
+	(void)output; (void)outputSize; (void)data; (void)index;
+
+	if (ArmaServerInfo == NULL) return;
+
+	cps = cps_rate(fields[0]);
+	asi_write_begin(ArmaServerInfo, ASI_WRITER_GAME);
+	ArmaServerInfo->FSM_CE_FREQ = cps;
+	asi_write_end(ArmaServerInfo, ASI_WRITER_GAME);
+
+	asmlog_debug("1: CPS update");
+}
+
+// GEN update, "ASMdll" callExtension format ["2:%1:%2:%3", _Players, _locAIs, _remAIs]
+static void command_gen(char *output, int outputSize, const char *data, const uint32_t *fields, int index)
+{
+	uint64_t mem = 0;
+	int have_mem = 0;
+
+	(void)output; (void)outputSize; (void)data; (void)index;
+
+	if (ArmaServerInfo == NULL) return;
+
+	// With the sampler thread running, MEM is updated by that thread.
+	if (!sampling) {
+		have_mem = optional_read_mem(&mem);
+	}
+	asi_write_begin(ArmaServerInfo, ASI_WRITER_GAME);
+	ArmaServerInfo->PLAYER_COUNT = fields[0];
+	ArmaServerInfo->AI_LOC_COUNT = fields[1];
+	ArmaServerInfo->AI_REM_COUNT = fields[2];
+	if (have_mem) {
+		ArmaServerInfo->MEM = mem;
+	}
+	asi_write_end(ArmaServerInfo, ASI_WRITER_GAME);
+
+	asmlog_debug("2: GEN update");
+}
+
+// MISSION update, "ASMdll" callExtension format ["3:%1", missionName]
+static void command_mission(char *output, int outputSize, const char *data, const uint32_t *fields, int index)
+{
+	(void)output; (void)outputSize; (void)fields; (void)index;
+
+	if (ArmaServerInfo == NULL) return;
+
+	asi_write_begin(ArmaServerInfo, ASI_WRITER_GAME);
+	copy_string(ArmaServerInfo->MISSION, data, SMALSTRINGSIZE);
+	asi_write_end(ArmaServerInfo, ASI_WRITER_GAME);
+
+	asmlog_debug("3: MISSION update");
+}
+
+// OBJ_COUNT_n update, "ASMdll" callExtension format ["4:%1", _oc0] (and 5, 6)
+static void command_obj_count(char *output, int outputSize, const char *data, const uint32_t *fields, int index)
+{
+	(void)output; (void)outputSize; (void)data;
+
+	if (ArmaServerInfo == NULL) return;
+
+	asi_write_begin(ArmaServerInfo, ASI_WRITER_GAME);
+	switch (index) {
+		case 0: ArmaServerInfo->OBJ_COUNT_0 = fields[0]; break;
+		case 1: ArmaServerInfo->OBJ_COUNT_1 = fields[0]; break;
+		case 2: ArmaServerInfo->OBJ_COUNT_2 = fields[0]; break;
+	}
+	asi_write_end(ArmaServerInfo, ASI_WRITER_GAME);
+
+	asmlog_debug("%d: OBJ_COUNT_%d update", 4 + index, index);
+}
+
+// init, "ASMdll" callExtension format ["9:%1", profileName]
+static void command_init(char *output, int outputSize, const char *data, const uint32_t *fields, int index)
+{
+	uint32_t prefix;
+
+	(void)fields; (void)index;
+
+	if (ArmaServerInfo != NULL) {
+		if (!sampling) {
+			asi_write_begin(ArmaServerInfo, ASI_WRITER_GAME);
+			ArmaServerInfo->MEM = 0;
+			asi_write_end(ArmaServerInfo, ASI_WRITER_GAME);
+		}
+		return;
+	}
+
+	if (settings.enableProfilePrefixSlotSelection > 0 && parse_prefix(data, SMALSTRINGSIZE, &prefix) > 0) {
+		asmlog_debug("selecting slot based on profileName...");
+		// Select the instance based on the leading digit in the server's profile name
+		InstanceID = prefix;
+		ArmaSlot = asm_shm_claim_id(&Shm, InstanceID);
+	} else {
+		asmlog_debug("finding available slot");
+		// Claim a free slot, or re-use one that hasn't been updated in the last 10 seconds
+		ArmaSlot = asm_shm_claim(&Shm, &InstanceID);
+	}
+	if (ArmaSlot != NULL) {
+		memset(&ArmaSlot->PROFILE, 0, sizeof(ArmaSlot->PROFILE));
+		ArmaServerInfo = &ArmaSlot->INFO;
+		asi_write_begin(ArmaServerInfo, ASI_WRITER_GAME);
+		ArmaServerInfo->MEM = 0;
+		ArmaServerInfo->STARTED = ArmaServerInfo->UPDATED = monotonic_ns();
+		ArmaServerInfo->PID = getpid();
+		copy_string(ArmaServerInfo->PROFILE, data, sizeof(ArmaServerInfo->PROFILE));
+		asi_write_end(ArmaServerInfo, ASI_WRITER_GAME);
+		if (sampling) {
+			sampler_attach(ArmaSlot);
+		}
+		snprintf(output, outputSize, "_ASM_OPT=[%s,%s,%s,\"%s\",\"%s\",\"%s\"];",
+				settings.OCI0, settings.OCI1, settings.OCI2,
+				settings.OCC0, settings.OCC1, settings.OCC2);
+	} else {
+		asmlog_error("init failed - no available slots.");
+		snprintf(output, outputSize, "_ASM_OPT=[0,0,0,\"\",\"\",\"\"];");
+	}
+	output[outputSize - 1] = '\0';
+}
+
+#define COMMAND_MAX_FIELDS 3
+
+// Jump table for the "<n>:<data>" commands, indexed by n
+static const struct command {
+	int fields;              // number of ':'-separated numeric fields, 0: data is a string
+	int index;               // passed on to the handler
+	command_handler handler;
+} commands[10] = {
+	{ 2, 0, command_fps       },
+	{ 1, 0, command_cps       },
+	{ 3, 0, command_gen       },
+	{ 0, 0, command_mission   },
+	{ 1, 0, command_obj_count },
+	{ 1, 1, command_obj_count },
+	{ 1, 2, command_obj_count },
+	{ 0, 0, NULL              }, // 7, 8 are not implemented
+	{ 0, 0, NULL              },
+	{ 0, 0, command_init      }
+};
+
 void RVExtension(char *output, int outputSize, const char *function)
 {
-	char *stopstring;
-	size_t funlen;
+	const struct command *command;
+	uint32_t fields[COMMAND_MAX_FIELDS];
+	uint64_t t0;
+	unsigned code;
 
 	if (output == NULL || outputSize <= 0 || function == NULL) return;
-	funlen = strnlen(function, FUNCTIONSIZE + 2);	// "<n>:<OCCx string>"
-	if (funlen == 0) return;
-	if (funlen == FUNCTIONSIZE + 2) return;
 
 	*output = '\0';
 
 	//asmlog_debug("RVExtension(%p, %d, \"%s\")", output, outputSize, function);
-	if (!isdigit(*function)) {
+	code = (unsigned char)function[0] - '0';
+	if (code > 9) {
 		do {
 			// Get version
 			if (strncasecmp(function, "version", sizeof("version")) == 0) {
@@ -175,173 +413,117 @@ void RVExtension(char *output, int outputSize, const char *function)
 		} while (0);
 		output[outputSize - 1] = '\0';
 		return;
-	} else {
-		// function is supposed to be <digit>:<data>
-		if (function[1] != ':' || funlen < 3) {
-			return;
-		}
 	}
 
-	if (!FileMap) {
-	   asmlog_error("no FileMap");
-	   return;
+	// function is supposed to be <digit>:<data>
+	if (function[1] != ':' || function[2] == '\0') {
+		return;
+	}
+
+	command = &commands[code];
+	if (command->handler == NULL) {
+		return;
 	}
 
-	switch (*function) {
-		case '0': // FPS update
-			if (ArmaServerInfo != NULL) {
-					unsigned FPS,FPSMIN;
+	if (Shm.map == NULL) {
+		asmlog_error("no shared memory");
+		return;
+	}
 
-					FPS = strtol(&function[2], &stopstring, 10);
-					FPSMIN = strtol(&stopstring[1], &stopstring, 10);
-					ArmaServerInfo->SERVER_FPS    =	FPS;
-					ArmaServerInfo->SERVER_FPSMIN =	FPSMIN;
-					ArmaServerInfo->TICK_COUNT    = gettickcount();
+	if (command->fields > 0 && parse_fields(&function[2], FUNCTIONSIZE, fields, command->fields) != 0) {
+		asmlog_debug("%c: malformed command", function[0]);
+		return;
+	}
 
-					asmlog_debug("0: FPS update");
-			}
-			break;
-
-		case '1': // CPS update
-			if (ArmaServerInfo != NULL) {
-					struct timespec T1;
-					double tnsec;
-					unsigned conditionNo;
-
-					memset(&T1, 0, sizeof(T1));
-					clock_gettime(CLOCK_MONOTONIC, &T1);
-					tnsec = (1e9 * (T1.tv_sec - T0.tv_sec) + (T1.tv_nsec - T0.tv_nsec)) / 1e9;
-					conditionNo = strtol(&function[2], &stopstring, 10);
-					ArmaServerInfo->FSM_CE_FREQ = floor(conditionNo * 1000 / tnsec + 0.5);
-
-					T0 = T1;
-					asmlog_debug("1: CPS update");
-			}
-			break;
-
-		case '2': // GEN update
-			if (ArmaServerInfo != NULL) {
-				unsigned players, ail, air;
-				FILE* f = NULL;
-				long rss = 0L;
-
-				players = strtol(&function[2],   &stopstring, 10);
-				ail		= strtol(&stopstring[1], &stopstring, 10);
-				air		= strtol(&stopstring[1], &stopstring, 10);
-				ArmaServerInfo->PLAYER_COUNT = players;
-				ArmaServerInfo->AI_LOC_COUNT = ail;
-				ArmaServerInfo->AI_REM_COUNT = air;
-
-				// ASMdll.dll for Windows gets the "Commit Charge" value here,
-				// the total memory that the memory manager has committed
-				// for a running process. (unit: bytes)
-				if ((f = fopen("/proc/self/statm", "r")) != NULL) {
-					// The second number in statm is the size of the in-memory
-					// working set (RSS). TODO: is this the value we want?
-					if (fscanf(f, "%*s%8ld", &rss) != 1) {
-						rss = 0L;
-					}
-					fclose(f);
-				}
-				ArmaServerInfo->MEM = rss * pagesize;
-				asmlog_debug("2: GEN update");
-			}
-			break;
-
-		case '3': // MISSION update
-			if (ArmaServerInfo != NULL) {
-				memset(ArmaServerInfo->MISSION, 0, SMALSTRINGSIZE);
-				strncpy(ArmaServerInfo->MISSION, &function[2], SMALSTRINGSIZE);
-				ArmaServerInfo->MISSION[SMALSTRINGSIZE-1] = 0;
-				asmlog_debug("3: MISSION update");
-			}
-			break;
-
-		case '4': // OBJ_COUNT_0 update
-			if (ArmaServerInfo != NULL) {
-				unsigned obj;
-				obj = strtol(&function[2], &stopstring, 10);
-				ArmaServerInfo->OBJ_COUNT_0 = obj;
-				asmlog_debug("4: OBJ_COUNT_0 update");
-			}
-			break;
-
-		case '5': // OBJ_COUNT_1 update
-			if (ArmaServerInfo != NULL) {
-				unsigned obj;
-				obj = strtol(&function[2], &stopstring, 10);
-				ArmaServerInfo->OBJ_COUNT_1 = obj;
-				asmlog_debug("5: OBJ_COUNT_1 update");
-			}
-			break;
-
-		case '6': // OBJ_COUNT_2 update
-			if (ArmaServerInfo != NULL) {
-				unsigned obj;
-				obj = strtol(&function[2], &stopstring, 10);
-				ArmaServerInfo->OBJ_COUNT_2 = obj;
-				asmlog_debug("6: OBJ_COUNT_2 update");
-			}
-			break;
-
-		case '9': // init
-			if (ArmaServerInfo == NULL) {
-				if (settings.enableProfilePrefixSlotSelection > 0 && isdigit(function[2])) {
-					asmlog_debug("selecting slot based on profileName...");
-					// Select the instance based on the leading digit in the server's profile name
-					errno = 0;
-					InstanceID = strtol(&function[2], &stopstring, 10);
-					if (errno == 0 && InstanceID < MAX_ARMA_INSTANCES) {
-						ArmaServerInfo = (struct ARMA_SERVER_INFO*)((unsigned char *)FileMap + (InstanceID * pagesize));
-					}
-				} else {
-					asmlog_debug("finding available slot");
-					// Find a free server info slot or re-use one if it hasn't been updated in the last 10 seconds
-					uint32_t DeadTimeout = gettickcount() - 10000;
-					for (InstanceID = 0 ; InstanceID < MAX_ARMA_INSTANCES ; InstanceID++) {
-						ArmaServerInfo = (struct ARMA_SERVER_INFO*)((unsigned char *)FileMap + (InstanceID * pagesize));
-						if ((ArmaServerInfo->PID == 0) || (ArmaServerInfo->TICK_COUNT < DeadTimeout)) break;
-					}
-				}
-				if (ArmaServerInfo != NULL && InstanceID < MAX_ARMA_INSTANCES) {
-					ArmaServerInfo->MEM = 0;
-					ArmaServerInfo->TICK_COUNT = gettickcount();
-					ArmaServerInfo->PID = getpid();
-					memset(ArmaServerInfo->PROFILE, 0, sizeof(ArmaServerInfo->PROFILE));
-					strncpy(ArmaServerInfo->PROFILE, &function[2], sizeof(ArmaServerInfo->PROFILE));
-					ArmaServerInfo->PROFILE[sizeof(ArmaServerInfo->PROFILE) - 1] = '\0';
-					snprintf(output, outputSize, "_ASM_OPT=[%s,%s,%s,\"%s\",\"%s\",\"%s\"];",
-							settings.OCI0, settings.OCI1, settings.OCI2,
-							settings.OCC0, settings.OCC1, settings.OCC2);
-				} else {
-					ArmaServerInfo = NULL;
-					asmlog_error("init failed - no available slots.");
-					snprintf(output, outputSize, "_ASM_OPT=[0,0,0,\"\",\"\",\"\"];");
-				}
-				output[outputSize - 1] = '\0';
-			} else {
-				ArmaServerInfo->MEM = 0;
-			}
-			break;
+	t0 = profile_start(code);
+	command->handler(output, outputSize, &function[2], fields, command->index);
+	profile_call(code, t0);
 
-		default: // 7,8 are not implemented
-			return;
-	}
-	if (ArmaServerInfo != NULL) {
-		if (msync(ArmaServerInfo, pagesize, MS_ASYNC|MS_INVALIDATE) != 0) {
-			asmlog_error("msync(): %s", strerror(errno));
-		}
-	}
-	return;
+	// No msync() here: the slot lives in a POSIX shared memory object, so the
+	// seqlock's release store is all it takes to publish the update to readers.
 }
 
-/* Not used by ASM.pbo */
+// Arguments of the batched "update" command, in order
+enum batch_arg {
+	BATCH_FPS,
+	BATCH_FPSMIN,
+	BATCH_CONDITIONS,
+	BATCH_PLAYERS,
+	BATCH_AI_LOCAL,
+	BATCH_AI_REMOTE,
+	BATCH_OBJ_COUNT_0,
+	BATCH_OBJ_COUNT_1,
+	BATCH_OBJ_COUNT_2,
+	BATCH_ARGS
+};
+
+// RVExtensionArgs() return codes
+#define ASM_ARGS_OK       0
+#define ASM_ARGS_INVALID -1
+#define ASM_ARGS_NO_SLOT -2
+
+/*
+ * Batched update of all the per-frame values in one call:
+ *
+ *   "ASMdll" callExtension ["update", [_fps, _fpsmin, _c, _Players, _locAIs, _remAIs]]
+ *   "ASMdll" callExtension ["update", [_fps, _fpsmin, _c, _Players, _locAIs, _remAIs, _oc0, _oc1, _oc2]]
+ *
+ * The values mean the same as in the "0:", "1:", "2:" and "4:" - "6:"
+ * commands, and are published as a single slot update. The object counts
+ * may be left out. Any other function is passed on to RVExtension().
+ */
 int RVExtensionArgs(char *output, int outputSize, const char *function, const char **args, int argsCnt)
 {
-	(void)args;
-	(void)argsCnt;
+	uint32_t values[BATCH_ARGS];
+	uint64_t t0, mem = 0;
+	int i, have_mem = 0;
+
+	if (output == NULL || outputSize <= 0 || function == NULL) return ASM_ARGS_INVALID;
+
+	if (strcasecmp(function, "update") != 0) {
+		RVExtension(output, outputSize, function);
+		return ASM_ARGS_OK;
+	}
+
+	*output = '\0';
 
-	RVExtension(output, outputSize, function);
+	if (args == NULL || (argsCnt != BATCH_OBJ_COUNT_0 && argsCnt != BATCH_ARGS)) {
+		return ASM_ARGS_INVALID;
+	}
+	for (i = 0; i < argsCnt; i++) {
+		if (parse_uint(args[i], &values[i]) != 0) {
+			return ASM_ARGS_INVALID;
+		}
+	}
+	if (ArmaServerInfo == NULL) {
+		return ASM_ARGS_NO_SLOT;
+	}
+	t0 = profile_start(ASI_PROFILE_UPDATE);
+
+	values[BATCH_CONDITIONS] = cps_rate(values[BATCH_CONDITIONS]);
+	if (!sampling) {
+		have_mem = optional_read_mem(&mem);
+	}
+
+	asi_write_begin(ArmaServerInfo, ASI_WRITER_GAME);
+	ArmaServerInfo->SERVER_FPS    = values[BATCH_FPS];
+	ArmaServerInfo->SERVER_FPSMIN = values[BATCH_FPSMIN];
+	ArmaServerInfo->FSM_CE_FREQ   = values[BATCH_CONDITIONS];
+	ArmaServerInfo->PLAYER_COUNT  = values[BATCH_PLAYERS];
+	ArmaServerInfo->AI_LOC_COUNT  = values[BATCH_AI_LOCAL];
+	ArmaServerInfo->AI_REM_COUNT  = values[BATCH_AI_REMOTE];
+	if (argsCnt == BATCH_ARGS) {
+		ArmaServerInfo->OBJ_COUNT_0 = values[BATCH_OBJ_COUNT_0];
+		ArmaServerInfo->OBJ_COUNT_1 = values[BATCH_OBJ_COUNT_1];
+		ArmaServerInfo->OBJ_COUNT_2 = values[BATCH_OBJ_COUNT_2];
+	}
+	if (have_mem) {
+		ArmaServerInfo->MEM = mem;
+	}
+	ArmaServerInfo->UPDATED       = monotonic_ns();
+	asi_write_end(ArmaServerInfo, ASI_WRITER_GAME);
 
-	return 0;
+	asmlog_debug("update: batched update");
+	profile_call(ASI_PROFILE_UPDATE, t0);
+	return ASM_ARGS_OK;
 }
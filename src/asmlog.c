@@ -23,10 +23,17 @@
 #else
 #include <syslog.h>
 #endif
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "asmlog.h"
@@ -66,6 +73,8 @@ logprefixname logprefixnames[] =
 
 int asmlog_level = LOG_INFO;
 
+static void asmlog_async_stop(void);
+
 static void asmlog_init(const char* name, int dest, int prefix)
 {
 	if (name) {
@@ -108,6 +117,7 @@ void asmlog_enable_debug(void)
 
 void asmlog_close(void)
 {
+	asmlog_async_stop();
 	if (logdest == ASM_LOGDEST_SYSLOG)
 	{
 		closelog();
@@ -175,51 +185,255 @@ static void asmlog(int level, const char* format, va_list ap)
 	va_end(apc);
 }
 
-void asmlog_critical(const char *format, ...)
+static void asmlog_write(int level, const char* format, ...)
 {
 	va_list ap;
 
 	va_start(ap, format);
-	asmlog(LOG_CRIT, format, ap);
+	asmlog(level, format, ap);
 	va_end(ap);
 }
-void asmlog_error(const char *format, ...)
+
+/*
+ * Asynchronous logging
+ *
+ * In asynchronous mode, messages are formatted by the calling thread into
+ * a bounded multi-producer, single-consumer ring, and written out by a
+ * background thread. Callers never block and never do I/O. When the ring
+ * is full the message is dropped and counted.
+ *
+ * Each entry has a sequence number: it equals the position when the entry
+ * is free for the producer that claims that position, and position + 1
+ * once the message is in place for the consumer.
+ *
+ * The background thread sleeps in FUTEX_WAIT on ring_wake, which every
+ * message increments, the same way as asi_notify(): only a producer that
+ * finds drain_waiting set makes the FUTEX_WAKE system call. While a call
+ * site has suppressed messages, the thread also wakes once a second to
+ * report them when their window has passed.
+ */
+#define ASMLOG_RING_SIZE   64	// power of two
+#define ASMLOG_RECORD_SIZE 256
+
+struct asmlog_record {
+	uint32_t seq;
+	int      level;
+	char     text[ASMLOG_RECORD_SIZE];
+};
+
+static struct asmlog_record ring[ASMLOG_RING_SIZE];
+static uint32_t ring_head;	// next position to claim, producers
+static uint32_t ring_tail;	// next position to write out, consumer
+static uint32_t ring_dropped;
+static uint32_t ring_wake;	// futex, incremented for every message
+static uint32_t drain_waiting;	// the consumer is, or is about to be, in FUTEX_WAIT
+static int      async_running = 0;
+static pthread_t async_thread;
+
+// Call sites that have suppressed messages at some point. Sites are never
+// removed, so the list only grows up to the number of sites that log errors.
+static struct asmlog_site *sites;
+
+static void ring_notify(void)
+{
+	__atomic_fetch_add(&ring_wake, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&drain_waiting, __ATOMIC_SEQ_CST) != 0 &&
+	    __atomic_exchange_n(&drain_waiting, 0, __ATOMIC_SEQ_CST) != 0) {
+		syscall(SYS_futex, &ring_wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+static int ring_put(int level, const char *format, va_list ap)
 {
-	va_list ap;
+	struct asmlog_record *record;
+	uint32_t pos, seq;
 
-	va_start(ap, format);
-	asmlog(LOG_ERR, format, ap);
-	va_end(ap);
+	pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	for (;;) {
+		record = &ring[pos & (ASMLOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+			// pos was reloaded
+		} else if ((int32_t)(seq - pos) < 0) {
+			// Full
+			__atomic_fetch_add(&ring_dropped, 1, __ATOMIC_RELAXED);
+			return 1;
+		} else {
+			pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	record->level = level;
+	vsnprintf(record->text, sizeof(record->text), format, ap);
+	__atomic_store_n(&record->seq, pos + 1, __ATOMIC_RELEASE);
+	ring_notify();
+	return 0;
 }
-void asmlog_warning(const char *format, ...)
+
+// Write out everything in the ring. Only called by the consumer.
+static void ring_drain(void)
 {
-	va_list ap;
+	struct asmlog_record *record;
+	uint32_t dropped;
 
-	va_start(ap, format);
-	asmlog(LOG_WARNING, format, ap);
-	va_end(ap);
+	for (;;) {
+		record = &ring[ring_tail & (ASMLOG_RING_SIZE - 1)];
+		if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != ring_tail + 1) break;
+
+		asmlog_write(record->level, "%s", record->text);
+		__atomic_store_n(&record->seq, ring_tail + ASMLOG_RING_SIZE, __ATOMIC_RELEASE);
+		ring_tail++;
+	}
+
+	if ((dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED)) != 0) {
+		asmlog_write(LOG_WARNING, "%u log messages dropped", dropped);
+	}
 }
-void asmlog_notice(const char *format, ...)
+
+static uint32_t seconds(void)
 {
-	va_list ap;
+	struct timespec ts;
 
-	va_start(ap, format);
-	asmlog(LOG_NOTICE, format, ap);
-	va_end(ap);
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
 }
-void asmlog_info(const char *format, ...)
+
+/*
+ * Start a new window for a call site if the current one has passed, or
+ * always if force is set. Returns the number of messages suppressed in
+ * the window that ended, or 0 if there was nothing to end.
+ */
+static uint32_t site_rollover(struct asmlog_site *site, uint32_t now, int force)
 {
-	va_list ap;
+	uint32_t window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
 
-	va_start(ap, format);
-	asmlog(LOG_INFO, format, ap);
-	va_end(ap);
+	if ((force || now - window >= ASMLOG_SITE_WINDOW) &&
+	    __atomic_compare_exchange_n(&site->window, &window, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+		return __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+	}
+	return 0;
 }
-void asmlog_debug(const char *format, ...)
+
+// Put a call site on the list, the first time it suppresses a message
+static void site_list(struct asmlog_site *site)
+{
+	struct asmlog_site *head;
+
+	if (__atomic_exchange_n(&site->listed, 1, __ATOMIC_RELAXED) != 0) return;
+
+	head = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+	do {
+		site->next = head;
+	} while (!__atomic_compare_exchange_n(&sites, &head, site, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Report the messages suppressed by call sites whose window has passed,
+ * or by all of them if force is set. Only called by the consumer. Returns
+ * 1 if some messages are still waiting for their window to pass.
+ */
+static int sites_drain(int force)
+{
+	struct asmlog_site *site;
+	uint32_t now = seconds(), suppressed;
+	int pending = 0;
+
+	for (site = __atomic_load_n(&sites, __ATOMIC_ACQUIRE); site != NULL; site = site->next) {
+		if (__atomic_load_n(&site->suppressed, __ATOMIC_RELAXED) == 0) continue;
+
+		if ((suppressed = site_rollover(site, now, force)) > 0) {
+			asmlog_write(LOG_WARNING, "%s:%d: %u similar messages suppressed",
+			             site->file, site->line, suppressed);
+		} else {
+			pending = 1;
+		}
+	}
+	return pending;
+}
+
+static void *asmlog_drain(void *arg)
+{
+	struct timespec second = { 1, 0 };
+	uint32_t from;
+	int running, pending;
+
+	(void)arg;
+	do {
+		from = __atomic_load_n(&ring_wake, __ATOMIC_SEQ_CST);
+		running = __atomic_load_n(&async_running, __ATOMIC_ACQUIRE);
+		ring_drain();
+		pending = sites_drain(!running);
+
+		if (running) {
+			__atomic_store_n(&drain_waiting, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&ring_wake, __ATOMIC_SEQ_CST) == from) {
+				syscall(SYS_futex, &ring_wake, FUTEX_WAIT, from, pending ? &second : NULL, NULL, 0);
+			}
+		}
+	} while (running);
+	return NULL;
+}
+
+// Hand messages to a background thread from now on, until asmlog_close()
+void asmlog_async(void)
+{
+	uint32_t i;
+
+	if (async_running || logdest == ASM_LOGDEST_CLOSED) return;
+
+	ring_head = ring_tail = ring_dropped = drain_waiting = 0;
+	for (i = 0; i < ASMLOG_RING_SIZE; i++) {
+		ring[i].seq = i;
+	}
+	__atomic_store_n(&async_running, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&async_thread, NULL, asmlog_drain, NULL) != 0) {
+		__atomic_store_n(&async_running, 0, __ATOMIC_RELEASE);
+	}
+}
+
+static void asmlog_async_stop(void)
+{
+	if (!async_running) return;
+
+	__atomic_store_n(&async_running, 0, __ATOMIC_RELEASE);
+	ring_notify();
+	pthread_join(async_thread, NULL);
+}
+
+/*
+ * Log a message from a call site, see ASMLOG(). Warnings and errors are
+ * rate limited per call site, unless site is NULL.
+ */
+void asmlog_message(struct asmlog_site *site, int level, const char* format, ...)
 {
 	va_list ap;
 
+	if (site != NULL && level <= LOG_WARNING) {
+		uint32_t suppressed = site_rollover(site, seconds(), 0);
+
+		if (suppressed > 0) {
+			asmlog_message(NULL, LOG_WARNING, "%s:%d: %u similar messages suppressed",
+			               site->file, site->line, suppressed);
+		}
+		if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > ASMLOG_SITE_BURST) {
+			if (__atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED) == 0) {
+				site_list(site);
+			}
+			return;
+		}
+	}
+
 	va_start(ap, format);
-	asmlog(LOG_DEBUG, format, ap);
+	if (__atomic_load_n(&async_running, __ATOMIC_ACQUIRE)) {
+		if (level <= asmlog_level || logdest == ASM_LOGDEST_SYSLOG) {
+			ring_put(level, format, ap);
+		}
+	} else {
+		asmlog(level, format, ap);
+	}
 	va_end(ap);
 }
@@ -20,6 +20,9 @@
 #ifndef ASMLOG_H_
 #define ASMLOG_H_
 
+#include <stdint.h>
+#include <syslog.h>
+
 extern int asmlog_level;
 
 void asmlog_console();
@@ -27,14 +30,52 @@ void asmlog_stdout(const char* name);
 void asmlog_systemd();
 void asmlog_syslog(const char* name);
 
+void asmlog_async(void);
 void asmlog_enable_debug(void);
 void asmlog_close(void);
 
-void asmlog_critical(const char* format, ...);
-void asmlog_error(const char* format, ...);
-void asmlog_warning(const char* format, ...);
-void asmlog_notice(const char* format, ...);
-void asmlog_info(const char* format, ...);
-void asmlog_debug(const char* format, ...);
+/*
+ * Every asmlog_warning(), asmlog_error() and asmlog_critical() call site
+ * has its own rate limit: after ASMLOG_SITE_BURST messages within
+ * ASMLOG_SITE_WINDOW seconds, further messages from that line are counted
+ * instead of logged, and the count is reported once the window has passed:
+ * by the background thread in asynchronous mode, otherwise by the next
+ * message from the same line.
+ */
+#define ASMLOG_SITE_BURST  5
+#define ASMLOG_SITE_WINDOW 10
+
+struct asmlog_site
+{
+	const char *file;
+	int         line;
+	uint32_t    window;     // start of the current window, seconds
+	uint32_t    count;      // messages in the current window
+	uint32_t    suppressed; // messages not logged in the current window
+	uint32_t    listed;     // on the list of sites that have suppressed messages
+	struct asmlog_site *next;
+};
+
+void asmlog_message(struct asmlog_site *site, int level, const char* format, ...)
+	__attribute__((format(printf, 3, 4)));
+
+#define ASMLOG(level, ...) do { \
+		static struct asmlog_site asmlog_site_ = { __FILE__, __LINE__, 0, 0, 0, 0, NULL }; \
+		asmlog_message(&asmlog_site_, (level), __VA_ARGS__); \
+	} while (0)
+
+#define asmlog_critical(...) ASMLOG(LOG_CRIT, __VA_ARGS__)
+#define asmlog_error(...)    ASMLOG(LOG_ERR, __VA_ARGS__)
+#define asmlog_warning(...)  ASMLOG(LOG_WARNING, __VA_ARGS__)
+#define asmlog_notice(...)   ASMLOG(LOG_NOTICE, __VA_ARGS__)
+#define asmlog_info(...)     ASMLOG(LOG_INFO, __VA_ARGS__)
+
+// Debug messages cost a single test unless enabled, and nothing in NDEBUG
+// builds ("configure --disable-debug"), where the arguments are only checked
+#ifdef NDEBUG
+#define asmlog_debug(...) do { if (0) asmlog_message(NULL, LOG_DEBUG, __VA_ARGS__); } while (0)
+#else
+#define asmlog_debug(...) do { if (asmlog_level >= LOG_DEBUG) ASMLOG(LOG_DEBUG, __VA_ARGS__); } while (0)
+#endif
 
 #endif /* ASMLOG_H_ */
@@ -22,25 +22,44 @@
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "asm.h"
 #include "asmlog.h"
 #include "config.h"
+#include "asi.h"
+#include "delta.h"
+#include "gettickcount.h"
+#include "shm.h"
 #include "util.h"
 
-#define BUFSIZE (MAX_ARMA_INSTANCES * sizeof(struct ARMA_SERVER_INFO))
+#define BUFSIZE (MAX_ARMA_INSTANCES * ASI_WIRE_SIZE)
+
+// How long to wait for an answer to the first v2 request before using v1
+#define V2_NEGOTIATE_MS 1000
 
 extern char host[];
 extern int port;
 extern int running;
 extern int once;
+extern int history;
+extern int profile;
+extern int stats;
+extern int subscribe;
+extern int delta_encoding;
+extern char broadcast_group[];
+extern char local_socket[];
+extern int map_shm;
+extern char archive[];
+extern int resolution;
 extern int log_interval;
 extern char* log_prefix;
 
@@ -50,20 +69,741 @@ FILE* log_file;
 char *log_filename;
 
 
-int asmclient(int instance_set)
+// Receive exactly len bytes
+static int recv_all(int server, unsigned char *buf, size_t len)
 {
-	int instance, count, server, rv;
-	char buf[BUFSIZE];
-	char* bp = NULL;
+	while (len > 0) {
+		ssize_t rv = recv(server, buf, len, 0);
+		if (rv == 0) return 1;
+		if (rv == -1) {
+			if (errno == EINTR && running) continue;
+			if (errno != EINTR) asmlog_error("asmclient: recv, %s", strerror(errno));
+			return 1;
+		}
+		buf += rv;
+		len -= rv;
+	}
+	return 0;
+}
+
+// Store a 32-bit word in the little-endian byte order of requests
+static void put_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+// Receive a length-prefixed response, see fetch()
+static unsigned char *receive_reply(int server, uint32_t *size)
+{
+	unsigned char len[4];
+	unsigned char *buf;
+
+	if (recv_all(server, len, sizeof(len)) != 0) {
+		return NULL;
+	}
+	*size = *((uint32_t *)len);
+	if (*size == 0) {
+		// See send_unavailable() in server.c
+		asmlog_error("asmclient: not available from this server, a relay?");
+		return NULL;
+	}
+	if (*size < 2 || (buf = malloc(*size)) == NULL) {
+		asmlog_error("asmclient: bad response (%u bytes)", *size);
+		return NULL;
+	}
+	if (recv_all(server, buf, *size) != 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/*
+ * Send a request, and receive a length-prefixed response into a buffer
+ * that the caller must free(). Returns NULL on failure.
+ */
+static unsigned char *fetch(int server, uint32_t request, uint32_t *size)
+{
+	unsigned char req[4];
+
+	put_u32(req, request);
+	if (send(server, req, sizeof(req), 0) != sizeof(req)) {
+		asmlog_error("asmclient: send, %s", strerror(errno));
+		return NULL;
+	}
+	return receive_reply(server, size);
+}
+
+
+// The names of the v2 fields, as shown
+static const char *field_names[ASM_FIELDS] = {
+	[ASM_FIELD_PID]           = "PID",
+	[ASM_FIELD_OBJ_COUNT_0]   = "OC0",
+	[ASM_FIELD_OBJ_COUNT_1]   = "OC1",
+	[ASM_FIELD_OBJ_COUNT_2]   = "OC2",
+	[ASM_FIELD_PLAYER_COUNT]  = "PLC",
+	[ASM_FIELD_AI_LOC_COUNT]  = "AIL",
+	[ASM_FIELD_AI_REM_COUNT]  = "AIR",
+	[ASM_FIELD_SERVER_FPS]    = "FPS",
+	[ASM_FIELD_SERVER_FPSMIN] = "MIN",
+	[ASM_FIELD_FSM_CE_FREQ]   = "CPS",
+	[ASM_FIELD_CPU_LOAD]      = "CPU",
+	[ASM_FIELD_MEM]           = "MEM",
+	[ASM_FIELD_NET_RECV]      = "NTI",
+	[ASM_FIELD_NET_SEND]      = "NTO",
+	[ASM_FIELD_DISC_READ]     = "DIR",
+	[ASM_FIELD_DISC_WRITE]    = "DIW",
+	[ASM_FIELD_IO_READ]       = "IOR",
+	[ASM_FIELD_IO_WRITE]      = "IOW",
+	[ASM_FIELD_STARTED]       = "STARTED",
+	[ASM_FIELD_UPDATED]       = "UPDATED",
+	[ASM_FIELD_MISSION]       = "MISSION",
+	[ASM_FIELD_PROFILE]       = "PROFILE",
+	[ASM_FIELD_HOST]          = "HOST",
+};
+
+/*
+ * Fetch and show the rolling history of all active instances.
+ * See send_history() in server.c for the format.
+ */
+static int show_history(int server)
+{
+	unsigned char *buf, *p, *end;
+	uint32_t size;
+	int count, instance, n, i;
+
+	if ((buf = fetch(server, ASM_REQUEST_HISTORY, &size)) == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	p = buf;
+	end = buf + size;
+	count = *((uint16_t *)p); p += 2;
+	asmlog_info("History for %d instances...", count);
+	while (count-- > 0 && p + 8 <= end) {
+		uint32_t interval, newest;
+
+		instance = *((uint16_t *)p); p += 2;
+		n        = *((uint16_t *)p); p += 2;
+		interval = *((uint32_t *)p); p += 4;
+		if (p + n * ASI_SAMPLE_WIRE_SIZE > end) break;
+
+		asmlog_info("============================ server %2d, %d samples, every %u s", instance + 1, n, interval / 1000);
+		asmlog_info("   AGE    FPS    MIN    CPS  PL#   AIL   AIR    MEM");
+		newest = n > 0 ? *((uint32_t *)(p + (n - 1) * ASI_SAMPLE_WIRE_SIZE)) : 0;
+		for (i = 0; i < n; i++, p += ASI_SAMPLE_WIRE_SIZE) {
+			asmlog_info("%5us %6.2f %6.2f %6u %4u %5u %5u %6u",
+				(newest - *((uint32_t *)p)) / 1000,
+				*((uint16_t *)(p + 4)) / 1000.0, *((uint16_t *)(p + 6)) / 1000.0,
+				*((uint16_t *)(p + 8)), *((uint16_t *)(p + 10)),
+				*((uint16_t *)(p + 12)), *((uint16_t *)(p + 14)),
+				*((uint32_t *)(p + 16)) / (1024*1024));
+		}
+	}
+
+	free(buf);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Fetch and show how much time the extension spends in each command.
+ * See send_profile() in server.c for the format.
+ */
+static int show_profile(int server)
+{
+	static const char *names[ASI_PROFILE_COMMANDS] = {
+		"0: FPS", "1: CPS", "2: GEN", "3: MISSION", "4: OC0", "5: OC1", "6: OC2",
+		"7", "8", "9: init", "update"
+	};
+	unsigned char *buf, *p, *end;
+	uint32_t size;
+	int count, instance, n, i;
+
+	if ((buf = fetch(server, ASM_REQUEST_PROFILE, &size)) == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	p = buf;
+	end = buf + size;
+	count = *((uint16_t *)p); p += 2;
+	asmlog_info("Extension call times for %d instances...", count);
+	while (count-- > 0 && p + 24 <= end) {
+		uint32_t fps;
+		uint64_t over, skipped;
+
+		instance = *((uint16_t *)p); p += 2;
+		n        = *((uint16_t *)p); p += 2;
+		fps      = *((uint32_t *)p); p += 4;
+		over     = *((uint64_t *)p); p += 8;
+		skipped  = *((uint64_t *)p); p += 8;
+		if (p + n * ASI_PROFILE_WIRE_SIZE > end) break;
+
+		asmlog_info("============================ server %2d, FPS %.2f, %llu calls over budget, %llu skipped",
+			instance + 1, fps / 1000.0, (unsigned long long)over, (unsigned long long)skipped);
+		asmlog_info("COMMAND          CALLS   AVG us   P50 us   P99 us   MAX us");
+		for (i = 0; i < n; i++, p += ASI_PROFILE_WIRE_SIZE) {
+			unsigned command = *((uint16_t *)p);
+			uint64_t calls   = *((uint64_t *)(p + 4));
+			uint64_t total   = *((uint64_t *)(p + 12));
+
+			asmlog_info("%-10s %11llu %8.2f %8.2f %8.2f %8.2f",
+				command < ASI_PROFILE_COMMANDS ? names[command] : "?",
+				(unsigned long long)calls, calls ? total / 1000.0 / calls : 0.0,
+				*((uint32_t *)(p + 24)) / 1000.0, *((uint32_t *)(p + 28)) / 1000.0,
+				*((uint32_t *)(p + 20)) / 1000.0);
+		}
+	}
+
+	free(buf);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Fetch and show the daemon's own counters.
+ * See send_stats() in server.c for the format.
+ */
+static int show_stats(int server)
+{
+	unsigned char *buf, *p, *end;
+	uint32_t size;
+	int count, len;
+
+	if ((buf = fetch(server, ASM_REQUEST_STATS, &size)) == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	p = buf;
+	end = buf + size;
+	count = *((uint16_t *)p); p += 2;
+	while (count-- > 0 && p < end) {
+		len = *p++;
+		if (p + len + 8 > end) break;
+		asmlog_info("%-20.*s %llu", len, (const char *)p, (unsigned long long)*((uint64_t *)(p + len)));
+		p += len + 8;
+	}
+
+	free(buf);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Fetch and show the archived samples of one instance, as asked for with
+ * -a n[:from[:to]], n being the number the instance is shown with, one
+ * more than its id. The times are seconds since the epoch, or relative
+ * to now if they are negative; the last hour by default. See
+ * send_archive() in server.c for the format.
+ */
+static int show_archive(int server)
+{
+	unsigned char req[28], *buf, *p;
+	char *s, line[512], when[32];
+	long long from = -3600, to = 0;
+	uint64_t first, last;
+	uint32_t size, mask = 0;
+	time_t now = time(NULL), t;
+	struct tm tm;
+	int id, count, fields, field, i, len, total = 0;
+
+	id = strtol(archive, &s, 10) - 1;
+	if (*s == ':') from = strtoll(s + 1, &s, 10);
+	if (*s == ':') to = strtoll(s + 1, &s, 10);
+	if (*s != '\0' || id < 0) {
+		asmlog_error("asmclient: -a %s, expected n[:from[:to]]", archive);
+		return EXIT_FAILURE;
+	}
+	first = (uint64_t)(from < 0 ? now + from : from) * 1000;
+	last  = (uint64_t)(to <= 0 ? now + to : to) * 1000 + 999;
+
+	do {
+		put_u32(req,      ASM_REQUEST_ARCHIVE);
+		put_u32(req + 4,  id);
+		put_u32(req + 8,  ASM_ARCHIVE_FIELDS);
+		put_u32(req + 12, first);
+		put_u32(req + 16, first >> 32);
+		put_u32(req + 20, last);
+		put_u32(req + 24, last >> 32);
+		if (send(server, req, sizeof(req), 0) != sizeof(req)) {
+			asmlog_error("asmclient: send, %s", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		if ((buf = receive_reply(server, &size)) == NULL) {
+			return EXIT_FAILURE;
+		}
+		count  = size >= 8 ? *((uint32_t *)(buf + 4)) : 0;
+		fields = size >= 8 ? __builtin_popcount(*((uint32_t *)buf)) : 0;
+		if (size < 8 || 8 + (uint64_t)count * (1 + fields) * 8 > size) {
+			asmlog_error("asmclient: bad archive reply (%u bytes)", size);
+			free(buf);
+			return EXIT_FAILURE;
+		}
+		if (total == 0) {
+			mask = *((uint32_t *)buf);
+			len = snprintf(line, sizeof(line), "%-19s", "TIME");
+			for (field = 0; field < ASM_FIELDS; field++) {
+				if (mask & (1u << field)) len += snprintf(line + len, sizeof(line) - len, " %10s", field_names[field]);
+			}
+			asmlog_info("Instance %d, %s", id + 1, line);
+		}
+		for (i = 0, p = buf + 8; i < count; i++) {
+			first = *((uint64_t *)p) + 1;
+			t = *((uint64_t *)p) / 1000; p += 8;
+			localtime_r(&t, &tm);
+			strftime(when, sizeof(when), "%F %T", &tm);
+			len = snprintf(line, sizeof(line), "%-19s", when);
+			for (field = 0; field < fields; field++, p += 8) {
+				len += snprintf(line + len, sizeof(line) - len, " %10llu", (unsigned long long)*((uint64_t *)p));
+			}
+			asmlog_info("Instance %d, %s", id + 1, line);
+		}
+		total += count;
+		free(buf);
+	} while (count == ASM_ARCHIVE_MAX_SAMPLES && first <= last);
+
+	asmlog_info("%d samples", total);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Fetch and show the rollups of one instance, with -a n[:from[:to]] -g s:
+ * for each bucket of s seconds, the number of samples and the minimum,
+ * average and maximum of each field. See send_rollup() in server.c for
+ * the format.
+ */
+static int show_rollup(int server)
+{
+	static const char *rows[] = { "min", "avg", "max" };
+	unsigned char req[32], *buf, *p;
+	char *s, line[512], when[32];
+	long long from = -3600, to = 0;
+	uint64_t first, last, samples, *agg;
+	uint32_t size, mask = 0, step = 0;
+	time_t now = time(NULL), t;
+	struct tm tm;
+	int id, count, fields, field, i, row, len, total = 0;
+
+	id = strtol(archive, &s, 10) - 1;
+	if (*s == ':') from = strtoll(s + 1, &s, 10);
+	if (*s == ':') to = strtoll(s + 1, &s, 10);
+	if (*s != '\0' || id < 0) {
+		asmlog_error("asmclient: -a %s, expected n[:from[:to]]", archive);
+		return EXIT_FAILURE;
+	}
+	first = (uint64_t)(from < 0 ? now + from : from) * 1000;
+	last  = (uint64_t)(to <= 0 ? now + to : to) * 1000 + 999;
+
+	do {
+		put_u32(req,      ASM_REQUEST_ROLLUP);
+		put_u32(req + 4,  id);
+		put_u32(req + 8,  ASM_ARCHIVE_FIELDS);
+		put_u32(req + 12, resolution);
+		put_u32(req + 16, first);
+		put_u32(req + 20, first >> 32);
+		put_u32(req + 24, last);
+		put_u32(req + 28, last >> 32);
+		if (send(server, req, sizeof(req), 0) != sizeof(req)) {
+			asmlog_error("asmclient: send, %s", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		if ((buf = receive_reply(server, &size)) == NULL) {
+			return EXIT_FAILURE;
+		}
+		count  = size >= 12 ? *((uint32_t *)(buf + 8)) : 0;
+		fields = size >= 12 ? __builtin_popcount(*((uint32_t *)buf)) : 0;
+		if (size < 12 || 12 + (uint64_t)count * (2 + 4 * fields) * 8 > size) {
+			asmlog_error("asmclient: bad rollup reply (%u bytes)", size);
+			free(buf);
+			return EXIT_FAILURE;
+		}
+		if (total == 0) {
+			mask = *((uint32_t *)buf);
+			step = *((uint32_t *)(buf + 4));
+			len = snprintf(line, sizeof(line), "%-19s %7s %3s", "TIME", "N", "");
+			for (field = 0; field < ASM_FIELDS; field++) {
+				if (mask & (1u << field)) len += snprintf(line + len, sizeof(line) - len, " %10s", field_names[field]);
+			}
+			asmlog_info("Instance %d, %u s, %s", id + 1, step, line);
+		}
+		for (i = 0, p = buf + 12; i < count; i++) {
+			first = *((uint64_t *)p) + 1;
+			t = *((uint64_t *)p) / 1000;
+			samples = *((uint64_t *)(p + 8));
+			agg = (uint64_t *)(p + 16);
+			localtime_r(&t, &tm);
+			strftime(when, sizeof(when), "%F %T", &tm);
+			for (row = 0; row < 3; row++) {
+				len = snprintf(line, sizeof(line), "%-19s %7llu %3s", row ? "" : when,
+					(unsigned long long)samples, rows[row]);
+				for (field = 0; field < fields; field++) {
+					len += snprintf(line + len, sizeof(line) - len, " %10llu", (unsigned long long)(
+						row == 0 ? agg[4 * field] :
+						row == 2 ? agg[4 * field + 1] :
+						samples ? agg[4 * field + 2] / samples : 0));
+				}
+				asmlog_info("Instance %d, %u s, %s", id + 1, step, line);
+			}
+			p += (2 + 4 * fields) * 8;
+		}
+		total += count;
+		free(buf);
+	} while (count == ASM_ROLLUP_MAX_BUCKETS && first <= last);
+
+	asmlog_info("%d buckets", total);
+	return EXIT_SUCCESS;
+}
+
+// TimeStamp|FPS|CPS|PL#|AIL|AIR|OC0|OC1|OC2
+// FIXME: separate log files for each instance
+static void log_instance(unsigned fps, unsigned cps, unsigned players, unsigned ail, unsigned air,
+                         unsigned oc0, unsigned oc1, unsigned oc2)
+{
+	time_t now;
+	struct tm *ts;
+	char timestamp[21];
+
+	if (log_file == NULL) return;
+
+	memset(timestamp, 0, sizeof(timestamp));
+	now = time(NULL);
+	ts = localtime(&now);
+	strftime(timestamp, sizeof(timestamp), "%T", ts);
+
+	fprintf(log_file, "%s|%u|%u|%u|%u|%u|%u|%u|%u\n",
+		timestamp, fps, cps, players, ail, air, oc0, oc1, oc2);
+}
+
+// Show a snapshot, unpacked into MAX_ARMA_INSTANCES full records
+static void show_snapshot(const char *buf, int instance_set)
+{
+	int instance, count;
+	const char* bp = NULL;
+	const struct ARMA_SERVER_INFO *asi = 0;
+
+	// Unless the -o option was used to pick which four servers should
+	// be displayed, show all of them.
+	count = instance_set == 0 ? MAX_ARMA_INSTANCES : 4;
+	if (instance_set == 0) {
+		bp = buf;
+	} else {
+		bp = buf + (4 * (instance_set - 1));
+	}
+	asmlog_info("Displaying stats for %d instances...", count);
+	for (instance = 0; instance < count; instance++) {
+		asi = (const struct ARMA_SERVER_INFO*)(bp + (instance * ASI_WIRE_SIZE));
+		asmlog_info("============================ server %2d", instance + 1);
+		asmlog_info("PID = %d", asi->PID);
+		asmlog_info("OC0 = %d", asi->OBJ_COUNT_0);
+		asmlog_info("OC1 = %d", asi->OBJ_COUNT_1);
+		asmlog_info("OC2 = %d", asi->OBJ_COUNT_2);
+		asmlog_info("PLC = %d", asi->PLAYER_COUNT);
+		asmlog_info("AIL = %d", asi->AI_LOC_COUNT);
+		asmlog_info("AIR = %d", asi->AI_REM_COUNT);
+		asmlog_info("FPS = %d", asi->SERVER_FPS);
+		asmlog_info("MIN = %d", asi->SERVER_FPSMIN);
+		asmlog_info("CPS = %d", asi->FSM_CE_FREQ);
+		asmlog_info("MEM = %u", asi->MEM / (1024*1024));
+		asmlog_info("NTI = %u", asi->NET_RECV);
+		asmlog_info("NTO = %u", asi->NET_SEND);
+		asmlog_info("DIR = %u", asi->DISC_READ);
+		asmlog_info("TICK = %u", asi->TICK_COUNT);
+		asmlog_info("MISSION = \"%s\"", asi->MISSION);
+		asmlog_info("PROFILE = \"%s\"", asi->PROFILE);
+
+		log_instance(asi->SERVER_FPS, asi->FSM_CE_FREQ,
+			asi->PLAYER_COUNT, asi->AI_LOC_COUNT, asi->AI_REM_COUNT,
+			asi->OBJ_COUNT_0, asi->OBJ_COUNT_1, asi->OBJ_COUNT_2);
+	}
+}
+
+/*
+ * Show a v2 snapshot, see send_v2() in server.c. Fields that this client
+ * does not know about are skipped.
+ */
+static void show_v2(const unsigned char *buf, uint32_t size)
+{
+	const unsigned char *p = buf, *end = buf + size, *record_end;
+	uint64_t values[ASM_FIELDS];
+	unsigned version, type, len;
+	int count, instance;
+
+	if (size < 12) return;
+	version = *((uint16_t *)p);
+	count   = *((uint16_t *)(p + 2));
+	p += 12;
+	asmlog_info("Displaying stats for %d instances (protocol v%u)...", count, version);
+	while (count-- > 0 && p + 4 <= end) {
+		instance   = *((uint16_t *)p);
+		record_end = p + 4 + *((uint16_t *)(p + 2));
+		p += 4;
+		if (record_end > end) break;
+
+		memset(values, 0, sizeof(values));
+		asmlog_info("============================ server %2d", instance + 1);
+		while (p + 4 <= record_end) {
+			type = *((uint16_t *)p);
+			len  = *((uint16_t *)(p + 2));
+			p += 4;
+			if (p + len > record_end) break;
+			if (type < ASM_FIELDS && field_names[type] != NULL) {
+				if (type == ASM_FIELD_MISSION || type == ASM_FIELD_PROFILE || type == ASM_FIELD_HOST) {
+					asmlog_info("%s = \"%.*s\"", field_names[type], (int)len, (const char *)p);
+				} else if (len == sizeof(uint64_t)) {
+					values[type] = *((uint64_t *)p);
+					asmlog_info("%s = %llu", field_names[type], (unsigned long long)values[type]);
+				}
+			}
+			p += len;
+		}
+		p = record_end;
+
+		log_instance(values[ASM_FIELD_SERVER_FPS], values[ASM_FIELD_FSM_CE_FREQ],
+			values[ASM_FIELD_PLAYER_COUNT], values[ASM_FIELD_AI_LOC_COUNT], values[ASM_FIELD_AI_REM_COUNT],
+			values[ASM_FIELD_OBJ_COUNT_0], values[ASM_FIELD_OBJ_COUNT_1], values[ASM_FIELD_OBJ_COUNT_2]);
+	}
+}
+
+/*
+ * Ask for and show a v2 snapshot. With timeout_ms >= 0, give up if the
+ * server has not started to answer by then.
+ *
+ * Returns 0 on success, 1 if the server did not answer, -1 on failure.
+ */
+static int request_v2(int server, int timeout_ms)
+{
+	unsigned char req[4], *buf;
+	struct pollfd pfd;
+	uint32_t size;
+	int rv;
+
+	put_u32(req, ASM_REQUEST_V2);
+	if (send(server, req, sizeof(req), 0) != sizeof(req)) {
+		asmlog_error("asmclient: send, %s", strerror(errno));
+		return -1;
+	}
+	if (timeout_ms >= 0) {
+		pfd.fd     = server;
+		pfd.events = POLLIN;
+		while ((rv = poll(&pfd, 1, timeout_ms)) == -1 && errno == EINTR && running);
+		if (rv == 0) return 1;
+		if (rv == -1) return -1;
+	}
+	if ((buf = receive_reply(server, &size)) == NULL) {
+		return -1;
+	}
+	show_v2(buf, size);
+	free(buf);
+	return 0;
+}
+
+/*
+ * Send a request that takes an argument, such as ASM_REQUEST_SUBSCRIBE
+ */
+static int send_request(int server, uint32_t request, uint32_t argument)
+{
+	unsigned char req[8];
+
+	put_u32(req, request);
+	put_u32(req + 4, argument);
+	if (send(server, req, sizeof(req), 0) != sizeof(req)) {
+		asmlog_error("asmclient: send, %s", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Receive a framed snapshot, see push_snapshot() and send_delta() in
+ * server.c, and unpack it into buf. A delta frame is applied to the
+ * previous snapshot kept in *delta, or NULL if delta-encoding is off.
+ *
+ * Returns 0 on success, 1 if a delta frame could not be applied (a
+ * keyframe has been asked for), or -1 if the connection failed.
+ */
+static int receive_frame(int server, char *buf, struct asm_delta *delta)
+{
+	unsigned char header[8], frame[ASM_DELTA_MAX_SIZE];
+	uint32_t size;
+
+	if (recv_all(server, header, sizeof(header)) != 0) {
+		return -1;
+	}
+	size = *((uint32_t *)header) - 4;
+	if (size > sizeof(frame)) {
+		asmlog_error("asmclient: bad frame (%u bytes)", size);
+		return -1;
+	}
+	asmlog_debug("Snapshot %u, %u bytes", *((uint32_t *)(header + 4)), size);
+	if (recv_all(server, frame, size) != 0) {
+		return -1;
+	}
+	if (delta == NULL) {
+		asm_snapshot_expand(frame, size, (unsigned char *)buf);
+		return 0;
+	}
+	if (asm_delta_decode(delta, frame, size) != 0) {
+		asmlog_warning("asmclient: bad delta frame, resyncing");
+		return send_request(server, ASM_REQUEST_DELTA, 0) != 0 ? -1 : 1;
+	}
+	memcpy(buf, delta->records, BUFSIZE);
+	return 0;
+}
+
+// Open the client-side log file, if logging was asked for
+static int open_log(void)
+{
+	size_t log_filename_len;
+
+	if (log_interval <= 0) return 0;
+
+	log_filename_len = strlen(log_prefix) + strlen(".log") + 1;
+	log_filename = calloc(log_filename_len, 1);
+	snprintf(log_filename, log_filename_len, "%s.log", log_prefix);
+	log_file = fopen(log_filename, "a+");
+	if (log_file == NULL) {
+		perror("Could not open log file");
+		return 1;
+	}
+	return 0;
+}
+
+static void close_log(void)
+{
+	if (log_file) {
+		(void)fclose(log_file);
+	}
+	if (log_filename) {
+		free(log_filename);
+	}
+}
+
+/*
+ * Join the group, or bind to the unicast address, that the server
+ * broadcasts snapshots to. Returns the socket, or -1.
+ */
+static int join_broadcast(void)
+{
+	char portnum[6];
+	struct addrinfo hints;
+	struct addrinfo *address_list, *p;
+	int fd = -1, yes = 1, rv;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	snprintf(portnum, sizeof(portnum), "%d", port);
+
+	if ((rv = getaddrinfo(broadcast_group, portnum, &hints, &address_list)) != 0) {
+		asmlog_error("asmclient: getaddrinfo %s, %s", broadcast_group, gai_strerror(rv));
+		return -1;
+	}
+	for (p = address_list; p != NULL; p = p->ai_next) {
+		if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+			continue;
+		}
+		// Several listeners on one host can share a multicast group
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		if (bind(fd, p->ai_addr, p->ai_addrlen) == 0) {
+			rv = 0;
+			if (p->ai_family == AF_INET) {
+				struct ip_mreqn mreq;
+				memset(&mreq, 0, sizeof(mreq));
+				mreq.imr_multiaddr = ((struct sockaddr_in *)p->ai_addr)->sin_addr;
+				if (IN_MULTICAST(ntohl(mreq.imr_multiaddr.s_addr))) {
+					rv = setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+				}
+			} else if (p->ai_family == AF_INET6) {
+				struct ipv6_mreq mreq;
+				memset(&mreq, 0, sizeof(mreq));
+				mreq.ipv6mr_multiaddr = ((struct sockaddr_in6 *)p->ai_addr)->sin6_addr;
+				if (IN6_IS_ADDR_MULTICAST(&mreq.ipv6mr_multiaddr)) {
+					rv = setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq));
+				}
+			}
+			if (rv == 0) break;
+		}
+		asmlog_error("asmclient: cannot listen to %s:%d, %s", broadcast_group, port, strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(address_list);
+	return fd;
+}
+
+/*
+ * Show the snapshots that the server broadcasts, see ASM_BROADCAST_MAGIC,
+ * until interrupted. Gaps in the sequence numbers are reported as lost
+ * datagrams.
+ */
+static int listen_broadcast(int instance_set)
+{
+	unsigned char datagram[ASM_BROADCAST_HEADER + ASM_DELTA_MAX_SIZE];
+	struct asm_delta delta;
+	uint32_t sequence = 0, gap;
+	uint64_t received = 0, lost = 0;
+	ssize_t len;
+	int fd;
+
+	asmlog_info("Listening to %s:%d", broadcast_group, port);
+	if ((fd = join_broadcast()) == -1) {
+		return EXIT_FAILURE;
+	}
+	if (open_log() != 0) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	running = 1;
+	while (running) {
+		len = recv(fd, datagram, sizeof(datagram), 0);
+		if (len == -1) {
+			if (errno != EINTR) {
+				asmlog_error("asmclient: recv, %s", strerror(errno));
+				running = 0;
+			}
+			continue;
+		}
+		if (len < ASM_BROADCAST_HEADER || *((uint32_t *)datagram) != ASM_BROADCAST_MAGIC) {
+			asmlog_debug("Ignoring a %zd byte datagram", len);
+			continue;
+		}
+
+		gap = *((uint32_t *)(datagram + 4)) - sequence - 1;
+		if (received > 0 && gap != 0) {
+			if (gap < UINT32_MAX / 2) {
+				lost += gap;
+				asmlog_warning("Lost %u datagrams, %llu of %llu so far", gap,
+						(unsigned long long)lost, (unsigned long long)(received + lost + 1));
+			} else {
+				// Late or duplicated, or the server restarted
+				asmlog_info("Sequence number went from %u to %u", sequence, *((uint32_t *)(datagram + 4)));
+			}
+		}
+		sequence = *((uint32_t *)(datagram + 4));
+		received++;
+
+		asm_delta_init(&delta);
+		if (asm_delta_decode(&delta, datagram + ASM_BROADCAST_HEADER, len - ASM_BROADCAST_HEADER) != 0) {
+			asmlog_warning("asmclient: bad datagram %u", sequence);
+			continue;
+		}
+		asmlog_debug("Datagram %u, snapshot %u, %zd bytes", sequence, *((uint32_t *)(datagram + 8)), len);
+		show_snapshot((const char *)delta.records, instance_set);
+	}
+
+	asmlog_info("Received %llu datagrams, lost %llu",
+			(unsigned long long)received, (unsigned long long)lost);
+	close(fd);
+	close_log();
+	return EXIT_SUCCESS;
+}
+
+// Connect to the server at host:port. Returns the socket, or -1.
+static int connect_tcp(void)
+{
+	int server = -1, rv;
 	struct addrinfo hints;
 	struct addrinfo *serverinfo = NULL, *p = NULL;
 	char portnum[6] = {0, 0, 0, 0, 0, 0}, s[INET6_ADDRSTRLEN];
-	char request[4] = {0, 0, 0, 0};
-	struct ARMA_SERVER_INFO *asi = 0;
-
-	asmlog_info(PACKAGE_STRING);
 
-	memset(buf, 0, sizeof(buf));
 	memset(&hints, 0, sizeof(hints));
 	memset(s, 0, sizeof(s));
 
@@ -76,7 +816,7 @@ int asmclient(int instance_set)
 
 	if ((rv = getaddrinfo(host, portnum, &hints, &serverinfo)) !=0 ) {
 		asmlog_error("asmclient: getaddrinfo, %s", gai_strerror(errno));
-		return EXIT_FAILURE;
+		return -1;
 	}
 
 	for (p = serverinfo; p != NULL; p = p->ai_next) {
@@ -98,104 +838,252 @@ int asmclient(int instance_set)
 	if (p == NULL) {
 		asmlog_error("Could not connect to %s:%d", host, port);
 		freeaddrinfo(serverinfo);
-		return EXIT_FAILURE;
+		return -1;
 	}
 
 	inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr), s, sizeof(s));
 
 	freeaddrinfo(serverinfo);
+	return server;
+}
 
-	if (log_interval > 0) {
-		size_t log_filename_len = strlen(log_prefix) + strlen(".log") + 1;
-		log_filename = calloc(log_filename_len, 1);
-		snprintf(log_filename, log_filename_len, "%s.log", log_prefix);
-		log_file = fopen(log_filename, "a+");
-		if (log_file == NULL) {
-			perror("Could not open log file");
-			return EXIT_FAILURE;
+// Connect to the server's Unix-domain socket. Returns the socket, or -1.
+static int connect_local(void)
+{
+	struct sockaddr_un addr;
+	int server;
+
+	asmlog_info("Connecting to %s", local_socket);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", local_socket);
+	if ((server = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		asmlog_error("asmclient: socket, %s", strerror(errno));
+		return -1;
+	}
+	if (connect(server, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		asmlog_error("Could not connect to %s, %s", local_socket, strerror(errno));
+		close(server);
+		return -1;
+	}
+	return server;
+}
+
+/*
+ * Get a read-only descriptor of the shared memory from the server, see
+ * ASM_REQUEST_SHM_FD. Returns the descriptor, or -1.
+ */
+static int receive_shm_fd(int server)
+{
+	unsigned char req[4], reply[8];
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { reply, sizeof(reply) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int fd = -1;
+
+	put_u32(req, ASM_REQUEST_SHM_FD);
+	if (send(server, req, sizeof(req), 0) != sizeof(req)) {
+		asmlog_error("asmclient: send, %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(server, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != sizeof(reply)) {
+		asmlog_error("asmclient: the server did not send the shared memory");
+		return -1;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
 		}
 	}
+	if (fd == -1) {
+		asmlog_error("asmclient: no descriptor in the reply");
+	}
+	return fd;
+}
+
+/*
+ * Show the instances straight from the shared memory, mapped read-only.
+ * The records are put together the way the server does for a snapshot.
+ */
+static int show_mapped(int server, int instance_set)
+{
+	struct asm_shm shm;
+	struct ASM_INSTANCE slot;
+	char records[BUFSIZE];
+	uint64_t now;
+	int fd, id;
+
+	if ((fd = receive_shm_fd(server)) == -1 || asm_shm_attach(&shm, fd) != 0) {
+		return EXIT_FAILURE;
+	}
+	if (open_log() != 0) {
+		asm_shm_close(&shm);
+		return EXIT_FAILURE;
+	}
 
 	running = 1;
 	while (running) {
-		// Send four-byte zero reqest
-		int remaining = (int)sizeof(request);
-		do {
-			rv = send(server, (void *)request, remaining, 0);
-			if (rv == -1) {
-				if (errno != EINTR) {
-					asmlog_error("asmclient: send, %s", strerror(errno));
-				}
-				break;
+		memset(records, 0, sizeof(records));
+		now = monotonic_ns();
+		for (id = asm_shm_next(&shm, 0); id >= 0 && id < MAX_ARMA_INSTANCES; id = asm_shm_next(&shm, id + 1)) {
+			if (asi_read(&asm_shm_slot(&shm, id)->INFO, &slot) == 0 &&
+			    slot.PID != 0 && slot.UPDATED + DEAD_TIMEOUT_NS >= now) {
+				asi_legacy(&slot, (struct ARMA_SERVER_INFO *)(records + id * ASI_WIRE_SIZE));
 			}
-			remaining -= rv;
-		} while (remaining > 0);
+		}
+		asmlog_debug("Generation %u", __atomic_load_n(asm_shm_generation(&shm), __ATOMIC_ACQUIRE));
+		show_snapshot(records, instance_set);
 
+		if (once != 0) {
+			running = 0;
+		} else {
+			(void)sleep(update_interval);
+		}
+	}
+
+	asm_shm_close(&shm);
+	close_log();
+	return EXIT_SUCCESS;
+}
+
+int asmclient(int instance_set)
+{
+	int server, rv;
+	char buf[BUFSIZE];
+	unsigned char snapshot[BUFSIZE];
+	struct asm_delta delta;
+	// Snapshots in v2 when the server knows it; pushes and deltas are v1
+	int version = subscribe < 0 && !delta_encoding ? ASM_PROTOCOL_VERSION : 1;
+	int negotiated = 0;
+	char request[4] = {0, 0, 0, 0};
+
+	asmlog_info(PACKAGE_STRING);
 
-		// Receive ASI stats
-		rv = recv(server, buf, BUFSIZE, 0);
-		if (rv == 0) {
-			// Server closed the connection
+	if (broadcast_group[0] != '\0') {
+		return listen_broadcast(instance_set);
+	}
+
+	memset(buf, 0, sizeof(buf));
+
+	server = local_socket[0] != '\0' ? connect_local() : connect_tcp();
+	if (server == -1) {
+		return EXIT_FAILURE;
+	}
+
+	if (map_shm) {
+		rv = show_mapped(server, instance_set);
+		close(server);
+		return rv;
+	}
+
+	if (history) {
+		rv = show_history(server);
+		close(server);
+		return rv;
+	}
+	if (profile) {
+		rv = show_profile(server);
+		close(server);
+		return rv;
+	}
+	if (stats) {
+		rv = show_stats(server);
+		close(server);
+		return rv;
+	}
+	if (archive[0] != '\0') {
+		rv = resolution > 0 ? show_rollup(server) : show_archive(server);
+		close(server);
+		return rv;
+	}
+
+	if (open_log() != 0) {
+		return EXIT_FAILURE;
+	}
+
+	running = 1;
+	if (delta_encoding) {
+		asm_delta_init(&delta);
+		if (send_request(server, ASM_REQUEST_DELTA, 0) != 0) {
 			running = 0;
-			continue;
 		}
-		if (rv == -1) {
-			if (errno != EINTR) {
-				asmlog_error("asmclient: recv, %s", strerror(errno));
-			}
-			continue;
+	}
+	if (running && subscribe >= 0 && send_request(server, ASM_REQUEST_SUBSCRIBE, subscribe) != 0) {
+		running = 0;
+	}
+	while (running && subscribe >= 0) {
+		// Show each snapshot as the server pushes it
+		rv = receive_frame(server, buf, delta_encoding ? &delta : NULL);
+		if (rv < 0) {
+			running = 0;
+		} else if (rv == 0) {
+			show_snapshot(buf, instance_set);
 		}
+	}
+	while (running) {
+		if (version == ASM_PROTOCOL_VERSION) {
+			// Servers that do not know v2 do not answer it at all
+			rv = request_v2(server, negotiated ? -1 : V2_NEGOTIATE_MS);
+			if (rv > 0) {
+				asmlog_info("The server does not speak protocol v2, using v1");
+				version = 1;
+				continue;
+			}
+			negotiated = 1;
+			if (rv < 0) {
+				running = 0;
+				continue;
+			}
+		} else {
+			// Send four-byte zero reqest
+			int remaining = (int)sizeof(request);
+			do {
+				rv = send(server, (void *)request, remaining, 0);
+				if (rv == -1) {
+					if (errno != EINTR) {
+						asmlog_error("asmclient: send, %s", strerror(errno));
+					}
+					break;
+				}
+				remaining -= rv;
+			} while (remaining > 0);
 
 
-		// Unless the -o option was used to pick which four servers should
-		// be displayed, show all of them.
-		count = instance_set == 0 ? MAX_ARMA_INSTANCES : 4;
-		if (instance_set == 0) {
-			bp = buf;
-		} else {
-			bp = buf + (4 * (instance_set - 1));
-		}
-		asmlog_info("Displaying stats for %d instances...", count);
-		// FIXME: consider that the received data for inactive instances
-		//        is only the PID field.
-		for (instance = 0; instance < count; instance++) {
-			asi = (struct ARMA_SERVER_INFO*)(bp + (instance * sizeof(struct ARMA_SERVER_INFO)));
-			asmlog_info("============================ server %2d", instance + 1);
-			asmlog_info("PID = %zd", asi->PID);
-			asmlog_info("OC0 = %zd", asi->OBJ_COUNT_0);
-			asmlog_info("OC1 = %zd", asi->OBJ_COUNT_1);
-			asmlog_info("OC2 = %zd", asi->OBJ_COUNT_2);
-			asmlog_info("PLC = %zd", asi->PLAYER_COUNT);
-			asmlog_info("AIL = %zd", asi->AI_LOC_COUNT);
-			asmlog_info("AIR = %zd", asi->AI_REM_COUNT);
-			asmlog_info("FPS = %zd", asi->SERVER_FPS);
-			asmlog_info("MIN = %zd", asi->SERVER_FPSMIN);
-			asmlog_info("CPS = %zd", asi->FSM_CE_FREQ);
-			asmlog_info("MEM = %zd", asi->MEM / (1024*1024));
-			asmlog_info("NTI = %zd", asi->NET_RECV);
-			asmlog_info("NTO = %zd", asi->NET_SEND);
-			asmlog_info("DIR = %zd", asi->DISC_READ);
-			asmlog_info("TICK = %zd", asi->TICK_COUNT);
-			asmlog_info("MISSION = \"%s\"", asi->MISSION);
-			asmlog_info("PROFILE = \"%s\"", asi->PROFILE);
-
-			// TimeStamp|FPS|CPS|PL#|AIL|AIR|OC0|OC1|OC2
-			// FIXME: separate log files for each instance
-			if (log_file) {
-				time_t now;
-				struct tm *ts;
-				char timestamp[21];
-
-				memset(timestamp, 0, sizeof(timestamp));
-				now = time(NULL);
-				ts = localtime(&now);
-				strftime(timestamp, sizeof(timestamp), "%T", ts);
-
-				fprintf(log_file, "%s|%u|%u|%u|%u|%u|%u|%u|%u\n",
-					timestamp, asi->SERVER_FPS, asi->FSM_CE_FREQ,
-					asi->PLAYER_COUNT, asi->AI_LOC_COUNT, asi->AI_REM_COUNT,
-					asi->OBJ_COUNT_0, asi->OBJ_COUNT_1, asi->OBJ_COUNT_2);
+			if (delta_encoding) {
+				// Delta frames have a length, unlike plain snapshots
+				rv = receive_frame(server, buf, &delta);
+				if (rv < 0) {
+					running = 0;
+				}
+				if (rv != 0) {
+					continue;
+				}
+			} else {
+				// Receive ASI stats
+				rv = recv(server, snapshot, BUFSIZE, 0);
+				if (rv == 0) {
+					// Server closed the connection
+					running = 0;
+					continue;
+				}
+				if (rv == -1) {
+					if (errno != EINTR) {
+						asmlog_error("asmclient: recv, %s", strerror(errno));
+					}
+					continue;
+				}
+				asm_snapshot_expand(snapshot, rv, (unsigned char *)buf);
 			}
+
+			show_snapshot(buf, instance_set);
 		}
 
 		if (once != 0) {
@@ -207,12 +1095,7 @@ int asmclient(int instance_set)
 		}
 	}
 
-	if (log_file) {
-		(void)fclose(log_file);
-	}
-	if (log_filename) {
-		free(log_filename);
-	}
+	close_log();
 	return EXIT_SUCCESS;
 }
 
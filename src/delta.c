@@ -0,0 +1,233 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "asm.h"
+#include "delta.h"
+
+// The fields of an ARMA_SERVER_INFO record, at their offsets in the wire format
+static const struct {
+	unsigned char offset;
+	unsigned char size;  // 2 or 4 for numbers, SMALSTRINGSIZE for strings
+} asm_delta_fields[] = {
+	{  0, 2 }, // PID
+	{  2, 2 }, // OBJ_COUNT_0
+	{  4, 2 }, // OBJ_COUNT_1
+	{  6, 2 }, // OBJ_COUNT_2
+	{  8, 2 }, // PLAYER_COUNT
+	{ 10, 2 }, // AI_LOC_COUNT
+	{ 12, 2 }, // AI_REM_COUNT
+	{ 14, 2 }, // SERVER_FPS
+	{ 16, 2 }, // SERVER_FPSMIN
+	{ 18, 2 }, // FSM_CE_FREQ
+	{ 20, 4 }, // MEM
+	{ 24, 4 }, // NET_RECV
+	{ 28, 4 }, // NET_SEND
+	{ 32, 4 }, // DISC_READ
+	{ 36, 4 }, // TICK_COUNT
+	{ 40, SMALSTRINGSIZE }, // MISSION
+	{ 72, SMALSTRINGSIZE }, // PROFILE
+};
+#define ASM_DELTA_FIELDS (int)(sizeof(asm_delta_fields) / sizeof(asm_delta_fields[0]))
+
+static uint32_t get_field(const unsigned char *record, int field)
+{
+	const unsigned char *p = record + asm_delta_fields[field].offset;
+
+	return asm_delta_fields[field].size == 2 ? *((const uint16_t *)p) : *((const uint32_t *)p);
+}
+
+static void put_field(unsigned char *record, int field, uint32_t value)
+{
+	unsigned char *p = record + asm_delta_fields[field].offset;
+
+	if (asm_delta_fields[field].size == 2) {
+		*((uint16_t *)p) = value;
+	} else {
+		*((uint32_t *)p) = value;
+	}
+}
+
+static unsigned char *put_varint(unsigned char *p, uint32_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+// Returns NULL if the varint runs past end or is too long
+static const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, uint32_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; p < end && shift < 35; shift += 7) {
+		*v |= (uint32_t)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) return p;
+	}
+	return NULL;
+}
+
+void asm_delta_init(struct asm_delta *delta)
+{
+	memset(delta, 0, sizeof(*delta));
+}
+
+/*
+ * Unpack a snapshot as sent by send_asi(), where an unused slot is only
+ * its zero PID field, into MAX_ARMA_INSTANCES full records
+ */
+void asm_snapshot_expand(const unsigned char *snapshot, size_t len, unsigned char *records)
+{
+	int instance;
+	size_t n;
+
+	memset(records, 0, MAX_ARMA_INSTANCES * ASI_WIRE_SIZE);
+	for (instance = 0; instance < MAX_ARMA_INSTANCES && len >= 2; instance++, records += ASI_WIRE_SIZE) {
+		n = (snapshot[0] == 0 && snapshot[1] == 0) || len < ASI_WIRE_SIZE ? 2 : ASI_WIRE_SIZE;
+		memcpy(records, snapshot, n);
+		snapshot += n;
+		len -= n;
+	}
+}
+
+/*
+ * Encode the difference between the current records and the previous
+ * ones into out, which must have room for ASM_DELTA_MAX_SIZE bytes, and
+ * remember the current records for the next frame.
+ *
+ * Returns the size of the frame.
+ */
+size_t asm_delta_encode(struct asm_delta *delta, const unsigned char *current, int keyframe, unsigned char *out)
+{
+	const unsigned char *old, *new;
+	unsigned char *p = out, *q, body[ASM_DELTA_MAX_SIZE];
+	unsigned char records[MAX_ARMA_INSTANCES * ASI_WIRE_SIZE], *s;
+	uint32_t instances = 0, fields, a, b, d;
+	int instance, field;
+	size_t len;
+
+	if (keyframe) {
+		memset(delta->records, 0, sizeof(delta->records));
+	}
+
+	// Strings only go over the wire up to their NUL, so forget what follows it
+	memcpy(records, current, sizeof(records));
+	for (instance = 0; instance < MAX_ARMA_INSTANCES; instance++) {
+		for (field = 0; field < ASM_DELTA_FIELDS; field++) {
+			if (asm_delta_fields[field].size != SMALSTRINGSIZE) continue;
+			s = records + instance * ASI_WIRE_SIZE + asm_delta_fields[field].offset;
+			len = strnlen((const char *)s, SMALSTRINGSIZE);
+			memset(s + len, 0, SMALSTRINGSIZE - len);
+		}
+	}
+
+	q = body;
+	for (instance = 0; instance < MAX_ARMA_INSTANCES; instance++) {
+		old = delta->records + instance * ASI_WIRE_SIZE;
+		new = records + instance * ASI_WIRE_SIZE;
+		if (memcmp(old, new, ASI_WIRE_SIZE) == 0) continue;
+
+		fields = 0;
+		for (field = 0; field < ASM_DELTA_FIELDS; field++) {
+			if (memcmp(old + asm_delta_fields[field].offset, new + asm_delta_fields[field].offset,
+			           asm_delta_fields[field].size) != 0) {
+				fields |= 1U << field;
+			}
+		}
+		instances |= 1U << instance;
+		q = put_varint(q, fields);
+		for (field = 0; fields != 0; field++, fields >>= 1) {
+			if ((fields & 1) == 0) continue;
+			if (asm_delta_fields[field].size == SMALSTRINGSIZE) {
+				len = strnlen((const char *)new + asm_delta_fields[field].offset, SMALSTRINGSIZE);
+				q = put_varint(q, len);
+				memcpy(q, new + asm_delta_fields[field].offset, len);
+				q += len;
+			} else {
+				a = get_field(old, field);
+				b = get_field(new, field);
+				d = b - a;
+				// zigzag: small differences either way make small varints
+				q = put_varint(q, (d << 1) ^ (uint32_t)((int32_t)d >> 31));
+			}
+		}
+	}
+	memcpy(delta->records, records, sizeof(delta->records));
+
+	*p++ = keyframe ? ASM_DELTA_KEYFRAME : 0;
+	p = put_varint(p, instances);
+	memcpy(p, body, q - body);
+	return p + (q - body) - out;
+}
+
+/*
+ * Apply a frame to the records in delta.
+ *
+ * Returns 0 on success, or 1 if the frame is malformed or is relative to
+ * a snapshot that this end never had; the client should then ask for a
+ * keyframe.
+ */
+int asm_delta_decode(struct asm_delta *delta, const unsigned char *in, size_t len)
+{
+	const unsigned char *p = in, *end = in + len;
+	unsigned char records[MAX_ARMA_INSTANCES * ASI_WIRE_SIZE], *record;
+	uint32_t instances, fields, v;
+	int instance, field;
+
+	if (len < 2) return 1;
+	if (*p & ASM_DELTA_KEYFRAME) {
+		memset(records, 0, sizeof(records));
+	} else if (delta->synced) {
+		memcpy(records, delta->records, sizeof(records));
+	} else {
+		return 1;
+	}
+	p++;
+
+	if ((p = get_varint(p, end, &instances)) == NULL || instances >> MAX_ARMA_INSTANCES != 0) return 1;
+	for (instance = 0; instances != 0; instance++, instances >>= 1) {
+		if ((instances & 1) == 0) continue;
+		record = records + instance * ASI_WIRE_SIZE;
+		if ((p = get_varint(p, end, &fields)) == NULL || fields >> ASM_DELTA_FIELDS != 0) return 1;
+		for (field = 0; fields != 0; field++, fields >>= 1) {
+			if ((fields & 1) == 0) continue;
+			if ((p = get_varint(p, end, &v)) == NULL) return 1;
+			if (asm_delta_fields[field].size == SMALSTRINGSIZE) {
+				if (v > SMALSTRINGSIZE || v > (size_t)(end - p)) return 1;
+				memset(record + asm_delta_fields[field].offset, 0, SMALSTRINGSIZE);
+				memcpy(record + asm_delta_fields[field].offset, p, v);
+				p += v;
+			} else {
+				put_field(record, field, get_field(record, field) + ((v >> 1) ^ -(v & 1)));
+			}
+		}
+	}
+	if (p != end) return 1;
+
+	memcpy(delta->records, records, sizeof(records));
+	delta->synced = 1;
+	return 0;
+}
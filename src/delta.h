@@ -0,0 +1,64 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASMDELTA_H_
+#define ASMDELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "asm.h"
+
+/*
+ * Delta encoding of snapshots, for clients on slow links.
+ *
+ * Both ends keep the last snapshot that went over the connection, as
+ * MAX_ARMA_INSTANCES full ARMA_SERVER_INFO records (see
+ * asm_snapshot_expand()). A frame then only carries what changed:
+ *
+ *   uint8   flags, ASM_DELTA_KEYFRAME if the frame is relative to an
+ *           all-zero snapshot rather than to the previous one
+ *   varint  bitmap of the instances that changed, bit n for instance n
+ *   for each instance that changed:
+ *     varint  bitmap of the fields that changed, in asm_delta_fields order
+ *     for each field that changed:
+ *       numbers: varint, the zigzag-encoded 32-bit difference to the old value
+ *       strings: varint length, followed by that many bytes
+ *
+ * A varint is 7 bits per byte, least significant first, with the top bit
+ * set on all but the last byte.
+ */
+#define ASM_DELTA_KEYFRAME  0x01
+
+// Worst case size of a frame: every field of every instance changed
+#define ASM_DELTA_MAX_SIZE  (1 + 3 + MAX_ARMA_INSTANCES * (3 + 15 * 5 + 2 * (1 + SMALSTRINGSIZE)))
+
+struct asm_delta
+{
+	int           synced;   // decoder: a keyframe has been received
+	unsigned char records[MAX_ARMA_INSTANCES * ASI_WIRE_SIZE];
+};
+
+void   asm_delta_init(struct asm_delta *delta);
+void   asm_snapshot_expand(const unsigned char *snapshot, size_t len, unsigned char *records);
+size_t asm_delta_encode(struct asm_delta *delta, const unsigned char *current, int keyframe, unsigned char *out);
+int    asm_delta_decode(struct asm_delta *delta, const unsigned char *in, size_t len);
+
+#endif /* ASMDELTA_H_ */
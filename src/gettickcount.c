@@ -21,6 +21,8 @@
 #include <stdint.h>
 #include <time.h>
 
+#include "gettickcount.h"
+
 /*
  * Emulates the Win32 GetTickCount API call
  *
@@ -33,3 +35,54 @@ uint32_t gettickcount()
         clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
         return (1000 * ts.tv_sec + ts.tv_nsec / 1000000);
 }
+
+/*
+ * CLOCK_MONOTONIC in nanoseconds, on the same clock as gettickcount(),
+ * so gettickcount() == monotonic_ns() / 1000000 (mod 2^32). It is read
+ * from CLOCK_MONOTONIC_COARSE, which is cheap enough for every call from
+ * the Arma server but only moves once per kernel tick, every 1 to 4 ms:
+ * the unit is nanoseconds, the accuracy milliseconds. Use precise_ns()
+ * to time anything shorter.
+ */
+uint64_t monotonic_ns()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * CLOCK_MONOTONIC in nanoseconds, at full resolution, for timing short
+ * stretches of code
+ */
+uint64_t precise_ns()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+double ns_per_cycle = 1.0;
+
+/*
+ * Measure the rate of cycles() against CLOCK_MONOTONIC, by busy-waiting
+ * for about a millisecond
+ */
+void cycles_calibrate()
+{
+#if defined(__i386__) || defined(__x86_64__)
+        uint64_t ns0, ns1, c0, c1;
+
+        ns0 = precise_ns();
+        c0  = cycles();
+        do {
+                ns1 = precise_ns();
+                c1  = cycles();
+        } while (ns1 - ns0 < 1000000);
+        if (c1 > c0) {
+                ns_per_cycle = (double)(ns1 - ns0) / (c1 - c0);
+        }
+#endif
+}
@@ -22,5 +22,22 @@
 #define _GETTICKCOUNT_H
 
 uint32_t gettickcount();
+uint64_t monotonic_ns();
+uint64_t precise_ns();
+
+/*
+ * A cheap timestamp for timing short stretches of code: the time stamp
+ * counter on x86, precise_ns() elsewhere. Multiply differences by
+ * ns_per_cycle, which cycles_calibrate() sets up, to get nanoseconds.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+static inline uint64_t cycles(void) { return __rdtsc(); }
+#else
+static inline uint64_t cycles(void) { return precise_ns(); }
+#endif
+
+extern double ns_per_cycle;
+void cycles_calibrate();
 
 #endif
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#include "histogram.h"
+
+void asm_histogram_add(struct asm_histogram *h, uint64_t ns)
+{
+	uint64_t us = (ns + 999) / 1000;
+	int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+
+	h->buckets[bucket < ASM_HISTOGRAM_BUCKETS ? bucket : ASM_HISTOGRAM_BUCKETS - 1]++;
+	h->count++;
+	h->sum += ns;
+	if (ns > h->max) h->max = ns;
+}
+
+void asm_histogram_merge(struct asm_histogram *into, const struct asm_histogram *from)
+{
+	int i;
+
+	for (i = 0; i < ASM_HISTOGRAM_BUCKETS; i++) {
+		into->buckets[i] += from->buckets[i];
+	}
+	into->count += from->count;
+	into->sum   += from->sum;
+	if (from->max > into->max) into->max = from->max;
+}
+
+// The upper bound of a bucket in ns, UINT64_MAX for the last one
+uint64_t asm_histogram_bound(int bucket)
+{
+	return bucket < ASM_HISTOGRAM_BUCKETS - 1 ? 1000ULL << bucket : UINT64_MAX;
+}
+
+/*
+ * The upper bound of the bucket that the q-quantile falls in, in ns, or
+ * the largest duration if that is smaller. 0 if there are none.
+ */
+uint64_t asm_histogram_quantile(const struct asm_histogram *h, double q)
+{
+	uint64_t rank = (uint64_t)(q * h->count), seen = 0;
+	int i;
+
+	if (h->count == 0) return 0;
+	for (i = 0; i < ASM_HISTOGRAM_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen > rank) break;
+	}
+	return asm_histogram_bound(i) < h->max ? asm_histogram_bound(i) : h->max;
+}
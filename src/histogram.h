@@ -0,0 +1,48 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASMHISTOGRAM_H_
+#define ASMHISTOGRAM_H_
+
+#include <stdint.h>
+
+/*
+ * Histograms of durations, in buckets of powers of two from 1 us up.
+ * Bucket i counts the durations of at most 1 << i microseconds that did
+ * not fit in bucket i - 1; the last one counts all the longer ones.
+ * Adding to a histogram is a few instructions, and histograms are added
+ * together only when they are read.
+ */
+#define ASM_HISTOGRAM_BUCKETS 24 // the last but one is 4.2 s
+
+struct asm_histogram
+{
+	uint64_t count;
+	uint64_t sum; // ns
+	uint64_t max; // ns
+	uint64_t buckets[ASM_HISTOGRAM_BUCKETS];
+};
+
+void     asm_histogram_add(struct asm_histogram *h, uint64_t ns);
+void     asm_histogram_merge(struct asm_histogram *into, const struct asm_histogram *from);
+uint64_t asm_histogram_bound(int bucket);
+uint64_t asm_histogram_quantile(const struct asm_histogram *h, double q);
+
+#endif /* ASMHISTOGRAM_H_ */
@@ -0,0 +1,324 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "asm.h"
+#include "metrics.h"
+#include "relay.h"
+
+enum metric_kind {
+	METRIC_U32,
+	METRIC_U64,
+	METRIC_TIME, // CLOCK_MONOTONIC ns, exported as seconds since the epoch
+};
+
+/*
+ * The metric families, each from one field of struct ASM_INSTANCE.
+ * Consecutive rows with the same name are one family, told apart by
+ * their extra label.
+ */
+static const struct {
+	const char      *name;
+	const char      *type;
+	const char      *unit;     // or NULL
+	const char      *help;
+	const char      *label;    // extra label, or NULL
+	size_t           offset;
+	enum metric_kind kind;
+	int              decimals; // the field is in units of 10^-decimals
+} asm_metrics_families[] = {
+	{ "asm_objects", "gauge", NULL, "Objects counted by the expressions in _ASM_OPT",
+		"expression=\"0\"", offsetof(struct ASM_INSTANCE, OBJ_COUNT_0), METRIC_U32, 0 },
+	{ "asm_objects", "gauge", NULL, "Objects counted by the expressions in _ASM_OPT",
+		"expression=\"1\"", offsetof(struct ASM_INSTANCE, OBJ_COUNT_1), METRIC_U32, 0 },
+	{ "asm_objects", "gauge", NULL, "Objects counted by the expressions in _ASM_OPT",
+		"expression=\"2\"", offsetof(struct ASM_INSTANCE, OBJ_COUNT_2), METRIC_U32, 0 },
+	{ "asm_players", "gauge", NULL, "Players connected",
+		NULL, offsetof(struct ASM_INSTANCE, PLAYER_COUNT), METRIC_U32, 0 },
+	{ "asm_ai_units", "gauge", NULL, "AI units",
+		"locality=\"local\"", offsetof(struct ASM_INSTANCE, AI_LOC_COUNT), METRIC_U32, 0 },
+	{ "asm_ai_units", "gauge", NULL, "AI units",
+		"locality=\"remote\"", offsetof(struct ASM_INSTANCE, AI_REM_COUNT), METRIC_U32, 0 },
+	{ "asm_server_fps", "gauge", NULL, "Server frames per second",
+		NULL, offsetof(struct ASM_INSTANCE, SERVER_FPS), METRIC_U32, 3 },
+	{ "asm_server_fps_min", "gauge", NULL, "Lowest server frames per second",
+		NULL, offsetof(struct ASM_INSTANCE, SERVER_FPSMIN), METRIC_U32, 3 },
+	{ "asm_fsm_condition_evaluations", "gauge", NULL, "FSM condition evaluations per second",
+		NULL, offsetof(struct ASM_INSTANCE, FSM_CE_FREQ), METRIC_U32, 0 },
+	{ "asm_cpu_usage_ratio", "gauge", "ratio", "CPU time used per second, 1 is one core",
+		NULL, offsetof(struct ASM_INSTANCE, CPU_LOAD), METRIC_U32, 4 },
+	{ "asm_memory_resident_bytes", "gauge", "bytes", "Resident set size",
+		NULL, offsetof(struct ASM_INSTANCE, MEM), METRIC_U64, 0 },
+	{ "asm_network_receive_rate", "gauge", NULL, "Bytes per second received",
+		NULL, offsetof(struct ASM_INSTANCE, NET_RECV), METRIC_U64, 0 },
+	{ "asm_network_send_rate", "gauge", NULL, "Bytes per second sent",
+		NULL, offsetof(struct ASM_INSTANCE, NET_SEND), METRIC_U64, 0 },
+	{ "asm_disk_read_rate", "gauge", NULL, "Bytes per second read from storage",
+		NULL, offsetof(struct ASM_INSTANCE, DISC_READ), METRIC_U64, 0 },
+	{ "asm_disk_write_rate", "gauge", NULL, "Bytes per second written to storage",
+		NULL, offsetof(struct ASM_INSTANCE, DISC_WRITE), METRIC_U64, 0 },
+	{ "asm_io_read_bytes", "counter", "bytes", "Bytes read from storage",
+		NULL, offsetof(struct ASM_INSTANCE, IO_READ), METRIC_U64, 0 },
+	{ "asm_io_write_bytes", "counter", "bytes", "Bytes written to storage",
+		NULL, offsetof(struct ASM_INSTANCE, IO_WRITE), METRIC_U64, 0 },
+	{ "asm_start_time_seconds", "gauge", "seconds", "When the mission was initialized",
+		NULL, offsetof(struct ASM_INSTANCE, STARTED), METRIC_TIME, 3 },
+	{ "asm_last_update_time_seconds", "gauge", "seconds", "When the instance last reported",
+		NULL, offsetof(struct ASM_INSTANCE, UPDATED), METRIC_TIME, 3 },
+};
+
+#define METRICS_FAMILIES (sizeof(asm_metrics_families) / sizeof(asm_metrics_families[0]))
+
+// instance_id="...",host="...",profile="...",mission="...", with every character escaped
+#define METRICS_LABELS_SIZE (64 + 2 * ASM_RELAY_HOST_SIZE + 4 * SMALSTRINGSIZE)
+
+static const uint64_t asm_metrics_scale[] = { 1, 10, 100, 1000, 10000 };
+
+// Append to the text, growing the buffer as needed
+static int metrics_printf(struct asm_metrics *metrics, const char *format, ...)
+{
+	va_list ap;
+	char *buf;
+	size_t size;
+	int n;
+
+	for (;;) {
+		va_start(ap, format);
+		n = vsnprintf(metrics->buf + metrics->len, metrics->size - metrics->len, format, ap);
+		va_end(ap);
+		if (n < 0) return 1;
+		if (metrics->len + n < metrics->size) break;
+
+		size = metrics->size > 0 ? 2 * metrics->size : 4096;
+		while (size <= metrics->len + n) size *= 2;
+		if ((buf = realloc(metrics->buf, size)) == NULL) return 1;
+		metrics->buf  = buf;
+		metrics->size = size;
+	}
+	metrics->len += n;
+	return 0;
+}
+
+// Append a label, escaped as label values must be
+static char *metrics_label(char *p, const char *name, const char *value, size_t len)
+{
+	size_t i;
+
+	p += sprintf(p, "%s=\"", name);
+	for (i = 0; i < len && value[i] != '\0'; i++) {
+		if (value[i] == '\\' || value[i] == '"') {
+			*p++ = '\\';
+			*p++ = value[i];
+		} else if (value[i] == '\n') {
+			*p++ = '\\';
+			*p++ = 'n';
+		} else {
+			*p++ = value[i];
+		}
+	}
+	*p++ = '"';
+	*p   = '\0';
+	return p;
+}
+
+/*
+ * Render the instances that are alive at now (monotonic_ns()), and set
+ * *expires to when the text will be out of date even if no instance
+ * reports anything new: when the first of them is considered dead. The
+ * text is not terminated; asm_metrics_render_daemon() does that.
+ *
+ * Returns 0 on success, 1 if out of memory.
+ */
+int asm_metrics_render(struct asm_metrics *metrics, const struct asm_metrics_source *source,
+                       uint64_t now, uint64_t *expires)
+{
+	struct ASM_INSTANCE *slots = NULL;
+	char (*labels)[METRICS_LABELS_SIZE] = NULL;
+	struct timespec ts;
+	int64_t epoch; // CLOCK_REALTIME - CLOCK_MONOTONIC, ns
+	const char *name = "";
+	uint64_t value, scale;
+	int instance, count = 0, room = 0, rv = 1;
+	size_t f;
+	char *p;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	epoch = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec - (int64_t)now;
+
+	for (instance = source->next(0); instance >= 0; instance = source->next(instance + 1)) {
+		room++;
+	}
+	if (room > 0) {
+		slots  = malloc(room * sizeof(*slots));
+		labels = malloc(room * sizeof(*labels));
+		if (slots == NULL || labels == NULL) goto out;
+	}
+
+	*expires = UINT64_MAX;
+	for (instance = source->next(0); instance >= 0 && count < room; instance = source->next(instance + 1)) {
+		if (source->read(instance, &slots[count]) != 0) {
+			*expires = now; // no consistent copy, try again next time
+			continue;
+		}
+		if (slots[count].PID == 0 || slots[count].UPDATED + DEAD_TIMEOUT_NS < now) {
+			continue;
+		}
+		if (slots[count].UPDATED + DEAD_TIMEOUT_NS + 1 < *expires) {
+			*expires = slots[count].UPDATED + DEAD_TIMEOUT_NS + 1;
+		}
+		p = labels[count] + sprintf(labels[count], "instance_id=\"%d\",", instance);
+		if (source->host != NULL) {
+			p = metrics_label(p, "host", source->host(instance), ASM_RELAY_HOST_SIZE);
+			*p++ = ',';
+		}
+		p = metrics_label(p, "profile", slots[count].PROFILE, SMALSTRINGSIZE);
+		*p++ = ',';
+		metrics_label(p, "mission", slots[count].MISSION, SMALSTRINGSIZE);
+		count++;
+	}
+
+	metrics->len = 0;
+	if (metrics_printf(metrics, "# TYPE asm_instance info\n"
+			"# HELP asm_instance The Arma server process of an instance\n") != 0) goto out;
+	for (instance = 0; instance < count; instance++) {
+		if (metrics_printf(metrics, "asm_instance_info{%s,pid=\"%u\"} 1\n",
+				labels[instance], slots[instance].PID) != 0) goto out;
+	}
+
+	for (f = 0; f < METRICS_FAMILIES; f++) {
+		if (strcmp(name, asm_metrics_families[f].name) != 0) {
+			name = asm_metrics_families[f].name;
+			if (metrics_printf(metrics, "# TYPE %s %s\n", name, asm_metrics_families[f].type) != 0) goto out;
+			if (asm_metrics_families[f].unit != NULL &&
+			    metrics_printf(metrics, "# UNIT %s %s\n", name, asm_metrics_families[f].unit) != 0) goto out;
+			if (metrics_printf(metrics, "# HELP %s %s\n", name, asm_metrics_families[f].help) != 0) goto out;
+		}
+		scale = asm_metrics_scale[asm_metrics_families[f].decimals];
+		for (instance = 0; instance < count; instance++) {
+			const char *field = (const char *)&slots[instance] + asm_metrics_families[f].offset;
+
+			switch (asm_metrics_families[f].kind) {
+				case METRIC_U32:
+					value = *((const uint32_t *)field);
+					break;
+				case METRIC_U64:
+					value = *((const uint64_t *)field);
+					break;
+				default:
+					// Milliseconds since the epoch
+					value = ((int64_t)*((const uint64_t *)field) + epoch) / 1000000;
+					break;
+			}
+			if (metrics_printf(metrics, "%s%s{%s%s%s} ", name,
+					strcmp(asm_metrics_families[f].type, "counter") == 0 ? "_total" : "",
+					labels[instance],
+					asm_metrics_families[f].label != NULL ? "," : "",
+					asm_metrics_families[f].label != NULL ? asm_metrics_families[f].label : "") != 0) goto out;
+			if (scale == 1) {
+				rv = metrics_printf(metrics, "%llu\n", (unsigned long long)value);
+			} else {
+				rv = metrics_printf(metrics, "%llu.%0*llu\n", (unsigned long long)(value / scale),
+						asm_metrics_families[f].decimals, (unsigned long long)(value % scale));
+			}
+			if (rv != 0) goto out;
+		}
+	}
+	rv = 0;
+
+out:
+	free(labels);
+	free(slots);
+	return rv;
+}
+
+// Append the families' metadata
+static int metrics_family(struct asm_metrics *metrics, const char *name, const char *type,
+                          const char *unit, const char *help)
+{
+	if (metrics_printf(metrics, "# TYPE %s %s\n", name, type) != 0) return 1;
+	if (unit != NULL && metrics_printf(metrics, "# UNIT %s %s\n", name, unit) != 0) return 1;
+	return metrics_printf(metrics, "# HELP %s %s\n", name, help);
+}
+
+/*
+ * Render the text served to a scrape: the instances, as rendered by
+ * asm_metrics_render(), and the counters and histograms of the daemon,
+ * which change with every request and so are rendered every time.
+ *
+ * Returns 0 on success, 1 if out of memory.
+ */
+int asm_metrics_render_daemon(struct asm_metrics *metrics, const struct asm_metrics *instances,
+                              const struct asm_metrics_value *values, int count,
+                              const struct asm_metrics_histogram *histograms, int histogram_count)
+{
+	const struct asm_histogram *h;
+	uint64_t bound, cumulative;
+	int i, bucket;
+
+	metrics->len = 0;
+	if (metrics_printf(metrics, "%.*s", (int)instances->len, instances->buf != NULL ? instances->buf : "") != 0) {
+		return 1;
+	}
+	for (i = 0; i < count; i++) {
+		if (metrics_family(metrics, values[i].name, values[i].type, values[i].unit, values[i].help) != 0 ||
+		    metrics_printf(metrics, "%s%s %llu\n", values[i].name,
+				strcmp(values[i].type, "counter") == 0 ? "_total" : "",
+				(unsigned long long)values[i].value) != 0) {
+			return 1;
+		}
+	}
+	for (i = 0; i < histogram_count; i++) {
+		h = histograms[i].histogram;
+		if (metrics_family(metrics, histograms[i].name, "histogram", "seconds", histograms[i].help) != 0) {
+			return 1;
+		}
+		cumulative = 0;
+		for (bucket = 0; bucket < ASM_HISTOGRAM_BUCKETS - 1; bucket++) {
+			cumulative += h->buckets[bucket];
+			bound = asm_histogram_bound(bucket) / 1000; // us
+			if (metrics_printf(metrics, "%s_bucket{le=\"%llu.%06llu\"} %llu\n", histograms[i].name,
+					(unsigned long long)(bound / 1000000), (unsigned long long)(bound % 1000000),
+					(unsigned long long)cumulative) != 0) {
+				return 1;
+			}
+		}
+		if (metrics_printf(metrics, "%s_bucket{le=\"+Inf\"} %llu\n%s_count %llu\n%s_sum %llu.%09llu\n",
+				histograms[i].name, (unsigned long long)h->count,
+				histograms[i].name, (unsigned long long)h->count,
+				histograms[i].name, (unsigned long long)(h->sum / 1000000000),
+				(unsigned long long)(h->sum % 1000000000)) != 0) {
+			return 1;
+		}
+	}
+	return metrics_printf(metrics, "# EOF\n");
+}
+
+void asm_metrics_free(struct asm_metrics *metrics)
+{
+	free(metrics->buf);
+	memset(metrics, 0, sizeof(*metrics));
+}
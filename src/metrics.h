@@ -0,0 +1,79 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASMMETRICS_H_
+#define ASMMETRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "asm.h"
+#include "histogram.h"
+
+/*
+ * The active instances in the OpenMetrics text format, for Prometheus.
+ * Each sample is labelled with instance_id, profile and mission, and on
+ * a relay with the host of the instance. The counters of the daemon
+ * itself follow them, as asm_daemon_* metrics.
+ */
+#define ASM_METRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+// The rendered text, in a buffer that is reused from one rendering to the next
+struct asm_metrics
+{
+	char   *buf;
+	size_t  len;
+	size_t  size;
+};
+
+// Where the instances come from: the shared memory, or the upstreams of a relay
+struct asm_metrics_source
+{
+	int         (*next)(int from);                         // as asm_shm_next()
+	int         (*read)(int id, struct ASM_INSTANCE *copy); // 0 if copied consistently
+	const char *(*host)(int id);                            // or NULL, for no host label
+};
+
+// A counter or gauge of the daemon itself
+struct asm_metrics_value
+{
+	const char *name;  // without the _total of a counter
+	const char *type;
+	const char *unit;  // or NULL
+	const char *help;
+	uint64_t    value;
+};
+
+// A histogram of durations in the daemon itself, exported in seconds
+struct asm_metrics_histogram
+{
+	const char                 *name;
+	const char                 *help;
+	const struct asm_histogram *histogram;
+};
+
+int  asm_metrics_render(struct asm_metrics *metrics, const struct asm_metrics_source *source,
+                        uint64_t now, uint64_t *expires);
+int  asm_metrics_render_daemon(struct asm_metrics *metrics, const struct asm_metrics *instances,
+                               const struct asm_metrics_value *values, int count,
+                               const struct asm_metrics_histogram *histograms, int histogram_count);
+void asm_metrics_free(struct asm_metrics *metrics);
+
+#endif /* ASMMETRICS_H_ */
@@ -0,0 +1,157 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "asi.h"
+#include "asmlog.h"
+#include "notify.h"
+
+static pthread_t               notify_thread;
+static pthread_mutex_t         notify_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t          notify_cond = PTHREAD_COND_INITIALIZER;
+static int                     notify_fd = -1;
+static uint32_t               *generation = NULL;
+static uint32_t               *waiting = NULL;
+// Under notify_lock: the event loop wants to know when generation moves from seen
+static int                     wanted = 0;
+static uint32_t                seen;
+static int                     stopping = 0;
+static struct asm_notify_stats stats;
+
+/*
+ * Wait for each change the event loop asks for, and pass it on through
+ * the eventfd. The flag is set again before every check, since the
+ * writer that wakes us takes it down.
+ */
+static void *notify_main(void *arg)
+{
+	const uint64_t one = 1;
+	uint32_t from;
+
+	(void)arg;
+	pthread_mutex_lock(&notify_lock);
+	while (!stopping) {
+		if (!wanted) {
+			pthread_cond_wait(&notify_cond, &notify_lock);
+			continue;
+		}
+		from = seen;
+		pthread_mutex_unlock(&notify_lock);
+
+		for (;;) {
+			__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(generation, __ATOMIC_SEQ_CST) != from) break;
+			syscall(SYS_futex, generation, FUTEX_WAIT, from, NULL, NULL, 0);
+		}
+
+		pthread_mutex_lock(&notify_lock);
+		wanted = 0;
+		if (write(notify_fd, &one, sizeof(one)) != sizeof(one)) {
+			asmlog_error("notify: write, %s", strerror(errno));
+		}
+	}
+	pthread_mutex_unlock(&notify_lock);
+	return NULL;
+}
+
+/*
+ * Start waiting for changes to the generation counter. Returns an eventfd
+ * for the event loop that becomes readable after a change it asked for
+ * with asm_notify_want(), or -1 on failure.
+ */
+int asm_notify_open(uint32_t *counter, uint32_t *flag)
+{
+	int rv;
+
+	if ((notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		asmlog_error("notify: eventfd, %s", strerror(errno));
+		return -1;
+	}
+	generation = counter;
+	waiting    = flag;
+	stopping   = 0;
+	if ((rv = pthread_create(&notify_thread, NULL, notify_main, NULL)) != 0) {
+		asmlog_error("notify: pthread_create(): %s", strerror(rv));
+		close(notify_fd);
+		notify_fd = -1;
+		return -1;
+	}
+	return notify_fd;
+}
+
+/*
+ * Stop the thread. Bumping the counter wakes it whether or not it is in
+ * FUTEX_WAIT yet; other readers just rebuild their snapshots once more.
+ */
+void asm_notify_close(void)
+{
+	if (notify_fd == -1) return;
+
+	pthread_mutex_lock(&notify_lock);
+	stopping = 1;
+	pthread_cond_signal(&notify_cond);
+	pthread_mutex_unlock(&notify_lock);
+	asi_notify(generation, waiting);
+	pthread_join(notify_thread, NULL);
+
+	__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+	close(notify_fd);
+	notify_fd = -1;
+}
+
+// Ask to be notified once the counter is no longer at generation from
+void asm_notify_want(uint32_t from)
+{
+	if (notify_fd == -1) return;
+
+	pthread_mutex_lock(&notify_lock);
+	if (!wanted) {
+		wanted = 1;
+		seen   = from;
+		stats.wants++;
+		pthread_cond_signal(&notify_cond);
+	}
+	pthread_mutex_unlock(&notify_lock);
+}
+
+// Take the notification off the eventfd. Returns 1 if there was one.
+int asm_notify_ready(void)
+{
+	uint64_t count;
+
+	if (notify_fd == -1 || read(notify_fd, &count, sizeof(count)) != sizeof(count)) {
+		return 0;
+	}
+	stats.wakeups += count;
+	return 1;
+}
+
+const struct asm_notify_stats *asm_notify_stats(void)
+{
+	return &stats;
+}
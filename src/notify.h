@@ -0,0 +1,51 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASMNOTIFY_H_
+#define ASMNOTIFY_H_
+
+#include <stdint.h>
+
+/*
+ * Change notification from asmdll.so to the daemon.
+ *
+ * A thread of the daemon blocks in FUTEX_WAIT on the GENERATION counter
+ * of the shared memory area, with the WAITING flag set so that the next
+ * writer wakes it (see asi_notify()), and passes the wakeup on to the
+ * event loop through an eventfd. It only waits after the event loop
+ * asked for it with asm_notify_want(), and at most once per request, so
+ * writers make no wakeups while nothing is listening and no more than
+ * the daemon asks for while something is.
+ */
+struct asm_notify_stats
+{
+	uint64_t wants;
+	uint64_t wakeups;
+};
+
+int  asm_notify_open(uint32_t *generation, uint32_t *waiting);
+void asm_notify_close(void);
+
+void asm_notify_want(uint32_t seen);
+int  asm_notify_ready(void);
+
+const struct asm_notify_stats *asm_notify_stats(void);
+
+#endif /* ASMNOTIFY_H_ */
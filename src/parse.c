@@ -0,0 +1,135 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Bounded, single-pass parsers for the RVExtension() command arguments.
+ *
+ * These run on the Arma server thread for every update, so they make no
+ * libc calls and never look further into the input than they have to.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "parse.h"
+
+#define IS_DIGIT(c) ((unsigned)((c) - '0') < 10)
+
+/*
+ * Parse exactly count ':'-separated unsigned decimal fields, eg "50:25".
+ * The input must end after the last field, within maxlen characters.
+ *
+ * Returns 0 on success, 1 if the input is malformed or a value overflows.
+ */
+int parse_fields(const char *s, size_t maxlen, uint32_t *fields, int count)
+{
+	const char *end = s + maxlen;
+	int field;
+
+	for (field = 0; field < count; field++) {
+		uint32_t v = 0;
+		const char *start = s;
+
+		while (s < end && IS_DIGIT(*s)) {
+			uint32_t d = *s++ - '0';
+			if (v > (UINT32_MAX - d) / 10) return 1;
+			v = 10 * v + d;
+		}
+		if (s == start || s == end) return 1;
+
+		fields[field] = v;
+
+		if (field < count - 1) {
+			if (*s++ != ':') return 1;
+		} else if (*s != '\0') {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Parse a callExtension argument holding one unsigned decimal number.
+ * Arguments that were passed as SQF strings are still quoted.
+ *
+ * Returns 0 on success.
+ */
+int parse_uint(const char *s, uint32_t *value)
+{
+	uint32_t v = 0;
+	int quoted = 0;
+	const char *start;
+
+	if (s == NULL) return 1;
+
+	if (*s == '"') {
+		quoted = 1;
+		s++;
+	}
+	for (start = s; IS_DIGIT(*s); s++) {
+		uint32_t d = *s - '0';
+		if (v > (UINT32_MAX - d) / 10) return 1;
+		v = 10 * v + d;
+	}
+	if (s == start) return 1;
+	if (quoted && *s++ != '"') return 1;
+	if (*s != '\0') return 1;
+
+	*value = v;
+	return 0;
+}
+
+/*
+ * Parse the leading digits of s, looking at no more than maxlen characters.
+ *
+ * Returns the number of digits used, or 0 if there were none or the value
+ * does not fit in 32 bits.
+ */
+size_t parse_prefix(const char *s, size_t maxlen, uint32_t *value)
+{
+	uint32_t v = 0;
+	size_t n;
+
+	for (n = 0; n < maxlen && IS_DIGIT(s[n]); n++) {
+		uint32_t d = s[n] - '0';
+		if (v > (UINT32_MAX - d) / 10) return 0;
+		v = 10 * v + d;
+	}
+	if (n > 0) {
+		*value = v;
+	}
+	return n;
+}
+
+// Copy a string into a fixed-size, zero-padded field, truncating if needed
+void copy_string(char *dst, const char *src, size_t size)
+{
+	size_t n = 0;
+
+	if (size == 0) return;
+
+	for (; n < size - 1 && src[n] != '\0'; n++) {
+		dst[n] = src[n];
+	}
+	for (; n < size; n++) {
+		dst[n] = '\0';
+	}
+}
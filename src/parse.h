@@ -0,0 +1,32 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASMPARSE_H_
+#define ASMPARSE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+int    parse_fields(const char *s, size_t maxlen, uint32_t *fields, int count);
+int    parse_uint(const char *s, uint32_t *value);
+size_t parse_prefix(const char *s, size_t maxlen, uint32_t *value);
+void   copy_string(char *dst, const char *src, size_t size);
+
+#endif /* ASMPARSE_H_ */
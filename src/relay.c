@@ -0,0 +1,694 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "asm.h"
+#include "asmlog.h"
+#include "gettickcount.h"
+#include "relay.h"
+
+// A reply larger than this is garbage: it is far more than ASM_MAX_SLOTS instances
+#define RELAY_MAX_REPLY (4 * 1024 * 1024)
+#define RELAY_EVENTS    16
+
+enum resolve_state {
+	RESOLVE_NONE,   // the event loop has the upstream
+	RESOLVE_WANTED, // waiting for the resolver thread
+	RESOLVE_BUSY,   // in getaddrinfo() on the resolver thread
+	RESOLVE_DONE    // answered, for the event loop to take
+};
+
+struct relay_instance
+{
+	uint16_t            id;     // on the upstream
+	struct ASM_INSTANCE info;
+};
+
+struct upstream
+{
+	char                    name[ASM_RELAY_HOST_SIZE];
+	char                    host[ASM_RELAY_HOST_SIZE];
+	char                    port[6];
+	struct sockaddr_storage addr;      // written by the resolver thread until addrlen is set
+	socklen_t               addrlen;   // 0 until resolved
+	int                     resolve;   // enum resolve_state, under resolve_lock
+	int                     resolve_error; // ... the getaddrinfo() result
+	socklen_t               resolved;  // ... the length of addr, once resolved
+	int                     fd;        // -1 while disconnected
+	int                     connecting;
+	int                     in_flight; // requests not answered yet
+	int                     stale;
+	int                     failed;    // the last connection attempt failed, and was logged
+	uint64_t                next;      // monotonic_ns() of the next poll, or connection attempt
+	uint64_t                replied;   // ... of the last reply, or of connecting
+	unsigned char          *in;        // the reply being received
+	size_t                  got;
+	size_t                  size;
+	unsigned char          *records;   // the instance records of the last reply, as received
+	size_t                  len;
+	struct relay_instance  *instances; // ... decoded, in id order
+	int                     count;
+	int                     room;
+};
+
+static struct upstream       *upstreams = NULL;
+static int                    upstream_count = 0;
+static int                    relay_epfd = -1;
+static uint32_t               generation = 0;
+static struct asm_relay_stats stats;
+
+// Host names are looked up on a thread of their own, see resolver_main()
+static pthread_t              resolver_thread;
+static pthread_mutex_t        resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t         resolve_cond = PTHREAD_COND_INITIALIZER;
+static int                    resolve_fd = -1;
+static int                    resolver_running = 0;
+static int                    resolver_stopping = 0; // under resolve_lock
+
+// Where a v2 field goes in struct ASM_INSTANCE
+static const struct {
+	unsigned short offset;
+	unsigned short size;  // 4 or 8 for numbers, SMALSTRINGSIZE for strings
+} relay_fields[ASM_FIELDS] = {
+	[ASM_FIELD_PID]           = { offsetof(struct ASM_INSTANCE, PID),           4 },
+	[ASM_FIELD_OBJ_COUNT_0]   = { offsetof(struct ASM_INSTANCE, OBJ_COUNT_0),   4 },
+	[ASM_FIELD_OBJ_COUNT_1]   = { offsetof(struct ASM_INSTANCE, OBJ_COUNT_1),   4 },
+	[ASM_FIELD_OBJ_COUNT_2]   = { offsetof(struct ASM_INSTANCE, OBJ_COUNT_2),   4 },
+	[ASM_FIELD_PLAYER_COUNT]  = { offsetof(struct ASM_INSTANCE, PLAYER_COUNT),  4 },
+	[ASM_FIELD_AI_LOC_COUNT]  = { offsetof(struct ASM_INSTANCE, AI_LOC_COUNT),  4 },
+	[ASM_FIELD_AI_REM_COUNT]  = { offsetof(struct ASM_INSTANCE, AI_REM_COUNT),  4 },
+	[ASM_FIELD_SERVER_FPS]    = { offsetof(struct ASM_INSTANCE, SERVER_FPS),    4 },
+	[ASM_FIELD_SERVER_FPSMIN] = { offsetof(struct ASM_INSTANCE, SERVER_FPSMIN), 4 },
+	[ASM_FIELD_FSM_CE_FREQ]   = { offsetof(struct ASM_INSTANCE, FSM_CE_FREQ),   4 },
+	[ASM_FIELD_CPU_LOAD]      = { offsetof(struct ASM_INSTANCE, CPU_LOAD),      4 },
+	[ASM_FIELD_MEM]           = { offsetof(struct ASM_INSTANCE, MEM),           8 },
+	[ASM_FIELD_NET_RECV]      = { offsetof(struct ASM_INSTANCE, NET_RECV),      8 },
+	[ASM_FIELD_NET_SEND]      = { offsetof(struct ASM_INSTANCE, NET_SEND),      8 },
+	[ASM_FIELD_DISC_READ]     = { offsetof(struct ASM_INSTANCE, DISC_READ),     8 },
+	[ASM_FIELD_DISC_WRITE]    = { offsetof(struct ASM_INSTANCE, DISC_WRITE),    8 },
+	[ASM_FIELD_IO_READ]       = { offsetof(struct ASM_INSTANCE, IO_READ),       8 },
+	[ASM_FIELD_IO_WRITE]      = { offsetof(struct ASM_INSTANCE, IO_WRITE),      8 },
+	[ASM_FIELD_STARTED]       = { offsetof(struct ASM_INSTANCE, STARTED),       8 },
+	[ASM_FIELD_UPDATED]       = { offsetof(struct ASM_INSTANCE, UPDATED),       8 },
+	[ASM_FIELD_MISSION]       = { offsetof(struct ASM_INSTANCE, MISSION),       SMALSTRINGSIZE },
+	[ASM_FIELD_PROFILE]       = { offsetof(struct ASM_INSTANCE, PROFILE),       SMALSTRINGSIZE },
+};
+
+// Split host[:port] or [address]:port, the port defaults to 24000
+static int upstream_parse(struct upstream *u, const char *spec)
+{
+	const char *colon;
+	size_t len;
+
+	snprintf(u->name, sizeof(u->name), "%s", spec);
+	snprintf(u->port, sizeof(u->port), "%d", 24000);
+	if (spec[0] == '[') {
+		spec++;
+		colon = strchr(spec, ']');
+		if (colon == NULL) return 1;
+		len = colon - spec;
+		colon = colon[1] == ':' ? colon + 1 : NULL;
+	} else {
+		colon = strrchr(spec, ':');
+		len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+	}
+	if (len == 0 || len >= sizeof(u->host)) return 1;
+	memcpy(u->host, spec, len);
+	u->host[len] = '\0';
+	if (colon != NULL) {
+		if (strlen(colon + 1) == 0 || strlen(colon + 1) >= sizeof(u->port)) return 1;
+		snprintf(u->port, sizeof(u->port), "%s", colon + 1);
+	}
+	return 0;
+}
+
+/*
+ * Look up the addresses the event loop asks for with upstream_resolve(),
+ * one at a time, and pass each answer back through the eventfd, since
+ * getaddrinfo() may block for as long as the name servers take.
+ */
+static void *resolver_main(void *arg)
+{
+	const uint64_t one = 1;
+	struct addrinfo hints, *address_list;
+	struct upstream *u;
+	int i, rv;
+
+	(void)arg;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	pthread_mutex_lock(&resolve_lock);
+	while (!resolver_stopping) {
+		for (i = 0, u = NULL; i < upstream_count && u == NULL; i++) {
+			if (upstreams[i].resolve == RESOLVE_WANTED) u = &upstreams[i];
+		}
+		if (u == NULL) {
+			pthread_cond_wait(&resolve_cond, &resolve_lock);
+			continue;
+		}
+		u->resolve = RESOLVE_BUSY;
+		pthread_mutex_unlock(&resolve_lock);
+
+		if ((rv = getaddrinfo(u->host, u->port, &hints, &address_list)) == 0) {
+			memcpy(&u->addr, address_list->ai_addr, address_list->ai_addrlen);
+		}
+
+		pthread_mutex_lock(&resolve_lock);
+		u->resolve       = RESOLVE_DONE;
+		u->resolve_error = rv;
+		if (rv == 0) {
+			u->resolved = address_list->ai_addrlen;
+			freeaddrinfo(address_list);
+		}
+		if (write(resolve_fd, &one, sizeof(one)) != sizeof(one)) {
+			asmlog_error("relay: write, %s", strerror(errno));
+		}
+	}
+	pthread_mutex_unlock(&resolve_lock);
+	return NULL;
+}
+
+// Hand the upstream to the resolver thread, unless it has it already
+static void upstream_resolve(struct upstream *u)
+{
+	pthread_mutex_lock(&resolve_lock);
+	if (u->resolve == RESOLVE_NONE) {
+		u->resolve = RESOLVE_WANTED;
+		pthread_cond_signal(&resolve_cond);
+	}
+	pthread_mutex_unlock(&resolve_lock);
+}
+
+static void upstream_disconnect(struct upstream *u, uint64_t now)
+{
+	if (u->fd != -1) {
+		epoll_ctl(relay_epfd, EPOLL_CTL_DEL, u->fd, NULL);
+		close(u->fd);
+		if (!u->connecting) asmlog_warning("relay: %s disconnected", u->name);
+	}
+	u->fd         = -1;
+	u->connecting = 0;
+	u->in_flight  = 0;
+	u->stale      = 0;
+	u->got        = 0;
+	u->next       = now + ASM_RELAY_RECONNECT * 1000000ULL;
+	if (u->count > 0 || u->len > 0) {
+		u->count = 0;
+		u->len   = 0;
+		generation++;
+	}
+}
+
+static void upstream_connect(struct upstream *u, uint64_t now)
+{
+	struct epoll_event ev;
+
+	u->next = now + ASM_RELAY_RECONNECT * 1000000ULL;
+	if (u->addrlen == 0) {
+		// Connects once the address is known, see upstreams_resolved()
+		upstream_resolve(u);
+		return;
+	}
+	stats.reconnects++;
+	u->fd = socket(u->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (u->fd == -1) {
+		asmlog_error("relay: socket, %s", strerror(errno));
+		return;
+	}
+	if (connect(u->fd, (struct sockaddr *)&u->addr, u->addrlen) == -1 && errno != EINPROGRESS) {
+		if (!u->failed) asmlog_warning("relay: %s, %s", u->name, strerror(errno));
+		u->failed = 1;
+		close(u->fd);
+		u->fd = -1;
+		return;
+	}
+	// Writable once connected
+	u->connecting = 1;
+	u->replied    = now;
+	ev.events     = EPOLLOUT;
+	ev.data.ptr   = u;
+	if (epoll_ctl(relay_epfd, EPOLL_CTL_ADD, u->fd, &ev) == -1) {
+		asmlog_error("relay: epoll_ctl, %s", strerror(errno));
+		upstream_disconnect(u, now);
+	}
+}
+
+// Take the resolver thread's answers, and connect to the upstreams it found
+static void upstreams_resolved(uint64_t now)
+{
+	struct upstream *u;
+	uint64_t count;
+	int i, rv;
+
+	if (read(resolve_fd, &count, sizeof(count)) != sizeof(count)) return;
+
+	for (i = 0; i < upstream_count; i++) {
+		u = &upstreams[i];
+		pthread_mutex_lock(&resolve_lock);
+		if (u->resolve != RESOLVE_DONE) {
+			pthread_mutex_unlock(&resolve_lock);
+			continue;
+		}
+		u->resolve = RESOLVE_NONE;
+		rv = u->resolve_error;
+		if (rv == 0) u->addrlen = u->resolved;
+		pthread_mutex_unlock(&resolve_lock);
+
+		if (rv != 0) {
+			if (!u->failed) asmlog_error("relay: %s, %s", u->name, gai_strerror(rv));
+			u->failed = 1;
+		} else if (u->fd == -1) {
+			upstream_connect(u, now);
+		}
+	}
+}
+
+// Ask for the next snapshot, unless ASM_RELAY_PIPELINE requests are unanswered already
+static int upstream_request(struct upstream *u)
+{
+	uint32_t request = ASM_REQUEST_V2;
+
+	if (u->in_flight >= ASM_RELAY_PIPELINE) return 0;
+	if (send(u->fd, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) {
+		asmlog_warning("relay: %s, send, %s", u->name, strerror(errno));
+		return 1;
+	}
+	u->in_flight++;
+	return 0;
+}
+
+// Decode the instance records of a reply, see send_v2()
+static int upstream_decode(struct upstream *u, const unsigned char *p, size_t len, int count,
+                           uint64_t upstream_now, uint64_t now)
+{
+	const unsigned char *end = p + len, *record_end;
+	struct relay_instance *instances, *instance;
+	unsigned type, size, n;
+	uint64_t value;
+
+	if (count > u->room) {
+		if ((instances = realloc(u->instances, count * sizeof(*instances))) == NULL) {
+			return 1;
+		}
+		u->instances = instances;
+		u->room      = count;
+	}
+
+	u->count = 0;
+	while (u->count < count && p + 4 <= end) {
+		instance = &u->instances[u->count];
+		memset(instance, 0, sizeof(*instance));
+		instance->id = *((const uint16_t *)p);
+		record_end   = p + 4 + *((const uint16_t *)(p + 2));
+		p += 4;
+		if (record_end > end || instance->id >= ASM_MAX_SLOTS) return 1;
+
+		while (p + 4 <= record_end) {
+			type = *((const uint16_t *)p);
+			size = *((const uint16_t *)(p + 2));
+			p += 4;
+			if (p + size > record_end) return 1;
+			if (type < ASM_FIELDS && relay_fields[type].size != 0) {
+				unsigned char *field = (unsigned char *)&instance->info + relay_fields[type].offset;
+
+				if (type == ASM_FIELD_MISSION || type == ASM_FIELD_PROFILE) {
+					// Always terminated, however long the upstream's string
+					n = size < SMALSTRINGSIZE - 1 ? size : SMALSTRINGSIZE - 1;
+					memcpy(field, p, n);
+					field[n] = '\0';
+				} else if (size == sizeof(uint64_t)) {
+					value = *((const uint64_t *)p);
+					if ((type == ASM_FIELD_STARTED || type == ASM_FIELD_UPDATED) && value != 0) {
+						// On the relay's clock
+						value = value + now - upstream_now;
+					}
+					if (relay_fields[type].size == 4) {
+						*((uint32_t *)field) = value > UINT32_MAX ? UINT32_MAX : value;
+					} else {
+						*((uint64_t *)field) = value;
+					}
+				}
+			}
+			p += size;
+		}
+		p = record_end;
+		u->count++;
+	}
+	return 0;
+}
+
+/*
+ * Take a complete reply:
+ *
+ *   uint16  version
+ *   uint16  number of instances
+ *   uint64  the upstream's CLOCK_MONOTONIC time, ns
+ *   the instance records
+ */
+static int upstream_reply(struct upstream *u, const unsigned char *body, size_t len, uint64_t now)
+{
+	unsigned char *records;
+
+	if (u->in_flight > 0) u->in_flight--;
+	if (len < 12 || *((const uint16_t *)body) != ASM_PROTOCOL_VERSION) {
+		asmlog_error("relay: %s sent a reply this relay does not understand", u->name);
+		return 1;
+	}
+	stats.replies++;
+	u->replied = now;
+	if (u->stale) {
+		asmlog_info("relay: %s is replying again", u->name);
+		u->stale = 0;
+	}
+
+	if (len - 12 != u->len || memcmp(u->records, body + 12, len - 12) != 0) {
+		if ((records = realloc(u->records, len - 12 > 0 ? len - 12 : 1)) == NULL) {
+			return 1;
+		}
+		u->records = records;
+		u->len     = len - 12;
+		memcpy(u->records, body + 12, u->len);
+		generation++;
+	}
+	// Decoded every time, as the times move to the relay's clock
+	if (upstream_decode(u, u->records, u->len, *((const uint16_t *)(body + 2)),
+	                    *((const uint64_t *)(body + 4)), now) != 0) {
+		asmlog_error("relay: %s sent a malformed reply", u->name);
+		return 1;
+	}
+	return 0;
+}
+
+// Read what the upstream sent, and take each complete reply
+static int upstream_read(struct upstream *u, uint64_t now)
+{
+	unsigned char *in;
+	uint32_t len;
+	ssize_t rv;
+
+	for (;;) {
+		if (u->got >= 4) {
+			len = *((uint32_t *)u->in);
+			if (len > RELAY_MAX_REPLY) {
+				asmlog_error("relay: %s sent a %u byte reply", u->name, len);
+				return 1;
+			}
+			if (u->got >= 4 + len) {
+				if (upstream_reply(u, u->in + 4, len, now) != 0) return 1;
+				memmove(u->in, u->in + 4 + len, u->got - 4 - len);
+				u->got -= 4 + len;
+				continue;
+			}
+			if (u->size < 4 + len) {
+				if ((in = realloc(u->in, 4 + len)) == NULL) return 1;
+				u->in   = in;
+				u->size = 4 + len;
+			}
+		} else if (u->size < 4) {
+			if ((in = realloc(u->in, 4096)) == NULL) return 1;
+			u->in   = in;
+			u->size = 4096;
+		}
+
+		rv = recv(u->fd, u->in + u->got, u->size - u->got, 0);
+		if (rv == 0) return 1;
+		if (rv == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			asmlog_warning("relay: %s, recv, %s", u->name, strerror(errno));
+			return 1;
+		}
+		u->got += rv;
+	}
+}
+
+static void upstream_ready(struct upstream *u, uint32_t events, uint64_t now)
+{
+	struct epoll_event ev;
+	int error = 0;
+	socklen_t size = sizeof(error);
+
+	if (u->connecting) {
+		getsockopt(u->fd, SOL_SOCKET, SO_ERROR, &error, &size);
+		if (error != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+			if (!u->failed) asmlog_warning("relay: %s, %s", u->name, strerror(error != 0 ? error : ECONNREFUSED));
+			u->failed = 1;
+			upstream_disconnect(u, now);
+			return;
+		}
+		asmlog_info("relay: connected to %s", u->name);
+		u->connecting = 0;
+		u->failed     = 0;
+		u->replied    = now;
+		u->next       = now;
+		ev.events     = EPOLLIN;
+		ev.data.ptr   = u;
+		if (epoll_ctl(relay_epfd, EPOLL_CTL_MOD, u->fd, &ev) == -1) {
+			upstream_disconnect(u, now);
+		}
+		return;
+	}
+	if (upstream_read(u, now) != 0) {
+		upstream_disconnect(u, now);
+	}
+}
+
+/*
+ * Start relaying from the upstream daemons, each given as host[:port].
+ *
+ * Returns the descriptor for the caller's event loop to watch, readable
+ * when asm_relay_ready() has something to do, or -1 on failure.
+ */
+int asm_relay_open(char **specs, int count)
+{
+	struct epoll_event ev;
+	uint64_t now = monotonic_ns();
+	int i, rv;
+
+	if ((relay_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		asmlog_error("relay: epoll_create1, %s", strerror(errno));
+		return -1;
+	}
+	if ((resolve_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		asmlog_error("relay: eventfd, %s", strerror(errno));
+		asm_relay_close();
+		return -1;
+	}
+	ev.events   = EPOLLIN;
+	ev.data.ptr = NULL; // not an upstream
+	if (epoll_ctl(relay_epfd, EPOLL_CTL_ADD, resolve_fd, &ev) == -1) {
+		asmlog_error("relay: epoll_ctl, %s", strerror(errno));
+		asm_relay_close();
+		return -1;
+	}
+	if ((upstreams = calloc(count, sizeof(*upstreams))) == NULL) {
+		asm_relay_close();
+		return -1;
+	}
+	upstream_count = count;
+	for (i = 0; i < count; i++) {
+		upstreams[i].fd   = -1;
+		upstreams[i].next = now;
+		if (upstream_parse(&upstreams[i], specs[i]) != 0) {
+			asmlog_error("relay: cannot make sense of %s, expected host[:port]", specs[i]);
+			asm_relay_close();
+			return -1;
+		}
+		asmlog_info("relay: instances of %s are %d to %d", upstreams[i].name,
+		            ASM_RELAY_ID(i, 0), ASM_RELAY_ID(i, ASM_MAX_SLOTS - 1));
+	}
+	resolver_stopping = 0;
+	if ((rv = pthread_create(&resolver_thread, NULL, resolver_main, NULL)) != 0) {
+		asmlog_error("relay: pthread_create(): %s", strerror(rv));
+		asm_relay_close();
+		return -1;
+	}
+	resolver_running = 1;
+	return relay_epfd;
+}
+
+// Stops the resolver thread first, which waits for a lookup in progress
+void asm_relay_close(void)
+{
+	int i;
+
+	if (resolver_running) {
+		pthread_mutex_lock(&resolve_lock);
+		resolver_stopping = 1;
+		pthread_cond_signal(&resolve_cond);
+		pthread_mutex_unlock(&resolve_lock);
+		pthread_join(resolver_thread, NULL);
+		resolver_running = 0;
+	}
+
+	for (i = 0; i < upstream_count; i++) {
+		if (upstreams[i].fd != -1) close(upstreams[i].fd);
+		free(upstreams[i].in);
+		free(upstreams[i].records);
+		free(upstreams[i].instances);
+	}
+	free(upstreams);
+	upstreams      = NULL;
+	upstream_count = 0;
+	if (relay_epfd != -1) close(relay_epfd);
+	relay_epfd = -1;
+	if (resolve_fd != -1) close(resolve_fd);
+	resolve_fd = -1;
+}
+
+// When asm_relay_poll() next has something to do, in monotonic_ns()
+uint64_t asm_relay_due(void)
+{
+	uint64_t due = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < upstream_count; i++) {
+		if (!upstreams[i].connecting && upstreams[i].next < due) due = upstreams[i].next;
+	}
+	return due;
+}
+
+// Handle whatever the upstream connections are ready for
+void asm_relay_ready(uint64_t now)
+{
+	struct epoll_event events[RELAY_EVENTS];
+	int n, i;
+
+	while ((n = epoll_wait(relay_epfd, events, RELAY_EVENTS, 0)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL) {
+				upstreams_resolved(now);
+			} else {
+				upstream_ready(events[i].data.ptr, events[i].events, now);
+			}
+		}
+		if (n < RELAY_EVENTS) break;
+	}
+}
+
+// Poll the upstreams that are due, and reconnect to the ones that went away
+void asm_relay_poll(uint64_t now)
+{
+	struct upstream *u;
+	int i;
+
+	for (i = 0; i < upstream_count; i++) {
+		u = &upstreams[i];
+		if (u->fd == -1) {
+			if (now >= u->next) upstream_connect(u, now);
+			continue;
+		}
+		if (u->connecting) {
+			if (now >= u->replied + ASM_RELAY_RECONNECT * 1000000ULL) {
+				if (!u->failed) asmlog_warning("relay: %s, connection timed out", u->name);
+				u->failed = 1;
+				upstream_disconnect(u, now);
+			}
+			continue;
+		}
+		if (now < u->next) continue;
+
+		u->next = now + ASM_RELAY_INTERVAL * 1000000ULL;
+		if (!u->stale && now >= u->replied + ASM_RELAY_STALE * 1000000ULL) {
+			asmlog_warning("relay: %s has not replied for %d ms", u->name, ASM_RELAY_STALE);
+			u->stale = 1;
+		}
+		if (now >= u->replied + DEAD_TIMEOUT_NS) {
+			upstream_disconnect(u, now);
+			continue;
+		}
+		if (upstream_request(u) != 0) {
+			upstream_disconnect(u, now);
+		}
+	}
+}
+
+// Changes whenever any upstream sent something new, or went away
+uint32_t asm_relay_generation(void)
+{
+	return generation;
+}
+
+// The first relayed instance id at or after from, or -1 if there are none
+int asm_relay_next(int from)
+{
+	int u, i, id;
+
+	for (u = from / ASM_MAX_SLOTS; u < upstream_count; u++) {
+		id = u == from / ASM_MAX_SLOTS ? from % ASM_MAX_SLOTS : 0;
+		for (i = 0; i < upstreams[u].count; i++) {
+			if (upstreams[u].instances[i].id >= id) {
+				return ASM_RELAY_ID(u, upstreams[u].instances[i].id);
+			}
+		}
+	}
+	return -1;
+}
+
+// Copy a relayed instance, like asi_read(). Returns 0 on success.
+int asm_relay_read(int id, struct ASM_INSTANCE *copy)
+{
+	const struct upstream *u;
+	int i;
+
+	if (id < 0 || id / ASM_MAX_SLOTS >= upstream_count) return 1;
+	u = &upstreams[id / ASM_MAX_SLOTS];
+	for (i = 0; i < u->count; i++) {
+		if (u->instances[i].id == id % ASM_MAX_SLOTS) {
+			memcpy(copy, &u->instances[i].info, sizeof(*copy));
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// The upstream that a relayed instance is from, as given to -r
+const char *asm_relay_host(int id)
+{
+	return id >= 0 && id / ASM_MAX_SLOTS < upstream_count ? upstreams[id / ASM_MAX_SLOTS].name : "";
+}
+
+const struct asm_relay_stats *asm_relay_stats(void)
+{
+	int i;
+
+	stats.connected = 0;
+	stats.stale     = 0;
+	for (i = 0; i < upstream_count; i++) {
+		if (upstreams[i].fd != -1 && !upstreams[i].connecting) stats.connected++;
+		if (upstreams[i].stale) stats.stale++;
+	}
+	return &stats;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASMRELAY_H_
+#define ASMRELAY_H_
+
+#include <stdint.h>
+
+#include "asm.h"
+
+/*
+ * Relay mode: serve the instances of a number of upstream daemons
+ * instead of the ones in local shared memory.
+ *
+ * Each upstream is polled for v2 snapshots over a connection of its own,
+ * all of them from the event loop, with up to ASM_RELAY_PIPELINE requests
+ * in flight so that a slow link does not halve the polling rate. The
+ * relay always serves the last reply of each upstream, so one slow or
+ * dead upstream never holds up the others. Host names are looked up on
+ * a thread of their own, so a slow name server does not hold up the loop
+ * either. Times are moved to the relay's CLOCK_MONOTONIC with the time in
+ * the header of each reply.
+ */
+#define ASM_RELAY_HOST_SIZE 64   // host[:port] of an upstream, as given to -r
+#define ASM_RELAY_INTERVAL  1000 // ms between polls of an upstream
+#define ASM_RELAY_PIPELINE  2    // requests in flight per upstream
+#define ASM_RELAY_STALE     (3 * ASM_RELAY_INTERVAL) // ms without a reply before an upstream is stale
+#define ASM_RELAY_RECONNECT 5000 // ms between connection attempts
+
+struct asm_relay_stats
+{
+	uint64_t replies;
+	uint64_t reconnects;
+	int      connected; // upstreams
+	int      stale;     // upstreams that are connected but not replying
+};
+
+int  asm_relay_open(char **upstreams, int count);
+void asm_relay_close(void);
+
+uint64_t asm_relay_due(void);
+void asm_relay_ready(uint64_t now);
+void asm_relay_poll(uint64_t now);
+
+uint32_t    asm_relay_generation(void);
+int         asm_relay_next(int from);
+int         asm_relay_read(int id, struct ASM_INSTANCE *copy);
+const char *asm_relay_host(int id);
+
+const struct asm_relay_stats *asm_relay_stats(void);
+
+#endif /* ASMRELAY_H_ */
@@ -0,0 +1,508 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asm.h"
+#include "rollup.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define ROLLUP_X86 1
+#endif
+
+#define ROLLUP_FIELDS __builtin_popcount(ASM_ARCHIVE_FIELDS)
+#define NO_BUCKET     UINT64_MAX
+
+/*
+ * A ring of buckets. The aggregates are arrays of cap numbers per field,
+ * field j of bucket s at [j * cap + s % cap]. In the first tier a bucket
+ * is a sample, and min, max, sum and last are the same array.
+ */
+struct tier
+{
+	int       cap;
+	uint64_t  seq;        // buckets so far
+	uint64_t *time;       // start, ms since the epoch
+	uint64_t *count;      // samples
+	uint64_t *min;
+	uint64_t *max;
+	uint64_t *sum;
+	uint64_t *last;
+	uint64_t  open;       // start of the bucket that is filling, or NO_BUCKET
+	uint64_t  open_from;  // its first bucket in the tier below
+};
+
+struct rollup
+{
+	int         id;
+	struct tier tiers[ASM_ROLLUP_TIERS];
+};
+
+static const uint32_t           resolutions[ASM_ROLLUP_TIERS] = ASM_ROLLUP_RESOLUTIONS;
+static int                      retention[ASM_ROLLUP_TIERS] = ASM_ROLLUP_RETENTION;
+static struct rollup          **rollups = NULL;  // in id order
+static int                      rollup_count = 0;
+static int                      rollup_room = 0;
+static const struct asm_rollup_kernels *kernels = NULL;
+static struct asm_rollup_stats  stats;
+
+static uint64_t min_scalar(const uint64_t *v, size_t n)
+{
+	uint64_t m = UINT64_MAX;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (v[i] < m) m = v[i];
+	}
+	return m;
+}
+
+static uint64_t max_scalar(const uint64_t *v, size_t n)
+{
+	uint64_t m = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (v[i] > m) m = v[i];
+	}
+	return m;
+}
+
+static uint64_t sum_scalar(const uint64_t *v, size_t n)
+{
+	uint64_t s = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		s += v[i];
+	}
+	return s;
+}
+
+static const struct asm_rollup_kernels scalar = { "scalar", min_scalar, max_scalar, sum_scalar };
+
+#ifdef ROLLUP_X86
+/*
+ * SSE2 has no 64-bit compare. Numbers are compared as signed after
+ * flipping their top bits: the high halves decide, unless they are equal,
+ * and then the sign of b - a does.
+ */
+__attribute__((target("sse2")))
+static inline __m128i gt_sse2(__m128i a, __m128i b)
+{
+	__m128i r = _mm_and_si128(_mm_cmpeq_epi32(a, b), _mm_sub_epi64(b, a));
+
+	r = _mm_or_si128(r, _mm_cmpgt_epi32(a, b));
+	return _mm_shuffle_epi32(_mm_srai_epi32(r, 31), _MM_SHUFFLE(3, 3, 1, 1));
+}
+
+__attribute__((target("sse2")))
+static uint64_t minmax_sse2(const uint64_t *v, size_t n, int max)
+{
+	const __m128i bias = _mm_set1_epi64x(INT64_MIN);
+	__m128i acc = _mm_set1_epi64x(max ? INT64_MIN : INT64_MAX), x, gt;
+	uint64_t lanes[2], m;
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		x  = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(v + i)), bias);
+		gt = max ? gt_sse2(x, acc) : gt_sse2(acc, x);
+		acc = _mm_or_si128(_mm_and_si128(gt, x), _mm_andnot_si128(gt, acc));
+	}
+	_mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(acc, bias));
+	m = max ? (lanes[0] > lanes[1] ? lanes[0] : lanes[1]) : (lanes[0] < lanes[1] ? lanes[0] : lanes[1]);
+	for (; i < n; i++) {
+		if (max ? v[i] > m : v[i] < m) m = v[i];
+	}
+	return m;
+}
+
+__attribute__((target("sse2")))
+static uint64_t min_sse2(const uint64_t *v, size_t n)
+{
+	return minmax_sse2(v, n, 0);
+}
+
+__attribute__((target("sse2")))
+static uint64_t max_sse2(const uint64_t *v, size_t n)
+{
+	return minmax_sse2(v, n, 1);
+}
+
+__attribute__((target("sse2")))
+static uint64_t sum_sse2(const uint64_t *v, size_t n)
+{
+	__m128i acc = _mm_setzero_si128();
+	uint64_t lanes[2];
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i *)(v + i)));
+	}
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	for (lanes[0] += lanes[1]; i < n; i++) {
+		lanes[0] += v[i];
+	}
+	return lanes[0];
+}
+
+__attribute__((target("avx2")))
+static uint64_t minmax_avx2(const uint64_t *v, size_t n, int max)
+{
+	const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+	__m256i acc = _mm256_set1_epi64x(max ? INT64_MIN : INT64_MAX), x, gt;
+	uint64_t lanes[4], m;
+	size_t i;
+	int j;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		x  = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(v + i)), bias);
+		gt = max ? _mm256_cmpgt_epi64(x, acc) : _mm256_cmpgt_epi64(acc, x);
+		acc = _mm256_blendv_epi8(acc, x, gt);
+	}
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_xor_si256(acc, bias));
+	m = lanes[0];
+	for (j = 1; j < 4; j++) {
+		if (max ? lanes[j] > m : lanes[j] < m) m = lanes[j];
+	}
+	for (; i < n; i++) {
+		if (max ? v[i] > m : v[i] < m) m = v[i];
+	}
+	return m;
+}
+
+__attribute__((target("avx2")))
+static uint64_t min_avx2(const uint64_t *v, size_t n)
+{
+	return minmax_avx2(v, n, 0);
+}
+
+__attribute__((target("avx2")))
+static uint64_t max_avx2(const uint64_t *v, size_t n)
+{
+	return minmax_avx2(v, n, 1);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const uint64_t *v, size_t n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	uint64_t lanes[4];
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i *)(v + i)));
+	}
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	for (lanes[0] += lanes[1] + lanes[2] + lanes[3]; i < n; i++) {
+		lanes[0] += v[i];
+	}
+	return lanes[0];
+}
+
+static const struct asm_rollup_kernels sse2 = { "sse2", min_sse2, max_sse2, sum_sse2 };
+static const struct asm_rollup_kernels avx2 = { "avx2", min_avx2, max_avx2, sum_avx2 };
+#endif
+
+/*
+ * The kernels of that name, if the CPU can run them, or with a NULL name
+ * the fastest ones it can run
+ */
+const struct asm_rollup_kernels *asm_rollup_kernels(const char *name)
+{
+	const struct asm_rollup_kernels *all[3];
+	int count = 0, i;
+
+#ifdef ROLLUP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) all[count++] = &avx2;
+	if (__builtin_cpu_supports("sse2")) all[count++] = &sse2;
+#endif
+	all[count++] = &scalar;
+	for (i = 0; i < count; i++) {
+		if (name == NULL || strcmp(name, all[i]->name) == 0) return all[i];
+	}
+	return NULL;
+}
+
+/*
+ * Set the number of buckets kept in each tier, as a comma-separated list
+ * from the finest tier up. A tier must keep more buckets than go into one
+ * of the tier above. Returns 1 if the list is no good.
+ */
+int asm_rollup_configure(const char *list)
+{
+	int kept[ASM_ROLLUP_TIERS], tier;
+	char *end;
+
+	for (tier = 0; tier < ASM_ROLLUP_TIERS; tier++) {
+		kept[tier] = strtol(list, &end, 10);
+		if (end == list || kept[tier] <= 0 || kept[tier] > 1000000) return 1;
+		if (tier > 0 && kept[tier - 1] <= (int)(resolutions[tier] / resolutions[tier - 1])) return 1;
+		if (*end != (tier < ASM_ROLLUP_TIERS - 1 ? ',' : '\0')) return 1;
+		list = end + 1;
+	}
+	memcpy(retention, kept, sizeof(retention));
+	return 0;
+}
+
+static void tier_free(struct tier *t)
+{
+	free(t->time);
+	free(t->count);
+	free(t->min);
+}
+
+static int tier_alloc(struct tier *t, int cap, int first)
+{
+	const size_t column = cap * sizeof(uint64_t);
+
+	memset(t, 0, sizeof(*t));
+	t->cap  = cap;
+	t->open = NO_BUCKET;
+	t->time  = malloc(column);
+	t->count = malloc(column);
+	t->min   = malloc(ROLLUP_FIELDS * column * (first ? 1 : 4));
+	if (t->time == NULL || t->count == NULL || t->min == NULL) {
+		tier_free(t);
+		return 1;
+	}
+	if (first) {
+		t->max = t->sum = t->last = t->min;
+	} else {
+		t->max  = t->min + ROLLUP_FIELDS * cap;
+		t->sum  = t->max + ROLLUP_FIELDS * cap;
+		t->last = t->sum + ROLLUP_FIELDS * cap;
+	}
+	return 0;
+}
+
+// The position of the rollups of an instance, or where they would go
+static int rollup_find(int id)
+{
+	int lo = 0, hi = rollup_count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (rollups[mid]->id < id) lo = mid + 1; else hi = mid;
+	}
+	return lo;
+}
+
+static struct rollup *rollup_get(int id)
+{
+	struct rollup **grown, *r;
+	int i = rollup_find(id), tier;
+
+	if (i < rollup_count && rollups[i]->id == id) {
+		return rollups[i];
+	}
+	if (rollup_count == rollup_room) {
+		if ((grown = realloc(rollups, (rollup_room + 16) * sizeof(*rollups))) == NULL) return NULL;
+		rollups = grown;
+		rollup_room += 16;
+	}
+	if ((r = malloc(sizeof(*r))) == NULL) return NULL;
+	r->id = id;
+	for (tier = 0; tier < ASM_ROLLUP_TIERS; tier++) {
+		if (tier_alloc(&r->tiers[tier], retention[tier], tier == 0) != 0) {
+			while (tier-- > 0) tier_free(&r->tiers[tier]);
+			free(r);
+			return NULL;
+		}
+	}
+	if (kernels == NULL) kernels = asm_rollup_kernels(NULL);
+	memmove(rollups + i + 1, rollups + i, (rollup_count - i) * sizeof(*rollups));
+	rollups[i] = r;
+	rollup_count++;
+	stats.instances = rollup_count;
+	return r;
+}
+
+/*
+ * Reduce buckets from ... to - 1 of a tier, as far as they are still in
+ * the ring, and store the aggregates of the fields in mask in agg: the
+ * minimum, maximum, sum and last value of each, in field order. Returns
+ * the number of samples, 0 if there are none.
+ */
+static uint64_t tier_reduce(const struct tier *t, uint64_t from, uint64_t to, uint32_t mask, uint64_t *agg)
+{
+	size_t start, len, wrapped;
+	uint64_t count, a, b;
+	int bit, column = 0;
+
+	if (t->seq > (uint64_t)t->cap && from < t->seq - t->cap) from = t->seq - t->cap;
+	if (from >= to) return 0;
+	start   = from % t->cap;
+	len     = to - from < t->cap - start ? to - from : t->cap - start;
+	wrapped = to - from - len;
+
+	count = kernels->sum(t->count + start, len) + kernels->sum(t->count, wrapped);
+	for (bit = 0; bit < 32; bit++) {
+		const size_t base = column * t->cap;
+
+		if (!(ASM_ARCHIVE_FIELDS & (1u << bit))) continue;
+		column++;
+		if (!(mask & (1u << bit))) continue;
+		a = kernels->min(t->min + base + start, len);
+		b = kernels->min(t->min + base, wrapped);
+		*agg++ = a < b ? a : b;
+		a = kernels->max(t->max + base + start, len);
+		b = kernels->max(t->max + base, wrapped);
+		*agg++ = a > b ? a : b;
+		*agg++ = kernels->sum(t->sum + base + start, len) + kernels->sum(t->sum + base, wrapped);
+		*agg++ = t->last[base + (to - 1) % t->cap];
+	}
+	return count;
+}
+
+/*
+ * A bucket has been added to tier - 1, starting at time. If it is past
+ * the bucket that tier is filling, that one is done: reduce it, and go on
+ * to the tier above with it.
+ */
+static void rollup_cascade(struct rollup *r, int tier, uint64_t time)
+{
+	uint64_t agg[4 * ASM_FIELDS], start, closed, from, count;
+	struct tier *t, *below;
+	int column, s;
+
+	for (; tier < ASM_ROLLUP_TIERS; tier++) {
+		t      = &r->tiers[tier];
+		below  = &r->tiers[tier - 1];
+		start  = time - time % (resolutions[tier] * 1000ULL);
+		closed = t->open;
+		from   = t->open_from;
+		if (start == closed) return;
+
+		t->open      = start;
+		t->open_from = below->seq - 1;
+		if (closed == NO_BUCKET) return;
+		if ((count = tier_reduce(below, from, below->seq - 1, ASM_ARCHIVE_FIELDS, agg)) == 0) return;
+		s = t->seq % t->cap;
+		t->time[s]  = closed;
+		t->count[s] = count;
+		for (column = 0; column < ROLLUP_FIELDS; column++) {
+			t->min[column * t->cap + s]  = agg[4 * column];
+			t->max[column * t->cap + s]  = agg[4 * column + 1];
+			t->sum[column * t->cap + s]  = agg[4 * column + 2];
+			t->last[column * t->cap + s] = agg[4 * column + 3];
+		}
+		t->seq++;
+		stats.buckets++;
+		time = closed;
+	}
+}
+
+/*
+ * Add a sample of an instance, taken at time ms since the epoch, with
+ * the values of the ASM_ARCHIVE_FIELDS in field order (see asi_fields())
+ */
+void asm_rollup_add(int id, uint64_t time, const uint64_t *values)
+{
+	struct rollup *r;
+	struct tier *t;
+	int column, s;
+
+	if ((r = rollup_get(id)) == NULL) return;
+	t = &r->tiers[0];
+	// Buckets go forward in time; skip samples from before a clock step back
+	if (t->seq > 0 && time <= t->time[(t->seq - 1) % t->cap]) return;
+
+	s = t->seq % t->cap;
+	t->time[s]  = time;
+	t->count[s] = 1;
+	for (column = 0; column < ROLLUP_FIELDS; column++) {
+		t->min[column * t->cap + s] = values[column];
+	}
+	t->seq++;
+	rollup_cascade(r, 1, time);
+}
+
+/*
+ * Aggregate the samples of an instance from ... to ms since the epoch
+ * into buckets of *resolution seconds (0 is taken as 1), made from the
+ * coarsest tier whose resolution divides it. Writes up to max buckets to
+ * out, in the format of the reply to ASM_REQUEST_ROLLUP, and returns how
+ * many. Only as much as that tier keeps is there.
+ */
+int asm_rollup_query(int id, uint32_t mask, uint32_t *resolution, uint64_t from, uint64_t to,
+                     unsigned char *out, int max)
+{
+	const int fields = __builtin_popcount(mask & ASM_ARCHIVE_FIELDS);
+	const struct rollup *r;
+	const struct tier *t;
+	uint64_t step, start, s, e;
+	int tier, i, n = 0;
+
+	stats.queries++;
+	if (*resolution == 0) *resolution = 1;
+	for (tier = ASM_ROLLUP_TIERS - 1; tier > 0 && *resolution % resolutions[tier] != 0; tier--);
+
+	i = rollup_find(id);
+	if (i >= rollup_count || rollups[i]->id != id) return 0;
+	r = rollups[i];
+	t = &r->tiers[tier];
+	step = *resolution * 1000ULL;
+
+	s = t->seq > (uint64_t)t->cap ? t->seq - t->cap : 0;
+	while (s < t->seq && n < max) {
+		start = t->time[s % t->cap];
+		if (start < from) {
+			s++;
+			continue;
+		}
+		if (start > to) break;
+		start -= start % step;
+		for (e = s + 1; e < t->seq && t->time[e % t->cap] < start + step && t->time[e % t->cap] <= to; e++);
+
+		*((uint64_t *)out)       = start;
+		*((uint64_t *)(out + 8)) = tier_reduce(t, s, e, mask, (uint64_t *)(out + 16));
+		out += (2 + 4 * fields) * sizeof(uint64_t);
+		n++;
+		s = e;
+	}
+	return n;
+}
+
+void asm_rollup_free(void)
+{
+	int tier;
+
+	while (rollup_count > 0) {
+		rollup_count--;
+		for (tier = 0; tier < ASM_ROLLUP_TIERS; tier++) {
+			tier_free(&rollups[rollup_count]->tiers[tier]);
+		}
+		free(rollups[rollup_count]);
+	}
+	free(rollups);
+	rollups = NULL;
+	rollup_room = 0;
+}
+
+const struct asm_rollup_stats *asm_rollup_stats(void)
+{
+	return &stats;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASMROLLUP_H_
+#define ASMROLLUP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "asm.h"
+
+/*
+ * Rollups of the samples of each instance, for trends over longer times
+ * than the archive is quick to read back, see ASM_REQUEST_ROLLUP.
+ *
+ * The per-second samples of the ASM_ARCHIVE_FIELDS go into the first of
+ * ASM_ROLLUP_TIERS tiers, each a ring of buckets. Once a bucket of a tier
+ * has passed, the buckets of the tier below that it covers are reduced
+ * into it: the number of samples, and for each field the minimum, the
+ * maximum, the sum and the last value. The rings are kept as structures
+ * of arrays, one array per field and aggregate, so that a reduction is a
+ * pass over a contiguous run of 64-bit numbers, done with SSE2 or AVX2
+ * when the CPU has them.
+ *
+ * Buckets start at whole multiples of their resolution on the wall clock.
+ * Only buckets that have passed are in a tier; a sample shows up in the
+ * 10 s tier 10 to 20 s later, and in the hourly tier about a minute after
+ * the hour.
+ */
+#define ASM_ROLLUP_TIERS       4
+#define ASM_ROLLUP_RESOLUTIONS { 1, 10, 60, 3600 }
+// Buckets kept in each tier, unless set with -k
+#define ASM_ROLLUP_RETENTION   { 600, 360, 1440, 168 }
+
+// Reductions of n 64-bit numbers
+struct asm_rollup_kernels
+{
+	const char *name;
+	uint64_t  (*min)(const uint64_t *v, size_t n);
+	uint64_t  (*max)(const uint64_t *v, size_t n);
+	uint64_t  (*sum)(const uint64_t *v, size_t n);
+};
+
+struct asm_rollup_stats
+{
+	uint64_t instances;
+	uint64_t buckets;   // reduced from the tier below
+	uint64_t queries;
+};
+
+const struct asm_rollup_kernels *asm_rollup_kernels(const char *name);
+int  asm_rollup_configure(const char *retention);
+void asm_rollup_add(int id, uint64_t time, const uint64_t *values);
+int  asm_rollup_query(int id, uint32_t mask, uint32_t *resolution, uint64_t from, uint64_t to,
+                      unsigned char *out, int max);
+void asm_rollup_free(void);
+const struct asm_rollup_stats *asm_rollup_stats(void);
+
+#endif /* ASMROLLUP_H_ */
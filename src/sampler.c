@@ -0,0 +1,348 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Background sampler thread for asmdll.so
+ *
+ * Collects process-level metrics from /proc at a fixed interval and
+ * publishes them into the instance's slot, so that the Arma server thread
+ * never has to touch /proc itself.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "asm.h"
+#include "asi.h"
+#include "asmlog.h"
+#include "gettickcount.h"
+#include "sampler.h"
+
+// Nice value for the sampler thread
+#define SAMPLER_NICE 10
+
+static pthread_t       sampler_thread;
+static pthread_mutex_t sampler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  sampler_cond;
+static int             sampler_running = 0;
+static long            sampler_interval;
+static long            history_interval;
+
+static struct ASM_SLOT *sampler_slot = NULL;
+
+// Cached /proc file descriptors, opened once when the thread is started
+static int statm_fd = -1;
+static int stat_fd  = -1;
+static int io_fd    = -1;
+
+static long pagesize;
+static long clk_tck;
+
+/*
+ * Read a /proc file from the start into buf. Returns the number of bytes read,
+ * or -1 if the file could not be read.
+ */
+static ssize_t proc_read(int fd, char *buf, size_t size)
+{
+	ssize_t n;
+
+	if (fd < 0) return -1;
+
+	do {
+		n = pread(fd, buf, size - 1, 0);
+	} while (n == -1 && errno == EINTR);
+	if (n < 0) return -1;
+
+	buf[n] = '\0';
+	return n;
+}
+
+// Resident set size, in bytes
+static int sample_mem(uint64_t *mem)
+{
+	char buf[128];
+	long rss;
+
+	if (proc_read(statm_fd, buf, sizeof(buf)) < 0) return 1;
+
+	// The second number in statm is the size of the in-memory working set (RSS)
+	if (sscanf(buf, "%*s%ld", &rss) != 1) return 1;
+
+	*mem = (uint64_t)rss * pagesize;
+	return 0;
+}
+
+// User + system CPU time, in clock ticks
+static int sample_cpu(unsigned long long *ticks)
+{
+	char buf[1024];
+	char *p;
+	unsigned long long utime, stime;
+
+	if (proc_read(stat_fd, buf, sizeof(buf)) < 0) return 1;
+
+	// Skip past the command name, which may contain spaces and parentheses.
+	// utime and stime are the 12th and 13th fields after it.
+	if ((p = strrchr(buf, ')')) == NULL) return 1;
+	if (sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+		return 1;
+	}
+
+	*ticks = utime + stime;
+	return 0;
+}
+
+// Find a "name: value" line in a /proc file
+static int proc_field(const char *buf, const char *name, unsigned long long *value)
+{
+	size_t len = strlen(name);
+	const char *p = buf;
+
+	while (p != NULL && *p != '\0') {
+		if (strncmp(p, name, len) == 0 && p[len] == ':') {
+			return sscanf(p + len + 1, "%llu", value) == 1 ? 0 : 1;
+		}
+		if ((p = strchr(p, '\n')) != NULL) {
+			p++;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Bytes read from and written to storage.
+ *
+ * read_bytes/write_bytes count what actually went to the block layer.
+ * Fall back to rchar/wchar, which include page cache hits, if they are
+ * missing.
+ */
+static int sample_io(unsigned long long *rbytes, unsigned long long *wbytes)
+{
+	char buf[512];
+
+	if (proc_read(io_fd, buf, sizeof(buf)) < 0) return 1;
+
+	if (proc_field(buf, "read_bytes", rbytes) != 0 && proc_field(buf, "rchar", rbytes) != 0) {
+		return 1;
+	}
+	if (proc_field(buf, "write_bytes", wbytes) != 0 && proc_field(buf, "wchar", wbytes) != 0) {
+		return 1;
+	}
+	return 0;
+}
+
+// Rate of change of a byte counter, in bytes per second
+static uint64_t bytes_per_sec(unsigned long long now, unsigned long long last, double seconds)
+{
+	if (now < last || seconds <= 0) return 0;
+
+	return (now - last) / seconds + 0.5;
+}
+
+static double elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+// Add the current values of the slot to its rolling history
+static void history_append(struct ASM_SLOT *slot)
+{
+	struct ASM_INSTANCE copy;
+	struct ASI_SAMPLE sample;
+
+	if (asi_read(&slot->INFO, &copy) != 0) return;
+
+	sample.TIME          = monotonic_ns();
+	sample.SERVER_FPS    = copy.SERVER_FPS;
+	sample.SERVER_FPSMIN = copy.SERVER_FPSMIN;
+	sample.FSM_CE_FREQ   = copy.FSM_CE_FREQ;
+	sample.PLAYER_COUNT  = copy.PLAYER_COUNT;
+	sample.AI_LOC_COUNT  = copy.AI_LOC_COUNT;
+	sample.AI_REM_COUNT  = copy.AI_REM_COUNT;
+	sample.MEM           = copy.MEM;
+	asi_history_append(slot, &sample);
+}
+
+static void *sampler_main(void *arg)
+{
+	struct timespec deadline, now, last, io_last, history_last;
+	unsigned long long cpu, last_cpu = 0;
+	unsigned long long rbytes = 0, wbytes = 0, last_rbytes = 0, last_wbytes = 0;
+	int have_cpu = 0, have_io_last = 0;
+
+	(void)arg;
+
+	// Stay out of the way of the Arma server threads
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), SAMPLER_NICE) != 0) {
+		asmlog_debug("sampler: setpriority(): %s", strerror(errno));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	last = io_last = history_last = deadline;
+
+	pthread_mutex_lock(&sampler_lock);
+	while (sampler_running) {
+		struct ASM_SLOT *slot;
+		uint64_t mem = 0, disc_read = 0, disc_write = 0;
+		uint32_t cpu_load = 0;
+		int have_mem, have_io;
+
+		pthread_mutex_unlock(&sampler_lock);
+
+		// Collect everything first, then publish it in one short update
+		have_mem = sample_mem(&mem) == 0;
+		have_io  = sample_io(&rbytes, &wbytes) == 0;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (sample_cpu(&cpu) == 0) {
+			if (have_cpu && elapsed(&last, &now) > 0) {
+				cpu_load = (cpu - last_cpu) * 10000.0 / clk_tck / elapsed(&last, &now) + 0.5;
+			}
+			last_cpu = cpu;
+			have_cpu = 1;
+		}
+		last = now;
+		if (have_io) {
+			if (have_io_last) {
+				disc_read  = bytes_per_sec(rbytes, last_rbytes, elapsed(&io_last, &now));
+				disc_write = bytes_per_sec(wbytes, last_wbytes, elapsed(&io_last, &now));
+			}
+			last_rbytes  = rbytes;
+			last_wbytes  = wbytes;
+			io_last      = now;
+			have_io_last = 1;
+		}
+
+		slot = __atomic_load_n(&sampler_slot, __ATOMIC_ACQUIRE);
+		if (slot != NULL) {
+			struct ASM_INSTANCE *asi = &slot->INFO;
+
+			asi_write_begin(asi, ASI_WRITER_SAMPLER);
+			if (have_mem) {
+				asi->MEM = mem;
+			}
+			asi->CPU_LOAD = cpu_load;
+			if (have_io) {
+				asi->IO_READ    = rbytes;
+				asi->IO_WRITE   = wbytes;
+				asi->DISC_READ  = disc_read;
+				asi->DISC_WRITE = disc_write;
+			}
+			asi_write_end(asi, ASI_WRITER_SAMPLER);
+
+			if (history_interval > 0 && elapsed(&history_last, &now) * 1000 >= history_interval) {
+				history_append(slot);
+				history_last = now;
+			}
+		}
+
+		deadline.tv_sec  += sampler_interval / 1000;
+		deadline.tv_nsec += (sampler_interval % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock(&sampler_lock);
+		while (sampler_running && pthread_cond_timedwait(&sampler_cond, &sampler_lock, &deadline) != ETIMEDOUT) {
+			;
+		}
+	}
+	pthread_mutex_unlock(&sampler_lock);
+
+	return NULL;
+}
+
+/*
+ * Open the /proc files and start the sampler thread. It takes a sample
+ * every interval_ms, and adds one to the rolling history every history_ms.
+ *
+ * Returns 0 on success.
+ */
+int sampler_start(long interval_ms, long history_ms)
+{
+	pthread_condattr_t attr;
+	int rv;
+
+	if (interval_ms <= 0) return 1;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	clk_tck  = sysconf(_SC_CLK_TCK);
+	sampler_interval = interval_ms;
+	history_interval = history_ms;
+
+	statm_fd = open("/proc/self/statm", O_RDONLY|O_CLOEXEC);
+	stat_fd  = open("/proc/self/stat", O_RDONLY|O_CLOEXEC);
+	io_fd    = open("/proc/self/io", O_RDONLY|O_CLOEXEC);
+	if (io_fd < 0) {
+		// Needs CONFIG_TASK_IO_ACCOUNTING
+		asmlog_warning("sampler: no I/O statistics, /proc/self/io: %s", strerror(errno));
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sampler_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	sampler_running = 1;
+	if ((rv = pthread_create(&sampler_thread, NULL, sampler_main, NULL)) != 0) {
+		asmlog_error("sampler: pthread_create(): %s", strerror(rv));
+		sampler_running = 0;
+		sampler_stop();
+		return 1;
+	}
+
+	asmlog_debug("sampler: started, interval %ld ms", interval_ms);
+	return 0;
+}
+
+// Start publishing samples into this slot, with an empty history
+void sampler_attach(struct ASM_SLOT *slot)
+{
+	asi_history_reset(slot, history_interval);
+	__atomic_store_n(&sampler_slot, slot, __ATOMIC_RELEASE);
+}
+
+// Stop and join the sampler thread, and close the /proc files
+void sampler_stop(void)
+{
+	pthread_mutex_lock(&sampler_lock);
+	if (sampler_running) {
+		sampler_running = 0;
+		pthread_cond_signal(&sampler_cond);
+		pthread_mutex_unlock(&sampler_lock);
+		pthread_join(sampler_thread, NULL);
+		asmlog_debug("sampler: stopped");
+	} else {
+		pthread_mutex_unlock(&sampler_lock);
+	}
+	__atomic_store_n(&sampler_slot, NULL, __ATOMIC_RELEASE);
+
+	if (statm_fd > -1) { close(statm_fd); statm_fd = -1; }
+	if (stat_fd > -1)  { close(stat_fd);  stat_fd  = -1; }
+	if (io_fd > -1)    { close(io_fd);    io_fd    = -1; }
+}
@@ -33,219 +33,1866 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <sys/un.h>
+#include <time.h>
+#include <linux/sockios.h>
 #include <netdb.h>
 
+#include "archive.h"
 #include "asm.h"
+#include "asi.h"
 #include "asmlog.h"
 #include "config.h"
+#include "delta.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "notify.h"
+#include "relay.h"
+#include "rollup.h"
 #include "server.h"
 #include "settings.h"
+#include "shm.h"
+#include "tsblock.h"
 #include "util.h"
 #include "gettickcount.h"
 
-extern char*  prog_name;
-extern char** args;
-extern int    argsc;
+extern int    port;
+extern int    max_clients;
+extern int    running;
+extern char   broadcast_group[];
+extern int    broadcast_interval;
+extern int    metrics_port;
+extern char   local_socket[];
+extern char  *upstreams[];
+extern int    upstream_count;
+extern char   archive[];
+extern int    write_timeout;
+extern int    idle_timeout;
+
+static int    connected_clients = 0;
+static int    connections = 0; // number of connections accepted so far
+static int    http_clients = 0; // connected to metrics_port
+
+/*
+ * A connected client. All clients are served by the one event loop in
+ * asmserver(), so a client is a small state machine: it reads a 4-byte
+ * request, then writes the reply, then reads the next request.
+ */
+enum client_state {
+	CLIENT_READING,
+	CLIENT_WRITING
+};
+
+// A request from a client of the metrics port
+#define HTTP_REQUEST_SIZE 2048
+#define HTTP_MAX_CLIENTS  16
+
+struct http_request {
+	char   buf[HTTP_REQUEST_SIZE]; // NUL terminated
+	size_t got;
+	int    close;   // close the connection once the reply is sent
+};
+
+/*
+ * The counters of one connection. Only the event loop touches them, and
+ * they are added up with those of the closed connections when read, see
+ * client_totals().
+ */
+struct client_stats {
+	uint64_t             requests;
+	uint64_t             bytes_sent;
+	uint64_t             partial_writes; // send() took some of the bytes
+	uint64_t             interrupted;    // send() failed with EINTR
+	struct asm_histogram latency;        // from a request to the last byte of its reply
+};
+
+struct client {
+	int               fd;
+	int               id;       // connection number, for the log
+	enum client_state state;
+	int               got;      // bytes of the current request received
+	unsigned char     req[4];
+	unsigned char    *out;      // the reply, out[head..tail) is still unsent
+	size_t            head;
+	size_t            tail;
+	size_t            size;
+	uint32_t          request;  // a request still waiting for its arguments, or 0
+	uint32_t          args[7];  // ... those received so far
+	int               argc;
+	int               subscribed;
+	uint32_t          interval; // push interval, ms
+	uint32_t          pushed;   // serial of the last snapshot pushed
+	uint64_t          next_push;
+	struct asm_delta *delta;    // the last snapshot sent, if delta-encoding
+	uint32_t          keyframes; // frames between keyframes
+	uint32_t          frames;   // frames since the last keyframe
+	struct http_request *http;  // a client of the metrics port, or NULL
+	int               local;    // connected to the Unix-domain socket
+	uint64_t          active;   // monotonic_ns() of the last request, for idle_timeout
+	uint64_t          behind;   // monotonic_ns() since output has waited without progress, or 0
+	size_t            queued_push; // bytes at the end of out that are a push not sent at all
+	uint64_t          requested; // precise_ns() when the request being answered came in, or 0
+	uint64_t          reply_from; // stats.bytes_sent then
+	struct client_stats stats;
+	struct client    *prev;
+	struct client    *next;
+};
+
+static struct client *clients = NULL; // all connected clients
+static int            subscribers = 0;
+static struct client_stats closed;    // of the clients that have disconnected
+
+/*
+ * The serialized snapshot, shared by all clients. It stays valid until
+ * the generation counter in shared memory moves, or until one of the
+ * instances in it stops reporting for DEAD_TIMEOUT_NS.
+ */
+static struct {
+	unsigned char buf[MAX_ARMA_INSTANCES * ASI_WIRE_SIZE];
+	size_t        len;
+	int           valid;
+	uint32_t      generation;
+	uint64_t      expires;  // monotonic_ns() when it must be rebuilt anyway
+	uint32_t      serial;   // bumped whenever the contents change
+	unsigned char records[MAX_ARMA_INSTANCES * ASI_WIRE_SIZE]; // buf, unpacked
+} snapshot;
+
+/*
+ * The instance records of the v2 snapshot, cached like the snapshot
+ * above. The header is written for each reply, as it has the time.
+ */
+static struct {
+	unsigned char *buf;
+	size_t         len;
+	size_t         size;
+	int            count;
+	int            valid;
+	uint32_t       generation;
+	uint64_t       expires;
+} v2;
+
+// Counters reported by send_stats()
+static struct {
+	uint64_t snapshot_hits;
+	uint64_t snapshot_misses;
+	uint64_t pushes;
+	uint64_t pushes_coalesced;
+	uint64_t delta_bytes;      // sent in delta frames
+	uint64_t delta_full_bytes; // what the same frames would have taken in full
+	uint64_t broadcasts;
+	uint64_t broadcast_errors;
+	uint64_t scrapes;
+	uint64_t metrics_renders;
+	uint64_t rejected;         // connections over max_clients
+	uint64_t slow_clients;     // times a client fell behind, see client_behind()
+	uint64_t pushes_replaced;  // queued pushes replaced by a newer snapshot
+	uint64_t write_timeouts;
+	uint64_t idle_timeouts;
+	uint64_t queue_full;       // pushes skipped for CLIENT_MAX_QUEUE
+	uint64_t max_queued;       // bytes, the most any client had queued
+	uint64_t counted_requests; // at the last "STAT", for requests_per_second
+	uint64_t counted_at;       // monotonic_ns() then
+	struct asm_histogram snapshot_builds;
+} stats;
+
+/*
+ * The text served on metrics_port, cached like the snapshot, so that
+ * scrapes in between two changes are just a copy
+ */
+static struct {
+	struct asm_metrics text;
+	int                valid;
+	uint32_t           generation;
+	uint64_t           expires;
+	struct asm_metrics scrape; // text, with the daemon's own metrics
+} metrics;
+
+/*
+ * Snapshots sent to broadcast_group, for any number of listeners. Each
+ * datagram is a keyframe, so a listener that missed some only misses
+ * those snapshots.
+ */
+static struct {
+	int              fd;
+	uint32_t         interval; // ms
+	uint32_t         sequence; // of the last datagram sent
+	uint32_t         sent;     // serial of the last snapshot sent
+	uint64_t         next;     // monotonic_ns() when the next one is due
+	uint64_t         repeat;   // ... when an unchanged snapshot is sent again
+	struct asm_delta delta;
+} broadcast = { .fd = -1 };
+
+// Requests served per client per wakeup, so one client cannot starve the others
+#define CLIENT_REQUEST_BURST 16
+// Bytes queued for a client at most before pushes to it are skipped. The
+// reply to a request is always queued whole, however large it is.
+#define CLIENT_MAX_QUEUE     (2 << 20)
+#define EPOLL_EVENTS         64
+
+static struct asm_shm shm = { -1, 0, NULL };
+static int            shm_readonly = -1; // handed to local clients
+static int            relay_mode = 0;    // serving upstream daemons' instances, see relay.h
+static int            archiving = 0;     // keeping the samples in archive, see archive.h
+static int            notifying = 0;     // woken up by changes to the instances, see notify.h
+static uint64_t       sample_next = 0;   // monotonic_ns() when the next samples are due
+static uint64_t       expire_next = 0;   // ... when clients are next checked for timeouts
+
+/*
+ * Initialize the shared memory area where the stats will be reported
+ */
+int init_shmem()
+{
+	if (asm_shm_open(&shm) != 0) {
+		return 1;
+	}
+	if (shm.created) {
+		asmlog_info("Shared memory initialized");
+	}
+	return 0;
+}
+
+void close_shmem(void)
+{
+	asm_shm_close(&shm);
+}
+
+/*
+ * Make room for n more bytes at the end of the client's output buffer
+ *
+ * Returns where to write them, or NULL when out of memory.
+ */
+static unsigned char *client_reserve(struct client *c, size_t n)
+{
+	unsigned char *out;
+
+	if (c->head == c->tail) {
+		c->head = c->tail = 0;
+	}
+	if (c->tail + n > c->size && c->head > 0) {
+		memmove(c->out, c->out + c->head, c->tail - c->head);
+		c->tail -= c->head;
+		c->head  = 0;
+	}
+	if (c->tail + n > c->size) {
+		if ((out = realloc(c->out, c->tail + n)) == NULL) {
+			return NULL;
+		}
+		c->out  = out;
+		c->size = c->tail + n;
+	}
+	return c->out + c->tail;
+}
+
+/*
+ * Note when a client starts to have output waiting that the socket will
+ * not take, for write_timeout, and when it has caught up again. A client
+ * that keeps the output moving is not behind, however slowly it moves.
+ */
+static void client_behind(struct client *c)
+{
+	if (c->tail - c->head > stats.max_queued) {
+		stats.max_queued = c->tail - c->head;
+	}
+	if (c->head == c->tail) {
+		c->behind = 0;
+	} else if (c->behind == 0) {
+		c->behind = monotonic_ns();
+		stats.slow_clients++;
+	}
+}
+
+/*
+ * Send as much of the pending output as the socket will take
+ *
+ * Returns 0 on success (even if some output is still pending), or 1 if
+ * the connection failed.
+ */
+static int client_flush(struct client *c)
+{
+	ssize_t sent;
+
+	while (c->head < c->tail) {
+		sent = send(c->fd, c->out + c->head, c->tail - c->head, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR) {
+				c->stats.interrupted++;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			asmlog_error("Client %d send(), %s", c->id, strerror(errno));
+			return 1;
+		}
+		if ((size_t)sent < c->tail - c->head) c->stats.partial_writes++;
+		c->stats.bytes_sent += sent;
+		c->head += sent;
+		if (c->behind != 0) c->behind = monotonic_ns();
+	}
+	client_behind(c);
+	return 0;
+}
+
+/*
+ * Time the reply to a request, from when the first word of the request
+ * came in until the last byte of the reply went to the socket. Requests
+ * that have no reply are not timed.
+ */
+static void request_started(struct client *c)
+{
+	if (c->requested == 0) {
+		c->requested  = precise_ns();
+		c->reply_from = c->stats.bytes_sent;
+	}
+}
+
+static void request_done(struct client *c)
+{
+	if (c->requested == 0 || c->head < c->tail) return;
+
+	if (c->stats.bytes_sent > c->reply_from) {
+		asm_histogram_add(&c->stats.latency, precise_ns() - c->requested);
+	}
+	c->requested = 0;
+}
+
+/*
+ * Queue len bytes for the client. If nothing else is queued they are
+ * handed to the socket straight away, and only what does not fit is
+ * copied to the client's output buffer.
+ */
+static int client_send(struct client *c, const unsigned char *buf, size_t len)
+{
+	ssize_t sent = 0;
+	unsigned char *p;
+
+	if (c->head == c->tail) {
+		sent = send(c->fd, buf, len, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR) c->stats.interrupted++;
+			sent = 0; // client_flush() will report any error
+		}
+		if ((size_t)sent < len && sent > 0) c->stats.partial_writes++;
+		c->stats.bytes_sent += sent;
+	}
+	if ((size_t)sent < len) {
+		if ((p = client_reserve(c, len - sent)) == NULL) {
+			return 1;
+		}
+		memcpy(p, buf + sent, len - sent);
+		c->tail += len - sent;
+		client_behind(c);
+	}
+	return 0;
+}
+
+// The first instance at or after from: a slot, or an upstream's instance when relaying
+static int instance_next(int from)
+{
+	return relay_mode ? asm_relay_next(from) : asm_shm_next(&shm, from);
+}
+
+// A consistent copy of an instance, see asi_read()
+static int instance_read(int id, struct ASM_INSTANCE *copy)
+{
+	return relay_mode ? asm_relay_read(id, copy) : asi_read(&asm_shm_slot(&shm, id)->INFO, copy);
+}
+
+// The counter that moves whenever any instance may have changed
+static uint32_t instance_generation(void)
+{
+	return relay_mode ? asm_relay_generation() : __atomic_load_n(asm_shm_generation(&shm), __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Serialize the first MAX_ARMA_INSTANCES instances into the snapshot
+ * cache, and bump its serial if they changed. Nothing is sent here:
+ * replies and pushes copy the cached snapshot later.
+ *
+ * NOTE: it appears that the Windows ArmaServerMonitor uses data serialized
+ *       in non-network byte order, ie in Intel x86 host byte order
+ *       (aka Little endian). That means that this function is technically
+ *       non-portable to non-x86 architectures, since we do not use htons()
+ *       et al to serialize the data before it is sent.
+ *       (OTOH, ArmA is strictly x86 anyhow)
+ */
+static void build_snapshot(uint64_t now)
+{
+	struct ASM_INSTANCE slot;
+	struct ARMA_SERVER_INFO legacy;
+	struct ARMA_SERVER_INFO *asi = &legacy;
+	int instance, next, live;
+	unsigned char sendbuf[sizeof(snapshot.buf)];
+	unsigned char* p = NULL;
+
+	//asmlog_info("send_asi: ARMA_SERVER_INFO is %zd bytes.", sizeof(struct ARMA_SERVER_INFO));
+	p = sendbuf;
+	snapshot.expires = UINT64_MAX;
+	// ArmaServerMonitor.exe expects exactly the first MAX_ARMA_INSTANCES slots.
+	// A relay has no slots, it sends the first MAX_ARMA_INSTANCES instances.
+	next = instance_next(0);
+	for (instance = 0; instance < MAX_ARMA_INSTANCES; instance++) {
+		// Take a consistent copy of the slot, then serialize the copy
+		live = 0;
+		if (relay_mode ? next >= 0 : instance == next) {
+			if (instance_read(next, &slot) != 0) {
+				snapshot.expires = now; // no consistent copy, try again next time
+			} else {
+				live = slot.PID != 0 && slot.UPDATED + DEAD_TIMEOUT_NS >= now;
+			}
+		}
+		if (!live) {
+			// The slot is either unused or dead - just send a zero PID field.
+			*((unsigned short *)p) = 0;                  p += sizeof(unsigned short); // 2
+		} else {
+			if (slot.UPDATED + DEAD_TIMEOUT_NS + 1 < snapshot.expires) {
+				snapshot.expires = slot.UPDATED + DEAD_TIMEOUT_NS + 1;
+			}
+			asi_legacy(&slot, asi);
+			*((unsigned short *)p) = asi->PID;           p += sizeof(unsigned short); // 2
+			*((unsigned short *)p) = asi->OBJ_COUNT_0;   p += sizeof(unsigned short); // 4
+			*((unsigned short *)p) = asi->OBJ_COUNT_1;   p += sizeof(unsigned short); // 6
+			*((unsigned short *)p) = asi->OBJ_COUNT_2;   p += sizeof(unsigned short); // 8
+			*((unsigned short *)p) = asi->PLAYER_COUNT;  p += sizeof(unsigned short); // 10
+			*((unsigned short *)p) = asi->AI_LOC_COUNT;  p += sizeof(unsigned short); // 12
+			*((unsigned short *)p) = asi->AI_REM_COUNT;  p += sizeof(unsigned short); // 14
+			*((unsigned short *)p) = asi->SERVER_FPS;    p += sizeof(unsigned short); // 16
+			*((unsigned short *)p) = asi->SERVER_FPSMIN; p += sizeof(unsigned short); // 18
+			*((unsigned short *)p) = asi->FSM_CE_FREQ;   p += sizeof(unsigned short); // 20
+			*((unsigned int *)p)   = asi->MEM;           p += sizeof(unsigned int);   // 24
+			*((unsigned int *)p)   = asi->NET_RECV;      p += sizeof(unsigned int);   // 28
+			*((unsigned int *)p)   = asi->NET_SEND;      p += sizeof(unsigned int);   // 32
+			*((unsigned int *)p)   = asi->DISC_READ;     p += sizeof(unsigned int);   // 36
+			*((unsigned int *)p)   = asi->TICK_COUNT;    p += sizeof(unsigned int);   // 40
+			memcpy(p, asi->MISSION, SMALSTRINGSIZE);     p += SMALSTRINGSIZE;         // 72
+			memcpy(p, asi->PROFILE, SMALSTRINGSIZE);     p += SMALSTRINGSIZE;         // 104
+		}
+		if (relay_mode ? next >= 0 : instance == next) {
+			next = instance_next(next + 1);
+		}
+	}
+	if (snapshot.len != (size_t)(p - sendbuf) || memcmp(snapshot.buf, sendbuf, snapshot.len) != 0) {
+		snapshot.len = p - sendbuf;
+		memcpy(snapshot.buf, sendbuf, snapshot.len);
+		asm_snapshot_expand(snapshot.buf, snapshot.len, snapshot.records);
+		snapshot.serial++;
+	}
+}
+
+/*
+ * Serialize the snapshot again if anything changed since it was last
+ * serialized. Returns 1 if it had to, 0 if the cached one is current.
+ */
+static int refresh_snapshot(void)
+{
+	uint32_t generation = instance_generation();
+	uint64_t now = monotonic_ns(), started;
+
+	if (snapshot.valid && snapshot.generation == generation && now < snapshot.expires) {
+		return 0;
+	}
+	started = precise_ns();
+	build_snapshot(now);
+	asm_histogram_add(&stats.snapshot_builds, precise_ns() - started);
+	snapshot.generation = generation;
+	snapshot.valid      = 1;
+	return 1;
+}
+
+/*
+ * Send the snapshot as a delta frame, with the same framing as
+ * push_snapshot():
+ *
+ *   uint32  number of bytes that follow
+ *   uint32  snapshot serial number
+ *   the frame, see delta.h
+ */
+static int send_delta(struct client *c)
+{
+	unsigned char frame[8 + ASM_DELTA_MAX_SIZE];
+	size_t len;
+
+	len = asm_delta_encode(c->delta, snapshot.records, c->frames == 0, frame + 8);
+	if (++c->frames >= c->keyframes) {
+		c->frames = 0;
+	}
+	*((unsigned int *)frame)       = 4 + len;
+	*((unsigned int *)(frame + 4)) = snapshot.serial;
+	if (client_send(c, frame, 8 + len) != 0) {
+		asmlog_error("send_delta, out of memory");
+		return 1;
+	}
+	stats.delta_bytes      += 8 + len;
+	stats.delta_full_bytes += 8 + snapshot.len;
+	return 0;
+}
+
+// Send the snapshot
+int send_asi(struct client *c)
+{
+	if (refresh_snapshot()) {
+		stats.snapshot_misses++;
+	} else {
+		stats.snapshot_hits++;
+	}
+	if (c->delta != NULL) {
+		return send_delta(c);
+	}
+
+	if (client_send(c, snapshot.buf, snapshot.len) != 0) {
+		asmlog_error("send_asi, out of memory");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Send all active instances in the v2 format, in the same byte order as
+ * send_asi():
+ *
+ *   uint32  number of bytes that follow
+ *   uint16  ASM_PROTOCOL_VERSION
+ *   uint16  number of instances
+ *   uint64  the daemon's CLOCK_MONOTONIC time, ns
+ *   for each instance:
+ *     uint16  instance id
+ *     uint16  number of bytes of fields that follow
+ *     for each field:
+ *       uint16  type, see enum asm_field
+ *       uint16  length of the value
+ *       value: uint64 for numbers, the characters without a NUL for strings
+ */
+#define V2_FIELD_SIZE    (4 + sizeof(uint64_t))
+#define V2_INSTANCE_SIZE (4 + (ASM_FIELDS - 4) * V2_FIELD_SIZE + 2 * (4 + SMALSTRINGSIZE) + 4 + ASM_RELAY_HOST_SIZE)
+
+static unsigned char *put_field(unsigned char *p, enum asm_field type, uint64_t value)
+{
+	*((unsigned short *)p) = type;            p += sizeof(unsigned short);
+	*((unsigned short *)p) = sizeof(uint64_t); p += sizeof(unsigned short);
+	*((uint64_t *)p)       = value;           p += sizeof(uint64_t);
+	return p;
+}
+
+static unsigned char *put_string(unsigned char *p, enum asm_field type, const char *s, size_t size)
+{
+	size_t len = strnlen(s, size);
+
+	*((unsigned short *)p) = type; p += sizeof(unsigned short);
+	*((unsigned short *)p) = len;  p += sizeof(unsigned short);
+	memcpy(p, s, len);             p += len;
+	return p;
+}
+
+static int build_v2(uint64_t now)
+{
+	struct ASM_INSTANCE slot;
+	unsigned char *buf, *p, *fields;
+	int instance, room = 0;
+
+	for (instance = instance_next(0); instance >= 0; instance = instance_next(instance + 1)) {
+		room++;
+	}
+	if (v2.size < room * V2_INSTANCE_SIZE) {
+		if ((buf = realloc(v2.buf, room * V2_INSTANCE_SIZE)) == NULL) {
+			return 1;
+		}
+		v2.buf  = buf;
+		v2.size = room * V2_INSTANCE_SIZE;
+	}
+
+	p = v2.buf;
+	v2.count   = 0;
+	v2.expires = UINT64_MAX;
+	for (instance = instance_next(0); instance >= 0 && v2.count < room; instance = instance_next(instance + 1)) {
+		if (instance_read(instance, &slot) != 0) {
+			v2.expires = now; // no consistent copy, try again next time
+			continue;
+		}
+		if (slot.PID == 0 || slot.UPDATED + DEAD_TIMEOUT_NS < now) {
+			continue;
+		}
+		if (slot.UPDATED + DEAD_TIMEOUT_NS + 1 < v2.expires) {
+			v2.expires = slot.UPDATED + DEAD_TIMEOUT_NS + 1;
+		}
+
+		*((unsigned short *)p) = instance; p += sizeof(unsigned short);
+		fields = p;                        p += sizeof(unsigned short);
+		p = put_field(p, ASM_FIELD_PID,           slot.PID);
+		p = put_field(p, ASM_FIELD_OBJ_COUNT_0,   slot.OBJ_COUNT_0);
+		p = put_field(p, ASM_FIELD_OBJ_COUNT_1,   slot.OBJ_COUNT_1);
+		p = put_field(p, ASM_FIELD_OBJ_COUNT_2,   slot.OBJ_COUNT_2);
+		p = put_field(p, ASM_FIELD_PLAYER_COUNT,  slot.PLAYER_COUNT);
+		p = put_field(p, ASM_FIELD_AI_LOC_COUNT,  slot.AI_LOC_COUNT);
+		p = put_field(p, ASM_FIELD_AI_REM_COUNT,  slot.AI_REM_COUNT);
+		p = put_field(p, ASM_FIELD_SERVER_FPS,    slot.SERVER_FPS);
+		p = put_field(p, ASM_FIELD_SERVER_FPSMIN, slot.SERVER_FPSMIN);
+		p = put_field(p, ASM_FIELD_FSM_CE_FREQ,   slot.FSM_CE_FREQ);
+		p = put_field(p, ASM_FIELD_CPU_LOAD,      slot.CPU_LOAD);
+		p = put_field(p, ASM_FIELD_MEM,           slot.MEM);
+		p = put_field(p, ASM_FIELD_NET_RECV,      slot.NET_RECV);
+		p = put_field(p, ASM_FIELD_NET_SEND,      slot.NET_SEND);
+		p = put_field(p, ASM_FIELD_DISC_READ,     slot.DISC_READ);
+		p = put_field(p, ASM_FIELD_DISC_WRITE,    slot.DISC_WRITE);
+		p = put_field(p, ASM_FIELD_IO_READ,       slot.IO_READ);
+		p = put_field(p, ASM_FIELD_IO_WRITE,      slot.IO_WRITE);
+		p = put_field(p, ASM_FIELD_STARTED,       slot.STARTED);
+		p = put_field(p, ASM_FIELD_UPDATED,       slot.UPDATED);
+		p = put_string(p, ASM_FIELD_MISSION,      slot.MISSION, SMALSTRINGSIZE);
+		p = put_string(p, ASM_FIELD_PROFILE,      slot.PROFILE, SMALSTRINGSIZE);
+		if (relay_mode) {
+			p = put_string(p, ASM_FIELD_HOST, asm_relay_host(instance), ASM_RELAY_HOST_SIZE);
+		}
+		*((unsigned short *)fields) = p - fields - sizeof(unsigned short);
+		v2.count++;
+	}
+	v2.len = p - v2.buf;
+	return 0;
+}
+
+int send_v2(struct client *c)
+{
+	uint32_t generation = instance_generation();
+	uint64_t now = monotonic_ns(), started;
+	unsigned char header[16];
+
+	if (!v2.valid || v2.generation != generation || now >= v2.expires) {
+		v2.valid = 0;
+		started = precise_ns();
+		if (build_v2(now) != 0) {
+			asmlog_error("send_v2, out of memory");
+			return 1;
+		}
+		asm_histogram_add(&stats.snapshot_builds, precise_ns() - started);
+		v2.generation = generation;
+		v2.valid      = 1;
+		stats.snapshot_misses++;
+	} else {
+		stats.snapshot_hits++;
+	}
+
+	*((unsigned int *)header)          = sizeof(header) - 4 + v2.len;
+	*((unsigned short *)(header + 4))  = ASM_PROTOCOL_VERSION;
+	*((unsigned short *)(header + 6))  = v2.count;
+	*((uint64_t *)(header + 8))        = now;
+	if (client_send(c, header, sizeof(header)) != 0 || client_send(c, v2.buf, v2.len) != 0) {
+		asmlog_error("send_v2, out of memory");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Answer a request that a relay cannot serve with an empty reply, as
+ * history and profiles are kept in the shared memory of each host and
+ * are not relayed. Other replies always have at least a count.
+ */
+static int send_unavailable(struct client *c, const char *request)
+{
+	unsigned char *p;
+
+	asmlog_debug("Client %d asked a relay for %s, not relayed", c->id, request);
+	if ((p = client_reserve(c, 4)) == NULL) {
+		asmlog_error("send_unavailable, out of memory");
+		return 1;
+	}
+	*((unsigned int *)p) = 0;
+	c->tail += 4;
+	return 0;
+}
+
+/*
+ * Send the rolling history of all active instances, in the same byte
+ * order as send_asi():
+ *
+ *   uint32  number of bytes that follow
+ *   uint16  number of instances
+ *   for each instance:
+ *     uint16  instance id
+ *     uint16  number of samples, oldest first
+ *     uint32  sample interval in milliseconds
+ *     samples of ASI_SAMPLE_WIRE_SIZE bytes each
+ *
+ * A relay sends no history, see send_unavailable().
+ */
+#define HISTORY_INSTANCE_SIZE (8 + ASI_HISTORY_SIZE * ASI_SAMPLE_WIRE_SIZE)
+int send_history(struct client *c)
+{
+	unsigned char *sendbuf;
+	struct ASI_SAMPLE samples[ASI_HISTORY_SIZE];
+	struct ASM_INSTANCE slot;
+	struct ASM_SLOT *asi;
+	uint32_t interval;
+	uint64_t now;
+	int instance, room = 0, count = 0, n, i;
+	unsigned char* p;
+
+	if (relay_mode) {
+		return send_unavailable(c, "history");
+	}
+	for (instance = asm_shm_next(&shm, 0); instance >= 0; instance = asm_shm_next(&shm, instance + 1)) {
+		room++;
+	}
+	if ((sendbuf = client_reserve(c, 6 + room * HISTORY_INSTANCE_SIZE)) == NULL) {
+		asmlog_error("send_history, out of memory");
+		return 1;
+	}
+	p = sendbuf + 6;
+
+	now = monotonic_ns();
+	for (instance = asm_shm_next(&shm, 0); instance >= 0 && count < room; instance = asm_shm_next(&shm, instance + 1)) {
+		asi = asm_shm_slot(&shm, instance);
+		if (asi_read(&asi->INFO, &slot) != 0 || slot.PID == 0 || slot.UPDATED + DEAD_TIMEOUT_NS < now) {
+			continue;
+		}
+
+		n = asi_history_read(asi, samples, &interval);
+		*((unsigned short *)p) = instance;  p += sizeof(unsigned short);
+		*((unsigned short *)p) = n;         p += sizeof(unsigned short);
+		*((unsigned int *)p)   = interval;  p += sizeof(unsigned int);
+		for (i = 0; i < n; i++) {
+			*((unsigned int *)p)   = samples[i].TIME / 1000000; p += sizeof(unsigned int);  // 4
+			*((unsigned short *)p) = samples[i].SERVER_FPS;    p += sizeof(unsigned short); // 6
+			*((unsigned short *)p) = samples[i].SERVER_FPSMIN; p += sizeof(unsigned short); // 8
+			*((unsigned short *)p) = samples[i].FSM_CE_FREQ;   p += sizeof(unsigned short); // 10
+			*((unsigned short *)p) = samples[i].PLAYER_COUNT;  p += sizeof(unsigned short); // 12
+			*((unsigned short *)p) = samples[i].AI_LOC_COUNT;  p += sizeof(unsigned short); // 14
+			*((unsigned short *)p) = samples[i].AI_REM_COUNT;  p += sizeof(unsigned short); // 16
+			*((unsigned int *)p)   = samples[i].MEM < UINT32_MAX ? samples[i].MEM : UINT32_MAX; p += sizeof(unsigned int); // 20
+		}
+		count++;
+	}
+	*((unsigned int *)sendbuf)         = p - sendbuf - 4;
+	*((unsigned short *)(sendbuf + 4)) = count;
+
+	c->tail = p - c->out;
+
+	return 0;
+}
+
+/*
+ * Send the extension call time profile of all active instances, in the
+ * same byte order as send_asi():
+ *
+ *   uint32  number of bytes that follow
+ *   uint16  number of instances
+ *   for each instance:
+ *     uint16  instance id
+ *     uint16  number of commands that follow
+ *     uint32  SERVER_FPS, 1/1000 frames per second
+ *     uint64  timed calls that went over extensionbudget
+ *     uint64  optional /proc reads skipped
+ *     for each command that has been called, ASI_PROFILE_WIRE_SIZE bytes:
+ *       uint16  command, 0-9 for "<n>:", 10 for "update"
+ *       uint16  0
+ *       uint64  calls
+ *       uint64  total time, ns, estimated from the timed calls
+ *       uint32  longest call, ns
+ *       uint32  median, ns
+ *       uint32  99th percentile, ns
+ *
+ * A relay sends no profile, see send_unavailable().
+ */
+#define PROFILE_INSTANCE_SIZE (24 + ASI_PROFILE_COMMANDS * ASI_PROFILE_WIRE_SIZE)
+static uint32_t clamp_u32(uint64_t v)
+{
+	return v < UINT32_MAX ? v : UINT32_MAX;
+}
+
+int send_profile(struct client *c)
+{
+	unsigned char *sendbuf, *p, *ncommands;
+	const struct ASI_PROFILE_COMMAND *command;
+	struct ASM_INSTANCE slot;
+	struct ASM_SLOT *asi;
+	uint64_t now;
+	int instance, room = 0, count = 0, n, cmd;
+
+	if (relay_mode) {
+		return send_unavailable(c, "profile");
+	}
+	for (instance = asm_shm_next(&shm, 0); instance >= 0; instance = asm_shm_next(&shm, instance + 1)) {
+		room++;
+	}
+	if ((sendbuf = client_reserve(c, 6 + room * PROFILE_INSTANCE_SIZE)) == NULL) {
+		asmlog_error("send_profile, out of memory");
+		return 1;
+	}
+	p = sendbuf + 6;
+
+	now = monotonic_ns();
+	for (instance = asm_shm_next(&shm, 0); instance >= 0 && count < room; instance = asm_shm_next(&shm, instance + 1)) {
+		asi = asm_shm_slot(&shm, instance);
+		if (asi_read(&asi->INFO, &slot) != 0 || slot.PID == 0 || slot.UPDATED + DEAD_TIMEOUT_NS < now) {
+			continue;
+		}
+
+		*((unsigned short *)p) = instance;                     p += sizeof(unsigned short);
+		ncommands = p;                                         p += sizeof(unsigned short);
+		*((unsigned int *)p)   = slot.SERVER_FPS;              p += sizeof(unsigned int);
+		*((uint64_t *)p)       = asi->PROFILE.OVER_BUDGET;     p += sizeof(uint64_t);
+		*((uint64_t *)p)       = asi->PROFILE.SKIPPED;         p += sizeof(uint64_t);
+		for (cmd = 0, n = 0; cmd < ASI_PROFILE_COMMANDS; cmd++) {
+			command = &asi->PROFILE.COMMANDS[cmd];
+			if (command->COUNT == 0) continue;
+
+			*((unsigned short *)p) = cmd;                                         p += sizeof(unsigned short); // 2
+			*((unsigned short *)p) = 0;                                           p += sizeof(unsigned short); // 4
+			*((uint64_t *)p)       = command->COUNT;                              p += sizeof(uint64_t);       // 12
+			*((uint64_t *)p)       = asi_profile_total(command);                  p += sizeof(uint64_t);       // 20
+			*((unsigned int *)p)   = clamp_u32(command->MAX);                     p += sizeof(unsigned int);   // 24
+			*((unsigned int *)p)   = clamp_u32(asi_profile_percentile(command, 50)); p += sizeof(unsigned int); // 28
+			*((unsigned int *)p)   = clamp_u32(asi_profile_percentile(command, 99)); p += sizeof(unsigned int); // 32
+			n++;
+		}
+		*((unsigned short *)ncommands) = n;
+		count++;
+	}
+	*((unsigned int *)sendbuf)         = p - sendbuf - 4;
+	*((unsigned short *)(sendbuf + 4)) = count;
+
+	c->tail = p - c->out;
+
+	return 0;
+}
+
+/*
+ * Push the snapshot to a subscribed client, framed as
+ *
+ *   uint32  number of bytes that follow
+ *   uint32  snapshot serial number; numbers are skipped when snapshots
+ *           changed faster than the client was pushed to
+ *   the snapshot, as sent by send_asi()
+ */
+static int push_snapshot(struct client *c)
+{
+	unsigned char frame[8];
+	size_t queued = c->tail - c->head;
+
+	if (c->delta != NULL) {
+		if (send_delta(c) != 0) return 1;
+	} else {
+		*((unsigned int *)frame)       = 4 + snapshot.len;
+		*((unsigned int *)(frame + 4)) = snapshot.serial;
+		if (client_send(c, frame, sizeof(frame)) != 0 || client_send(c, snapshot.buf, snapshot.len) != 0) {
+			asmlog_error("push_snapshot, out of memory");
+			return 1;
+		}
+	}
+	// All of a full snapshot still queued may be replaced by a newer one
+	c->queued_push = c->delta == NULL && c->tail - c->head - queued == 8 + snapshot.len ? 8 + snapshot.len : 0;
+	c->pushed = snapshot.serial;
+	stats.pushes++;
+	return 0;
+}
+
+// Switch the client to push mode, or change its interval
+static void subscribe(struct client *c, uint32_t interval)
+{
+	if (!c->subscribed) {
+		subscribers++;
+		c->subscribed = 1;
+		// Make the first push send the current snapshot
+		c->pushed = snapshot.serial - 1;
+	}
+	c->interval  = interval > ASM_PUSH_MIN_INTERVAL ? interval : ASM_PUSH_MIN_INTERVAL;
+	c->next_push = monotonic_ns();
+	asmlog_info("Client %d subscribed, every %u ms", c->id, c->interval);
+}
+
+/*
+ * Switch the client to delta-encoded snapshots. Either way the next one
+ * is a keyframe, so a client that lost track can ask again to resync.
+ */
+static int enable_delta(struct client *c, uint32_t keyframes)
+{
+	if (c->delta == NULL) {
+		if ((c->delta = malloc(sizeof(*c->delta))) == NULL) {
+			asmlog_error("Client %d delta, out of memory", c->id);
+			return 1;
+		}
+		asm_delta_init(c->delta);
+	}
+	c->keyframes = keyframes > 0 ? keyframes : ASM_DELTA_KEYFRAME_INTERVAL;
+	c->frames    = 0;
+	asmlog_info("Client %d delta-encoded, keyframe every %u", c->id, c->keyframes);
+	return 0;
+}
+
+/*
+ * Milliseconds until the next subscribed client is due for a push, or
+ * the next broadcast, upstream poll, sample or timeout check is due.
+ *
+ * With change notification, a subscribed client is only due once there
+ * is something new for it; until then the event loop sleeps until the
+ * notification, see watch_changes().
+ */
+static int push_timeout(uint64_t now)
+{
+	const struct client *c;
+	uint64_t due = sample_next;
+	int changed;
+
+	if (broadcast.fd != -1 && broadcast.next < due) due = broadcast.next;
+	if (relay_mode && asm_relay_due() < due) due = asm_relay_due();
+	if (clients != NULL && (write_timeout > 0 || idle_timeout > 0) && expire_next < due) due = expire_next;
+	if (subscribers > 0) {
+		changed = !notifying || !snapshot.valid || snapshot.generation != instance_generation();
+		for (c = clients; c != NULL; c = c->next) {
+			if (c->subscribed && (changed || c->pushed != snapshot.serial) && c->next_push < due) {
+				due = c->next_push;
+			}
+		}
+		// Instances that stop updating drop out of the snapshot without a change
+		if (notifying && snapshot.expires < due) due = snapshot.expires;
+	}
+	return due <= now ? 0 : (int)((due - now + 999999) / 1000000);
+}
+
+/*
+ * Have the event loop woken up by the next change to the instances, if
+ * there are subscribed clients and the snapshot is current. A change
+ * that is already there needs no notification, it is pushed when the
+ * clients are due.
+ */
+static void watch_changes(void)
+{
+	if (notifying && subscribers > 0 && snapshot.valid && snapshot.generation == instance_generation()) {
+		asm_notify_want(snapshot.generation);
+	}
+}
+
+// The counters of all connections, connected or not
+static const struct client_stats *client_totals(void)
+{
+	static struct client_stats total;
+	const struct client *c;
+
+	total = closed;
+	for (c = clients; c != NULL; c = c->next) {
+		total.requests       += c->stats.requests;
+		total.bytes_sent     += c->stats.bytes_sent;
+		total.partial_writes += c->stats.partial_writes;
+		total.interrupted    += c->stats.interrupted;
+		asm_histogram_merge(&total.latency, &c->stats.latency);
+	}
+	return &total;
+}
+
+// Requests per second since the previous call
+static uint64_t request_rate(uint64_t requests)
+{
+	uint64_t now = monotonic_ns(), rate = 0;
+
+	if (now > stats.counted_at) {
+		rate = (requests - stats.counted_requests) * 1000000000ULL / (now - stats.counted_at);
+	}
+	stats.counted_requests = requests;
+	stats.counted_at       = now;
+	return rate;
+}
+
+/*
+ * Send the daemon's own counters, in the same byte order as send_asi().
+ * Durations are in microseconds; requests_per_second is over the time
+ * since the previous "STAT", or since the start.
+ *
+ *   uint32  number of bytes that follow
+ *   uint16  number of counters
+ *   for each counter:
+ *     uint8   length of the name
+ *     char    name, not NUL terminated
+ *     uint64  value
+ */
+int send_stats(struct client *c)
+{
+	const struct asm_relay_stats *relay = asm_relay_stats();
+	const struct asm_archive_stats *archived = asm_archive_stats();
+	const struct asm_rollup_stats *rollups = asm_rollup_stats();
+	const struct asm_notify_stats *notified = asm_notify_stats();
+	const struct client_stats *total = client_totals();
+	const uint64_t rate = request_rate(total->requests);
+	const struct {
+		const char *name;
+		uint64_t    value;
+	} counters[] = {
+		{ "clients",         connected_clients },
+		{ "connections",     connections },
+		{ "rejected",        stats.rejected },
+		{ "requests",        total->requests },
+		{ "requests_per_second", rate },
+		{ "bytes_sent",      total->bytes_sent },
+		{ "partial_writes",  total->partial_writes },
+		{ "send_interrupted", total->interrupted },
+		{ "latency_count",   total->latency.count },
+		{ "latency_p50_us",  asm_histogram_quantile(&total->latency, 0.5) / 1000 },
+		{ "latency_p99_us",  asm_histogram_quantile(&total->latency, 0.99) / 1000 },
+		{ "latency_max_us",  total->latency.max / 1000 },
+		{ "snapshot_builds", stats.snapshot_builds.count },
+		{ "build_p50_us",    asm_histogram_quantile(&stats.snapshot_builds, 0.5) / 1000 },
+		{ "build_p99_us",    asm_histogram_quantile(&stats.snapshot_builds, 0.99) / 1000 },
+		{ "build_max_us",    stats.snapshot_builds.max / 1000 },
+		{ "snapshot_hits",   stats.snapshot_hits },
+		{ "snapshot_misses", stats.snapshot_misses },
+		{ "subscribers",     subscribers },
+		{ "pushes",          stats.pushes },
+		{ "pushes_coalesced", stats.pushes_coalesced },
+		{ "pushes_replaced", stats.pushes_replaced },
+		{ "slow_clients",    stats.slow_clients },
+		{ "write_timeouts",  stats.write_timeouts },
+		{ "idle_timeouts",   stats.idle_timeouts },
+		{ "queue_full",      stats.queue_full },
+		{ "max_queued",      stats.max_queued },
+		{ "delta_bytes",     stats.delta_bytes },
+		{ "delta_full_bytes", stats.delta_full_bytes },
+		{ "broadcasts",      stats.broadcasts },
+		{ "broadcast_errors", stats.broadcast_errors },
+		{ "http_clients",    http_clients },
+		{ "scrapes",         stats.scrapes },
+		{ "metrics_renders", stats.metrics_renders },
+		{ "relay_upstreams", upstream_count },
+		{ "relay_connected", relay->connected },
+		{ "relay_stale",     relay->stale },
+		{ "relay_replies",   relay->replies },
+		{ "relay_reconnects", relay->reconnects },
+		{ "archive_samples", archived->samples },
+		{ "archive_blocks",  archived->blocks },
+		{ "archive_bytes",   archived->bytes },
+		{ "archive_errors",  archived->errors },
+		{ "archive_queries", archived->queries },
+		{ "rollup_instances", rollups->instances },
+		{ "rollup_buckets",  rollups->buckets },
+		{ "rollup_queries",  rollups->queries },
+		{ "notify_wants",    notified->wants },
+		{ "notify_wakeups",  notified->wakeups },
+	};
+	const int count = sizeof(counters) / sizeof(counters[0]);
+	unsigned char *sendbuf, *p;
+	size_t len;
+	int i;
+
+	if ((sendbuf = client_reserve(c, 6 + count * (1 + 255 + 8))) == NULL) {
+		asmlog_error("send_stats, out of memory");
+		return 1;
+	}
+	p = sendbuf + 6;
+	for (i = 0; i < count; i++) {
+		len = strlen(counters[i].name);
+		*p = len;                                 p += 1;
+		memcpy(p, counters[i].name, len);         p += len;
+		*((uint64_t *)p) = counters[i].value;     p += sizeof(uint64_t);
+	}
+	*((unsigned int *)sendbuf)         = p - sendbuf - 4;
+	*((unsigned short *)(sendbuf + 4)) = count;
+	c->tail = p - c->out;
+
+	return 0;
+}
+
+/*
+ * Pass a read-only descriptor of the shared memory object to a client
+ * of the Unix-domain socket, see ASM_REQUEST_SHM_FD. It is sent at once,
+ * as the descriptor must go with the reply's bytes, and a client only
+ * gets here with nothing else queued.
+ */
+static int send_shm_fd(struct client *c)
+{
+	unsigned char reply[8];
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { reply, sizeof(reply) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	unsigned char *p;
+
+	if (!c->local) {
+		asmlog_error("Client %d asked for the shared memory over TCP, refused", c->id);
+		return 1;
+	}
+	if (relay_mode) {
+		// The reply without a descriptor, so that the client does not wait for one
+		asmlog_error("Client %d asked a relay for the shared memory, refused", c->id);
+		if ((p = client_reserve(c, sizeof(reply))) == NULL) return 1;
+		*((unsigned int *)p)       = 4;
+		*((unsigned int *)(p + 4)) = 0;
+		c->tail += sizeof(reply);
+		return 0;
+	}
+	if (shm_readonly == -1 && (shm_readonly = asm_shm_open_readonly()) == -1) {
+		asmlog_error("send_shm_fd, %s", strerror(errno));
+		return 1;
+	}
+
+	*((unsigned int *)reply)       = 4;
+	*((unsigned int *)(reply + 4)) = ASM_SHM_SIZE(ASM_MAX_SLOTS);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &shm_readonly, sizeof(int));
+
+	if (sendmsg(c->fd, &msg, MSG_NOSIGNAL) != sizeof(reply)) {
+		asmlog_error("Client %d sendmsg(), %s", c->id, strerror(errno));
+		return 1;
+	}
+	c->stats.bytes_sent += sizeof(reply);
+	asmlog_info("Client %d got the shared memory", c->id);
+	return 0;
+}
+
+/*
+ * Watch the client for input while it is reading a request, and for
+ * room in the socket buffer while a reply is pending
+ */
+static int client_watch(int epfd, struct client *c, int op)
+{
+	struct epoll_event ev;
+
+	ev.events   = c->state == CLIENT_READING ? EPOLLIN : EPOLLOUT;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, op, c->fd, &ev) == -1) {
+		asmlog_error("Client %d epoll_ctl(), %s", c->id, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static void client_close(int epfd, struct client *c)
+{
+	if (c->prev != NULL) c->prev->next = c->next; else clients = c->next;
+	if (c->next != NULL) c->next->prev = c->prev;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	if (c->http != NULL) {
+		asmlog_debug("HTTP client %d disconnected", c->id);
+		http_clients--;
+		free(c->http);
+	} else {
+		asmlog_info("Client %d disconnected", c->id);
+		connected_clients--;
+	}
+	if (c->subscribed) subscribers--;
+	closed.requests       += c->stats.requests;
+	closed.bytes_sent     += c->stats.bytes_sent;
+	closed.partial_writes += c->stats.partial_writes;
+	closed.interrupted    += c->stats.interrupted;
+	asm_histogram_merge(&closed.latency, &c->stats.latency);
+	free(c->delta);
+	free(c->out);
+	free(c);
+}
+
+/*
+ * Send the archived samples of an instance, see ASM_REQUEST_ARCHIVE. The
+ * arguments are in c->args. Without an archive, there are no samples.
+ */
+static int send_archive(struct client *c)
+{
+	static uint64_t times[ASM_ARCHIVE_MAX_SAMPLES];
+	static uint64_t values[ASM_ARCHIVE_MAX_SAMPLES * ASM_TSBLOCK_MAX_FIELDS];
+	const uint32_t mask = c->args[1] & ASM_ARCHIVE_FIELDS;
+	const uint64_t from = c->args[2] | (uint64_t)c->args[3] << 32;
+	const uint64_t to   = c->args[4] | (uint64_t)c->args[5] << 32;
+	const int fields = __builtin_popcount(mask);
+	unsigned char *sendbuf, *p;
+	int n = 0, i, field;
+
+	if (archiving && (n = asm_archive_query(c->args[0], mask, from, to, times, values, ASM_ARCHIVE_MAX_SAMPLES)) < 0) {
+		n = 0;
+	}
+	if ((sendbuf = client_reserve(c, 12 + (size_t)n * (1 + fields) * sizeof(uint64_t))) == NULL) {
+		asmlog_error("send_archive, out of memory");
+		return 1;
+	}
+	p = sendbuf + 12;
+	for (i = 0; i < n; i++) {
+		*((uint64_t *)p) = times[i]; p += sizeof(uint64_t);
+		for (field = 0; field < fields; field++) {
+			*((uint64_t *)p) = values[i * fields + field]; p += sizeof(uint64_t);
+		}
+	}
+	*((unsigned int *)sendbuf)       = p - sendbuf - 4;
+	*((unsigned int *)(sendbuf + 4)) = mask;
+	*((unsigned int *)(sendbuf + 8)) = n;
+	c->tail = p - c->out;
+
+	return 0;
+}
+
+/*
+ * Send the rollups of an instance, see ASM_REQUEST_ROLLUP. The arguments
+ * are in c->args.
+ */
+static int send_rollup(struct client *c)
+{
+	const uint32_t mask = c->args[1] & ASM_ARCHIVE_FIELDS;
+	const uint64_t from = c->args[3] | (uint64_t)c->args[4] << 32;
+	const uint64_t to   = c->args[5] | (uint64_t)c->args[6] << 32;
+	const size_t bucket = (2 + 4 * __builtin_popcount(mask)) * sizeof(uint64_t);
+	uint32_t resolution = c->args[2];
+	unsigned char *sendbuf;
+	int n;
+
+	if ((sendbuf = client_reserve(c, 16 + ASM_ROLLUP_MAX_BUCKETS * bucket)) == NULL) {
+		asmlog_error("send_rollup, out of memory");
+		return 1;
+	}
+	n = asm_rollup_query(c->args[0], mask, &resolution, from, to, sendbuf + 16, ASM_ROLLUP_MAX_BUCKETS);
+	*((unsigned int *)sendbuf)        = 12 + n * bucket;
+	*((unsigned int *)(sendbuf + 4))  = mask;
+	*((unsigned int *)(sendbuf + 8))  = resolution;
+	*((unsigned int *)(sendbuf + 12)) = n;
+	c->tail = sendbuf + 16 + n * bucket - c->out;
+
+	return 0;
+}
+
+// The number of 32-bit words of arguments that follow a request
+static int request_args(uint32_t request)
+{
+	switch (request) {
+		case ASM_REQUEST_SUBSCRIBE:
+		case ASM_REQUEST_DELTA:
+			return 1;
+		case ASM_REQUEST_ARCHIVE:
+			return 6;
+		case ASM_REQUEST_ROLLUP:
+			return 7;
+		default:
+			return 0;
+	}
+}
+
+// Queue the reply to a complete request
+static void client_request(struct client *c)
+{
+	// A request is a little-endian "DWORD" (32 bits)
+	uint32_t request = c->req[0] | (c->req[1] << 8) | (c->req[2] << 16) | ((uint32_t)c->req[3] << 24);
+
+	if (c->request != 0) {
+		// The word is an argument of the request before it
+		c->args[c->argc++] = request;
+		if (c->argc < request_args(c->request)) return;
+		if (c->request == ASM_REQUEST_SUBSCRIBE) {
+			subscribe(c, c->args[0]);
+		} else if (c->request == ASM_REQUEST_DELTA) {
+			enable_delta(c, c->args[0]);
+		} else if (c->subscribed) {
+			asmlog_error("Client %d sent %08x in push mode, ignored", c->id, c->request);
+		} else if (c->request == ASM_REQUEST_ARCHIVE) {
+			asmlog_debug("Client %d send_archive() ...", c->id);
+			send_archive(c);
+		} else {
+			asmlog_debug("Client %d send_rollup() ...", c->id);
+			send_rollup(c);
+		}
+		c->request = 0;
+		c->argc    = 0;
+		return;
+	}
+	if (request_args(request) > 0) {
+		c->request = request;
+		return;
+	}
+	if (c->subscribed) {
+		// Replies could not be told apart from pushes
+		asmlog_error("Client %d sent %08x in push mode, ignored", c->id, request);
+		return;
+	}
+
+	switch (request) {
+		case ASM_REQUEST_SNAPSHOT: // A zero DWORD is the magic word
+			asmlog_debug("Client %d send_asi() ...", c->id);
+			send_asi(c);
+			break;
+		case ASM_REQUEST_V2:
+			asmlog_debug("Client %d send_v2() ...", c->id);
+			send_v2(c);
+			break;
+		case ASM_REQUEST_HISTORY:
+			asmlog_debug("Client %d send_history() ...", c->id);
+			send_history(c);
+			break;
+		case ASM_REQUEST_PROFILE:
+			asmlog_debug("Client %d send_profile() ...", c->id);
+			send_profile(c);
+			break;
+		case ASM_REQUEST_STATS:
+			asmlog_debug("Client %d send_stats() ...", c->id);
+			send_stats(c);
+			break;
+		case ASM_REQUEST_SHM_FD:
+			asmlog_debug("Client %d send_shm_fd() ...", c->id);
+			send_shm_fd(c);
+			break;
+		default:
+			asmlog_error("Client %d received %08x (%02x %02x %02x %02x)",
+					c->id, request, c->req[0], c->req[1], c->req[2], c->req[3]);
+	}
+}
+
+/*
+ * Queue an HTTP response. The header and the body are queued together,
+ * so that they leave in one segment when they fit.
+ */
+static int http_reply(struct client *c, const char *status, const char *type,
+                      const char *body, size_t len, int head)
+{
+	char header[256];
+	unsigned char *p;
+	int n;
+
+	n = snprintf(header, sizeof(header),
+			"HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%s\r\n",
+			status, type, len, c->http->close ? "Connection: close\r\n" : "");
+	if (head) len = 0;
+	if ((p = client_reserve(c, n + len)) == NULL) {
+		asmlog_error("http_reply, out of memory");
+		return 1;
+	}
+	memcpy(p, header, n);
+	memcpy(p + n, body, len);
+	c->tail += n + len;
+	return 0;
+}
 
-extern int    port;
-extern int    max_clients;
-extern int    running;
+// Add the daemon's own metrics to the instances' for a scrape, in metrics.scrape
+static int render_daemon_metrics(void)
+{
+	const struct client_stats *total = client_totals();
+	const struct asm_metrics_value values[] = {
+		{ "asm_daemon_clients", "gauge", NULL, "Connected clients, not counting scrapers",
+			connected_clients },
+		{ "asm_daemon_connections", "counter", NULL, "Connections accepted",
+			connections },
+		{ "asm_daemon_rejected_connections", "counter", NULL, "Connections closed at once, for too many clients",
+			stats.rejected },
+		{ "asm_daemon_requests", "counter", NULL, "Requests answered, scrapes included",
+			total->requests },
+		{ "asm_daemon_sent_bytes", "counter", "bytes", "Bytes sent to clients",
+			total->bytes_sent },
+		{ "asm_daemon_partial_writes", "counter", NULL, "Sends that took only part of the bytes",
+			total->partial_writes },
+		{ "asm_daemon_interrupted_sends", "counter", NULL, "Sends interrupted by a signal",
+			total->interrupted },
+		{ "asm_daemon_slow_clients", "counter", NULL, "Times a client left output waiting in its queue",
+			stats.slow_clients },
+		{ "asm_daemon_timeouts", "counter", NULL, "Clients disconnected for not taking their output",
+			stats.write_timeouts },
+	};
+	const struct asm_metrics_histogram histograms[] = {
+		{ "asm_daemon_request_latency_seconds", "From a request to the last byte of its reply",
+			&total->latency },
+		{ "asm_daemon_snapshot_build_seconds", "Time to serialize a snapshot",
+			&stats.snapshot_builds },
+	};
 
-static int    connected_clients = 0;
+	return asm_metrics_render_daemon(&metrics.scrape, &metrics.text,
+			values, sizeof(values) / sizeof(values[0]),
+			histograms, sizeof(histograms) / sizeof(histograms[0]));
+}
+
+// Answer a scrape of /metrics
+static int send_metrics(struct client *c, int head)
+{
+	const struct asm_metrics_source source = {
+		instance_next, instance_read, relay_mode ? asm_relay_host : NULL
+	};
+	uint32_t generation = instance_generation();
+	uint64_t now = monotonic_ns();
+
+	stats.scrapes++;
+	if (!metrics.valid || metrics.generation != generation || now >= metrics.expires) {
+		metrics.valid = 0;
+		if (asm_metrics_render(&metrics.text, &source, now, &metrics.expires) != 0) {
+			asmlog_error("send_metrics, out of memory");
+			return 1;
+		}
+		metrics.generation = generation;
+		metrics.valid      = 1;
+		stats.metrics_renders++;
+	}
+	if (render_daemon_metrics() != 0) {
+		asmlog_error("send_metrics, out of memory");
+		return 1;
+	}
+	return http_reply(c, "200 OK", ASM_METRICS_CONTENT_TYPE, metrics.scrape.buf, metrics.scrape.len, head);
+}
 
-static int    firstload = 0;
-static int    filemap_fd;
-static void*  filemap;
-static long   pagesize;
+// Queue the reply to a complete HTTP request, the NUL terminated header
+static int http_request(struct client *c, const char *req)
+{
+	static const char not_found[] = "Try /metrics\n";
+	char method[8], path[256], version[16];
+	int head;
+
+	if (sscanf(req, "%7s %255s %15s", method, path, version) != 3) {
+		c->http->close = 1;
+		return http_reply(c, "400 Bad Request", "text/plain", "", 0, 0);
+	}
+	asmlog_debug("HTTP client %d: %s %s %s", c->id, method, path, version);
+
+	// Keep HTTP/1.1 connections, as Prometheus reuses them
+	if (strcmp(version, "HTTP/1.1") != 0 || strcasestr(req, "\r\nConnection: close") != NULL) {
+		c->http->close = 1;
+	}
+	head = strcmp(method, "HEAD") == 0;
+	if (!head && strcmp(method, "GET") != 0) {
+		c->http->close = 1;
+		// with the Allow header that a 405 must have
+		return http_reply(c, "405 Method Not Allowed\r\nAllow: GET, HEAD", "text/plain", "", 0, 0);
+	}
+	if (strcmp(path, "/metrics") == 0 || strncmp(path, "/metrics?", 9) == 0) {
+		return send_metrics(c, head);
+	}
+	return http_reply(c, "404 Not Found", "text/plain", not_found, sizeof(not_found) - 1, head);
+}
 
 /*
- * Initialize the shared memory area where the stats will be reported
+ * Read from a client of the metrics port, and answer each complete
+ * request until one of them has to wait for the socket
+ *
+ * Returns 0 if the client is still connected, 1 if it should be closed.
  */
-int init_shmem()
+static int http_read(struct client *c)
 {
-	mode_t orig_umask;
-	struct stat filestat;
+	struct http_request *h = c->http;
+	char *end;
+	size_t n;
+	ssize_t rv;
 
-	pagesize = sysconf(_SC_PAGESIZE); // 4 KiB or 2 MiB
+	for (;;) {
+		while ((end = strstr(h->buf, "\r\n\r\n")) != NULL) {
+			end[2] = '\0';
+			request_started(c);
+			if (http_request(c, h->buf) != 0) return 1;
+			n = end + 4 - h->buf;
+			memmove(h->buf, h->buf + n, h->got - n + 1);
+			h->got -= n;
 
-	orig_umask = umask(0);
-	filemap_fd = shm_open("/ASM_MapFile", O_CREAT|O_RDWR, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
-	(void)umask(orig_umask);
+			if (client_flush(c) != 0) return 1;
+			c->stats.requests++;
+			c->active = monotonic_ns();
+			request_done(c);
+			if (c->head < c->tail) {
+				c->state = CLIENT_WRITING;
+				return 0;
+			}
+			if (h->close) return 1;
+		}
+		if (h->got == sizeof(h->buf) - 1) {
+			asmlog_error("HTTP client %d sent a request of over %zu bytes", c->id, h->got);
+			return 1;
+		}
 
-	if (filemap_fd < 0) {
-		asmlog_error("Could not create shared memory object, %s", strerror(errno));
-		return 1;
+		rv = recv(c->fd, h->buf + h->got, sizeof(h->buf) - 1 - h->got, 0);
+		if (rv == 0) return 1;
+		if (rv == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			asmlog_error("HTTP client %d recv(), %s", c->id, strerror(errno));
+			return 1;
+		}
+		h->got += rv;
+		h->buf[h->got] = '\0';
 	}
-	memset(&filestat, 0, sizeof(filestat));
-	if (fstat(filemap_fd, &filestat) != 0) {
-		asmlog_error("Could not fstat() the shared memory object, %s", strerror(errno));
-		(void)shm_unlink("/ASM_MapFile");
-		(void)close(filemap_fd);
+}
+
+/*
+ * Advance the client's state machine after epoll reported it ready
+ *
+ * Returns 0 if the client is still connected, 1 if it should be closed.
+ */
+static int client_ready(int epfd, struct client *c, uint32_t events)
+{
+	enum client_state state = c->state;
+	int rv, requests = 0;
+
+	if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN)) {
 		return 1;
 	}
-	if (filestat.st_size == 0) {
-		if (ftruncate(filemap_fd, FILEMAPSIZE) != 0) {
-			asmlog_error("Could not set shared memory object size, %s", strerror(errno));
-			shm_unlink("/ASM_MapFile");
-			close(filemap_fd);
-			return 1;
+
+	if (c->state == CLIENT_WRITING) {
+		if (client_flush(c) != 0) return 1;
+		request_done(c);
+		if (c->head == c->tail) {
+			if (c->http != NULL && c->http->close) return 1;
+			c->state = CLIENT_READING;
 		}
-		firstload = 1;
 	}
 
-	filemap = mmap(NULL, FILEMAPSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, filemap_fd, 0);
-	if (filemap == MAP_FAILED) {
-		filemap = NULL;
-		if (firstload == 1) {
-			shm_unlink("/ASM_MapFile");
-		}
-		close(filemap_fd);
-		asmlog_error("Could not memory map the object, %s", strerror(errno));
+	if (c->http != NULL && c->state == CLIENT_READING && http_read(c) != 0) {
 		return 1;
 	}
+	while (c->http == NULL && c->state == CLIENT_READING && requests < CLIENT_REQUEST_BURST) {
+		rv = recv(c->fd, c->req + c->got, sizeof(c->req) - c->got, 0);
+		if (rv == 0) {
+			// The client closed the connection
+			return 1;
+		}
+		if (rv == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			asmlog_error("Client %d recv(), %s", c->id, strerror(errno));
+			return 1;
+		}
 
-	if (firstload == 1) {
-		memset(filemap, 0, FILEMAPSIZE);
-		asmlog_info("Shared memory initialized");
+		c->got += rv;
+		if (c->got < (int)sizeof(c->req)) continue;
+		c->got = 0;
+		requests++;
+
+		request_started(c);
+		client_request(c);
+		if (client_flush(c) != 0) return 1;
+		if (c->request == 0) {
+			c->stats.requests++;
+			c->active = monotonic_ns();
+			request_done(c);
+		}
+		if (c->head < c->tail) c->state = CLIENT_WRITING;
 	}
 
+	if (c->state != state && client_watch(epfd, c, EPOLL_CTL_MOD) != 0) {
+		return 1;
+	}
 	return 0;
 }
 
-void close_shmem(void)
+/*
+ * Has the client not taken the previous push yet? Counts what is still
+ * in the socket's send queue as well, so that pushes are not left to
+ * pile up there either.
+ */
+static int push_pending(const struct client *c)
 {
-	if (filemap != NULL) {
-		munmap(filemap, FILEMAPSIZE);
+	int queued = 0;
+
+	if (c->head < c->tail) return 1;
+	return ioctl(c->fd, SIOCOUTQ, &queued) == 0 && (size_t)queued > 8 + snapshot.len;
+}
+
+/*
+ * Push the snapshot to each subscribed client that is due, if it changed
+ * since the client last got it. A client that has not taken the previous
+ * push yet gets the latest snapshot once it catches up instead of a
+ * backlog of old ones: if none of the previous push has gone to the
+ * socket, it is replaced, and otherwise the new one is skipped. Delta
+ * frames are always skipped, as each one depends on the one before. A
+ * push that would leave more than CLIENT_MAX_QUEUE bytes queued behind
+ * other output is skipped as well.
+ */
+static void push_snapshots(int epfd, uint64_t now)
+{
+	struct client *c, *next;
+	int refreshed = 0;
+
+	for (c = clients; c != NULL; c = next) {
+		next = c->next;
+		if (!c->subscribed || c->next_push > now) continue;
+
+		c->next_push = now + c->interval * 1000000ULL;
+		if (!refreshed) {
+			refresh_snapshot();
+			refreshed = 1;
+		}
+		if (c->pushed == snapshot.serial) continue;
+		if (c->queued_push > 0 && c->tail - c->head >= c->queued_push) {
+			c->tail -= c->queued_push;
+			c->queued_push = 0;
+			stats.pushes_replaced++;
+		} else if (push_pending(c)) {
+			if (c->head == c->tail && c->behind == 0) {
+				// Stuck in the socket's send queue
+				c->behind = now;
+				stats.slow_clients++;
+			}
+			stats.pushes_coalesced++;
+			continue;
+		}
+		if (c->head < c->tail && c->tail - c->head + 8 + snapshot.len > CLIENT_MAX_QUEUE) {
+			stats.queue_full++;
+			continue;
+		}
+		if (push_snapshot(c) != 0 || client_flush(c) != 0) {
+			client_close(epfd, c);
+			continue;
+		}
+		if (c->head < c->tail) {
+			c->state = CLIENT_WRITING;
+			if (client_watch(epfd, c, EPOLL_CTL_MOD) != 0) {
+				client_close(epfd, c);
+			}
+		}
 	}
-	if (filemap_fd > -1) {
-		if (firstload == 1) {
-			shm_unlink("/ASM_MapFile");
+}
+
+/*
+ * Disconnect the clients whose output has not moved for write_timeout
+ * seconds, and, if idle_timeout is set, the ones that have not sent a
+ * request for that long. Subscribed clients are never idle. Checked once
+ * a second.
+ */
+static void expire_clients(int epfd, uint64_t now)
+{
+	struct client *c, *next;
+
+	if (now < expire_next) return;
+	expire_next = now + 1000000000ULL;
+
+	for (c = clients; c != NULL; c = next) {
+		next = c->next;
+		if (write_timeout > 0 && c->behind != 0 && c->behind + write_timeout * 1000000000ULL < now) {
+			asmlog_warning("Client %d took no output for %d s, disconnecting", c->id, write_timeout);
+			stats.write_timeouts++;
+			client_close(epfd, c);
+		} else if (idle_timeout > 0 && !c->subscribed && c->active + idle_timeout * 1000000000ULL < now) {
+			asmlog_info("Client %d sent nothing for %d s, disconnecting", c->id, idle_timeout);
+			stats.idle_timeouts++;
+			client_close(epfd, c);
 		}
-		close(filemap_fd);
 	}
 }
 
-// Handle child processes exiting
-void handle_child(int s)
+/*
+ * Open the socket that snapshots are broadcast from, to broadcast_group
+ * on the same port number as the TCP server. The group may be a
+ * multicast or a unicast address.
+ */
+static int open_broadcast(void)
 {
-	(void)s;
+	char portnum[6];
+	struct addrinfo hints;
+	struct addrinfo *address_list, *p;
+	int rv;
 
-    while (waitpid(-1, NULL, WNOHANG) > 0) {
-		connected_clients--;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	snprintf(portnum, sizeof(portnum), "%d", port);
+
+	if ((rv = getaddrinfo(broadcast_group, portnum, &hints, &address_list)) != 0) {
+		asmlog_error("broadcast: getaddrinfo %s, %s", broadcast_group, gai_strerror(rv));
+		return 1;
+	}
+	for (p = address_list; p != NULL; p = p->ai_next) {
+		broadcast.fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+		if (broadcast.fd == -1) continue;
+		// Multicast stays on the local network: the default TTL is 1
+		if (connect(broadcast.fd, p->ai_addr, p->ai_addrlen) == 0) break;
+		close(broadcast.fd);
+		broadcast.fd = -1;
 	}
+	freeaddrinfo(address_list);
+	if (broadcast.fd == -1) {
+		asmlog_error("broadcast: cannot send to %s:%d, %s", broadcast_group, port, strerror(errno));
+		return 1;
+	}
+
+	broadcast.interval = broadcast_interval < ASM_PUSH_MIN_INTERVAL ?
+			ASM_PUSH_MIN_INTERVAL : (uint32_t)broadcast_interval;
+	broadcast.next = monotonic_ns();
+	asmlog_info("Broadcasting snapshots to %s:%d, at most one per %u ms",
+			broadcast_group, port, broadcast.interval);
+	return 0;
 }
 
+/*
+ * Broadcast the snapshot if it is due and changed since it was last
+ * broadcast, or if it has not been broadcast for ASM_BROADCAST_REPEAT ms,
+ * so that new listeners do not wait long for their first snapshot.
+ */
+static void broadcast_snapshot(uint64_t now)
+{
+	unsigned char datagram[ASM_BROADCAST_HEADER + ASM_DELTA_MAX_SIZE];
+	size_t len;
+
+	if (now < broadcast.next) return;
+	broadcast.next = now + broadcast.interval * 1000000ULL;
+
+	refresh_snapshot();
+	if (broadcast.sent == snapshot.serial && now < broadcast.repeat) return;
+
+	len = asm_delta_encode(&broadcast.delta, snapshot.records, 1, datagram + ASM_BROADCAST_HEADER);
+	*((unsigned int *)datagram)       = ASM_BROADCAST_MAGIC;
+	*((unsigned int *)(datagram + 4)) = ++broadcast.sequence;
+	*((unsigned int *)(datagram + 8)) = snapshot.serial;
+	// Nobody listening to a unicast address shows up as ECONNREFUSED
+	if (send(broadcast.fd, datagram, ASM_BROADCAST_HEADER + len, 0) == -1) {
+		asmlog_debug("broadcast: send, %s", strerror(errno));
+		stats.broadcast_errors++;
+	} else {
+		stats.broadcasts++;
+	}
+	broadcast.sent   = snapshot.serial;
+	broadcast.repeat = now + ASM_BROADCAST_REPEAT * 1000000ULL;
+}
 
 /*
- * serialize the server info and send it down the tubes
- *
- * NOTE: it appears that the Windows ArmaServerMonitor uses data serialized
- *       in non-network byte order, ie in Intel x86 host byte order
- *       (aka Little endian). That means that this function is technically
- *       non-portable to non-x86 architectures, since we do not use htons()
- *       et al to serialize the data before it is sent.
- *       (OTOH, ArmA is strictly x86 anyhow)
+ * Add a sample of every active instance to the rollups, and to the
+ * archive if there is one, every ASM_ARCHIVE_INTERVAL ms. The samples
+ * are stamped with the wall clock, which unlike the monotonic one means
+ * something after a reboot.
  */
-int send_asi(int clientfd)
+static void sample_instances(uint64_t now)
 {
-	int status = 0;
-	uint32_t DeadTimeOut;
-	struct ARMA_SERVER_INFO *asi = NULL;
-	int instance, remaining;
-	unsigned char sendbuf[MAX_ARMA_INSTANCES * sizeof(struct ARMA_SERVER_INFO)];
-	unsigned char* p = NULL;
+	uint64_t values[ASM_FIELDS];
+	struct ASM_INSTANCE slot;
+	struct timespec ts;
+	uint64_t time;
+	int instance;
 
-	//asmlog_info("send_asi: ARMA_SERVER_INFO is %zd bytes.", sizeof(struct ARMA_SERVER_INFO));
-	memset(sendbuf, 0, sizeof(sendbuf));
-	p = sendbuf;
-	DeadTimeOut = gettickcount() - 10000;
-	for (instance = 0; instance < MAX_ARMA_INSTANCES; instance++) {
-		asi = (struct ARMA_SERVER_INFO*)((unsigned char *)filemap + (instance * pagesize));
+	if (now < sample_next) return;
+	sample_next = now + ASM_ARCHIVE_INTERVAL * 1000000ULL;
 
-		// Serialize the ARMA_SERVER_INFO data
-		if (asi->PID == 0 || asi->TICK_COUNT < DeadTimeOut) {
-			// The slot is either unused or dead - just send a zero PID field.
-			*((unsigned short *)p) = 0;                  p += sizeof(unsigned short); // 2
-		} else {
-			*((unsigned short *)p) = asi->PID;           p += sizeof(unsigned short); // 2
-			*((unsigned short *)p) = asi->OBJ_COUNT_0;   p += sizeof(unsigned short); // 4
-			*((unsigned short *)p) = asi->OBJ_COUNT_1;   p += sizeof(unsigned short); // 6
-			*((unsigned short *)p) = asi->OBJ_COUNT_2;   p += sizeof(unsigned short); // 8
-			*((unsigned short *)p) = asi->PLAYER_COUNT;  p += sizeof(unsigned short); // 10
-			*((unsigned short *)p) = asi->AI_LOC_COUNT;  p += sizeof(unsigned short); // 12
-			*((unsigned short *)p) = asi->AI_REM_COUNT;  p += sizeof(unsigned short); // 14
-			*((unsigned short *)p) = asi->SERVER_FPS;    p += sizeof(unsigned short); // 16
-			*((unsigned short *)p) = asi->SERVER_FPSMIN; p += sizeof(unsigned short); // 18
-			*((unsigned short *)p) = asi->FSM_CE_FREQ;   p += sizeof(unsigned short); // 20
-			*((unsigned int *)p)   = asi->MEM;           p += sizeof(unsigned int);   // 24
-			*((unsigned int *)p)   = asi->NET_RECV;      p += sizeof(unsigned int);   // 28
-			*((unsigned int *)p)   = asi->NET_SEND;      p += sizeof(unsigned int);   // 32
-			*((unsigned int *)p)   = asi->DISC_READ;     p += sizeof(unsigned int);   // 36
-			*((unsigned int *)p)   = asi->TICK_COUNT;    p += sizeof(unsigned int);   // 40
-			memcpy(p, asi->MISSION, SMALSTRINGSIZE);     p += SMALSTRINGSIZE;         // 72
-			memcpy(p, asi->PROFILE, SMALSTRINGSIZE);     p += SMALSTRINGSIZE;         // 104
-			asi->MISSION[SMALSTRINGSIZE - 1] = 0;
-			asi->PROFILE[SMALSTRINGSIZE - 1] = 0;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	time = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+	for (instance = instance_next(0); instance >= 0; instance = instance_next(instance + 1)) {
+		if (instance_read(instance, &slot) != 0 || slot.PID == 0 || slot.UPDATED + DEAD_TIMEOUT_NS < now) {
+			continue;
 		}
+		asi_fields(&slot, ASM_ARCHIVE_FIELDS, values);
+		asm_rollup_add(instance, time, values);
+		if (archiving) asm_archive_add(instance, time, values);
 	}
-	remaining = p - sendbuf;
-	//asmlog_debug("send_asi: %d sending %zd", instance + 1, remaining);
-	do {
-		int sent = send(clientfd, (void *)sendbuf, remaining, 0);
-		if (sent == -1) {
-			if (errno != EINTR) {
-				asmlog_error("send_asi, send()");
-				status = 1;
+	if (archiving) asm_archive_sweep(time);
+}
+
+enum listener {
+	LISTENER_TCP,
+	LISTENER_HTTP,  // metrics_port
+	LISTENER_LOCAL  // local_socket
+};
+
+// Accept all pending connections on one of the (non-blocking) listening sockets
+static void accept_clients(int epfd, int server, enum listener kind)
+{
+	int http = kind == LISTENER_HTTP;
+	struct sockaddr_storage client_addr;
+	socklen_t size;
+	char s[INET6_ADDRSTRLEN];
+	struct client *c;
+	int fd;
+
+	for (;;) {
+		size = sizeof(client_addr);
+		fd = accept4(server, (struct sockaddr *)&client_addr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				asmlog_error("accept, %s", strerror(errno));
 			}
-			break;
+			return;
 		}
-		remaining -= sent;
-	} while (remaining > 0);
 
-	return status;
+		// Limit the number of clients that may connect to max_clients
+		if (http ? http_clients >= HTTP_MAX_CLIENTS : connected_clients >= max_clients) {
+			stats.rejected++;
+			close(fd);
+			continue;
+		}
+
+		if (kind == LISTENER_LOCAL) {
+			snprintf(s, sizeof(s), "%s", "the local socket");
+		} else {
+			inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr *)&client_addr), s, sizeof s);
+		}
+
+		// TODO: use TCP Wrappers to let sysadmins accept or deny connections
+
+		if (http) {
+			// Scrapers come every few seconds, so do not fill the log
+			asmlog_debug("Got HTTP connection from %s", s);
+		} else {
+			asmlog_info("Got connection from %s", s);
+		}
+
+		if ((c = calloc(1, sizeof(*c))) == NULL ||
+		    (http && (c->http = calloc(1, sizeof(*c->http))) == NULL)) {
+			asmlog_error("accept, out of memory");
+			close(fd);
+			free(c);
+			continue;
+		}
+		c->fd    = fd;
+		c->id    = ++connections;
+		c->active = monotonic_ns();
+		c->state = CLIENT_READING;
+		c->local = kind == LISTENER_LOCAL;
+		if (client_watch(epfd, c, EPOLL_CTL_ADD) != 0) {
+			close(fd);
+			free(c->http);
+			free(c);
+			continue;
+		}
+		c->next = clients;
+		if (clients != NULL) clients->prev = c;
+		clients = c;
+		if (http) {
+			http_clients++;
+		} else {
+			connected_clients++;
+			asmlog_info("Client %d connected", c->id);
+		}
+	}
+}
+
+/*
+ * Make sure the process may open a socket for each of max_clients,
+ * as far as the hard limit allows
+ */
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+	rlim_t want = max_clients + 64;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < want) {
+		rl.rlim_cur = rl.rlim_max < want ? rl.rlim_max : want;
+		if (setrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur < want) {
+			asmlog_warning("Open file limit %lu is too low for %d clients",
+					(unsigned long)rl.rlim_cur, max_clients);
+		}
+	}
 }
 
 // A port number is a 16-bit value whose max value is 65535,
 // ie  5+1 chars if represented as a string
 #define PORT_STRLEN 6
-int asmserver()
+
+/*
+ * Open a non-blocking socket listening on port_number
+ *
+ * Returns the socket, or -1 on failure.
+ */
+static int listen_on(int port_number)
 {
-	int rv, server, yes = 1;
+	int rv, server = -1, yes = 1;
 	char portnum[PORT_STRLEN];
 	struct addrinfo hints;
 	struct addrinfo *address_list;
 	struct addrinfo *p;
-	struct sigaction sa;
-
-	socklen_t size;
-	struct sockaddr_storage client_addr;
-	char s[INET6_ADDRSTRLEN];
-	pid_t pid;
-
-	asmlog_info(PACKAGE_STRING);
-
-	// Open the shared memory area
-	if (init_shmem()) {
-		asmlog_error("Could not initalize the shared memory area");
-		return EXIT_FAILURE;
-	}
 
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family   = AF_UNSPEC;   // IPv4 and IPv6
 	hints.ai_socktype = SOCK_STREAM; // TCP
 	hints.ai_flags    = AI_PASSIVE;  // fill in my IP for me
 
-	snprintf(portnum, PORT_STRLEN, "%d", port);
+	snprintf(portnum, PORT_STRLEN, "%d", port_number);
 
 	if ((rv = getaddrinfo(NULL, portnum, &hints, &address_list)) != 0) {
-	    asmlog_error("asmserver(): getaddrinfo, %s", gai_strerror(rv));
-	    return EXIT_FAILURE;	// FIXME: cleanup
+		asmlog_error("asmserver(): getaddrinfo, %s", gai_strerror(rv));
+		return -1;
 	}
 
 	// Pick the first usable address found
@@ -261,7 +1908,8 @@ int asmserver()
 		{
 			close(server);
 			asmlog_error("asmserver(): setsockopt");
-			return EXIT_FAILURE;		// FIXME: cleanup
+			freeaddrinfo(address_list);
+			return -1;
 		}
 
 		if (bind(server, p->ai_addr, p->ai_addrlen) == -1) {
@@ -273,120 +1921,218 @@ int asmserver()
 		break;
 	}
 
+	freeaddrinfo(address_list);
+
 	if (p == NULL)
 	{
-		asmlog_error("server(): failed to bind");
-	    return EXIT_FAILURE; // FIXME: cleanup
+		asmlog_error("server(): failed to bind to port %d", port_number);
+		return -1;
 	}
 
-	freeaddrinfo(address_list);
-
-	if (listen(server, max_clients) == -1) {
+	// max_clients is enforced by accept_clients(), not by the backlog
+	if (listen(server, SOMAXCONN) == -1) {
 		asmlog_error("listen");
 		close(server);
-	    return EXIT_FAILURE;
+		return -1;
 	}
+	fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+	return server;
+}
 
-	// Handle client connection handlers exiting
-	memset(&sa, 0, sizeof sa);
-	sa.sa_handler = handle_child;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = SA_NOCLDSTOP;
-	if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-		asmlog_error("sigaction");
-		close(server);
-	    return EXIT_FAILURE;
+/*
+ * Open a non-blocking Unix-domain socket at path, for local clients.
+ * Who may connect is up to the permissions of the socket file.
+ *
+ * Returns the socket, or -1 on failure.
+ */
+static int listen_local(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int server;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		asmlog_error("Socket path %s is too long", path);
+		return -1;
 	}
+	strcpy(addr.sun_path, path);
 
-	// Wait for connections
-	running = 1;
-	size = sizeof(client_addr);
+	// A socket left behind by a daemon that did not exit cleanly
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
 
-	while (running) {  // main accept() loop
-		asmlog_info("Waiting for connections");
+	if ((server = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		asmlog_error("asmserver(): socket, %s", strerror(errno));
+		return -1;
+	}
+	if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		asmlog_error("asmserver(): bind %s, %s", path, strerror(errno));
+		close(server);
+		return -1;
+	}
+	if (chmod(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) == -1 || listen(server, SOMAXCONN) == -1) {
+		asmlog_error("asmserver(): %s, %s", path, strerror(errno));
+		close(server);
+		unlink(path);
+		return -1;
+	}
+	return server;
+}
 
-		int client = accept(server, (struct sockaddr *)&client_addr, &size);
-		if (client == -1) {
-			if (errno != EINTR) {
-				asmlog_error("accept");
-			}
-			continue;
-		}
+// Have the event loop wake up for connections to a listening socket
+static int listener_watch(int epfd, int fd, void *ptr)
+{
+	struct epoll_event ev;
 
-		// Limit the number of clients that may connect to max_clients
-		if (connected_clients >= max_clients) {
-			close(client);
-			continue;
-		}
+	ev.events   = EPOLLIN;
+	ev.data.ptr = ptr;
+	if (fd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		asmlog_error("epoll_ctl, %s", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
 
-		inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr *)&client_addr), s, sizeof s);
+int asmserver()
+{
+	int server = -1, metrics_server = -1, local_server = -1, relay = -1, notify = -1;
+	struct epoll_event events[EPOLL_EVENTS];
+	int epfd = -1, n, i, status = EXIT_FAILURE;
 
-		// TODO: use TCP Wrappers to let sysadmins accept or deny connections
+	asmlog_info(PACKAGE_STRING);
 
-		asmlog_info("Got connection from %s", s);
+	// Open the shared memory area, unless the instances come from upstreams
+	if (upstream_count == 0 && init_shmem()) {
+		asmlog_error("Could not initalize the shared memory area");
+		return EXIT_FAILURE;
+	}
 
-		if ((pid = fork()) < 0) {
-			/* MURPHY */
-			asmlog_error("fork, %s", strerror(errno));
-			close(client);
-			running = 0;
-			continue;
+	if ((server = listen_on(port)) == -1) {
+		goto out;
+	}
+	if (metrics_port > 0) {
+		if ((metrics_server = listen_on(metrics_port)) == -1) goto out;
+		asmlog_info("Serving metrics on port %d", metrics_port);
+	}
+	if (local_socket[0] != '\0') {
+		if ((local_server = listen_local(local_socket)) == -1) goto out;
+		asmlog_info("Listening on %s", local_socket);
+	}
+	if (upstream_count > 0) {
+		if ((relay = asm_relay_open(upstreams, upstream_count)) == -1) goto out;
+		relay_mode = 1;
+	}
+	if (archive[0] != '\0') {
+		if (asm_archive_open(archive) != 0) goto out;
+		archiving = 1;
+	}
+	asmlog_info("Rollups with %s kernels", asm_rollup_kernels(NULL)->name);
+	// Without notification, pushes fall back to looking for changes when clients are due
+	if (!relay_mode) {
+		if ((notify = asm_notify_open(asm_shm_generation(&shm), asm_shm_waiting(&shm))) == -1) {
+			asmlog_warning("No change notification, polling for changes to push");
 		}
+		notifying = notify != -1;
+	}
 
-		connected_clients++;
-		if (pid == 0) {
-			/* CHILD */
-			int i;
-			char req[5] = {0};
+	raise_fd_limit();
 
-			fd_set fds;
+	if (broadcast_group[0] != '\0' && open_broadcast() != 0) {
+		goto out;
+	}
 
-			close(server); // child doesn't need the server socket
-			server = -1;
+	// Serve all clients from one event loop. The listening sockets are
+	// told apart from clients by their epoll data.
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		asmlog_error("epoll_create1, %s", strerror(errno));
+		goto out;
+	}
+	if (listener_watch(epfd, server, NULL) != 0 ||
+	    listener_watch(epfd, metrics_server, &metrics_server) != 0 ||
+	    listener_watch(epfd, local_server, &local_server) != 0 ||
+	    listener_watch(epfd, relay, &relay) != 0 ||
+	    listener_watch(epfd, notify, &notify) != 0) {
+		goto out;
+	}
 
-			FD_ZERO(&fds);
-			FD_SET(client, &fds);
+	// Wait for connections
+	running = 1;
+	status  = EXIT_SUCCESS;
+	stats.counted_at = monotonic_ns();
+	asmlog_info("Waiting for connections");
 
-			// Identify the child process using the client connection number
-			snprintf(args[0], strlen(args[0]), "%s%d", prog_name, connected_clients);
-			for (i = argsc - 1; i > 0; i--) {
-				memset(args[i], 0, strlen(args[i]));
+	while (running) {  // main event loop
+		watch_changes();
+		n = epoll_wait(epfd, events, EPOLL_EVENTS, push_timeout(monotonic_ns()));
+		if (n == -1) {
+			if (errno != EINTR) {
+				asmlog_error("epoll_wait, %s", strerror(errno));
+				running = 0;
 			}
+			continue;
+		}
 
-			asmlog_info("Client %d connected", connected_clients);
-
-			while (running) {
-				asmlog_debug("Client %d recv() ...", connected_clients);
-				rv = recv(client, req, 4, 0);
-
-				if (rv == 0) {
-					// The client closed the connection
-					running = 0;
-					continue;
-				}
-
-				if (rv == -1 && errno == EINTR) continue;
-
-				// A zero "DWORD" (32-bits) is the magic word
-				i = atoi(req);
-				if (i == 0) {
-					asmlog_debug("Client %d send_asi() ...", connected_clients);
-					send_asi(client);
-				} else {
-					asmlog_error("Client %d received %08x (%02x %02x %02x %02x)",
-							connected_clients, i, req[0], req[1], req[2], req[3]);
-				}
-			 	memset(req, 0xff, sizeof(req));
-			 }
-
-			close(client);
-			asmlog_info("Client %d disconnected", connected_clients);
-		} else {
-			/* PARENT */
-			close(client);  // parent doesn't need the client socket
+		for (i = 0; i < n; i++) {
+			struct client *c = events[i].data.ptr;
+
+			if (c == NULL) {
+				accept_clients(epfd, server, LISTENER_TCP);
+			} else if (events[i].data.ptr == &metrics_server) {
+				accept_clients(epfd, metrics_server, LISTENER_HTTP);
+			} else if (events[i].data.ptr == &local_server) {
+				accept_clients(epfd, local_server, LISTENER_LOCAL);
+			} else if (events[i].data.ptr == &relay) {
+				asm_relay_ready(monotonic_ns());
+			} else if (events[i].data.ptr == &notify) {
+				asm_notify_ready();
+			} else if (client_ready(epfd, c, events[i].events) != 0) {
+				client_close(epfd, c);
+			}
 		}
+		if (relay_mode) {
+			asm_relay_poll(monotonic_ns());
+		}
+		if (subscribers > 0) {
+			push_snapshots(epfd, monotonic_ns());
+		}
+		if (broadcast.fd != -1) {
+			broadcast_snapshot(monotonic_ns());
+		}
+		sample_instances(monotonic_ns());
+		expire_clients(epfd, monotonic_ns());
+	}
+
+	// Disconnect the clients that are still connected
+	while (clients != NULL) {
+		client_close(epfd, clients);
 	}
 
+out:
+	if (epfd != -1) {
+		close(epfd);
+	}
+	if (broadcast.fd != -1) {
+		close(broadcast.fd);
+	}
+	if (metrics_server != -1) {
+		close(metrics_server);
+	}
+	asm_metrics_free(&metrics.text);
+	asm_metrics_free(&metrics.scrape);
+	if (local_server != -1) {
+		close(local_server);
+		unlink(local_socket);
+	}
+	if (shm_readonly != -1) {
+		close(shm_readonly);
+	}
+	asm_notify_close();
+	asm_relay_close();
+	asm_archive_close();
+	asm_rollup_free();
 	if (server > -1) {
 		close(server);
 		asmlog_info("Server exiting");
@@ -394,6 +2140,5 @@ int asmserver()
 
 	close_shmem();
 
-	return EXIT_SUCCESS;
+	return status;
 }
-
@@ -35,6 +35,9 @@
 asm_settings settings = {
 	.enableAPImonitoring = 0,  // Not implemented
 	.enableProfilePrefixSlotSelection = 1,
+	.samplingInterval = 1000,
+	.historyInterval = 5,
+	.extensionBudget = 0,
 	.OCI0 = "30",
 	.OCI1 = "60",
 	.OCI2 = "0",
@@ -153,6 +156,41 @@ void read_settings(void)
 		}
 	}
 
+	ival = g_key_file_get_integer(asm_ini, "ASM", "samplinginterval", &error);
+	if (error != NULL) {
+		asmlog_warning("asm.ini: %s", error->message);
+		g_clear_error(&error);
+	} else {
+		if (ival >= 0) {
+			settings.samplingInterval = ival;
+		}
+	}
+
+	ival = g_key_file_get_integer(asm_ini, "ASM", "historyinterval", &error);
+	if (error != NULL) {
+		asmlog_warning("asm.ini: %s", error->message);
+		g_clear_error(&error);
+	} else {
+		if (ival >= 0) {
+			settings.historyInterval = ival;
+		}
+	}
+
+	ival = g_key_file_get_integer(asm_ini, "ASM", "extensionbudget", &error);
+	if (error != NULL) {
+		asmlog_warning("asm.ini: %s", error->message);
+		g_clear_error(&error);
+	} else {
+		if (ival >= 0) {
+			settings.extensionBudget = ival;
+		}
+	}
+	// The budget only gates reading /proc on the Arma server thread, which the sampler does instead
+	if (settings.extensionBudget > 0 && settings.samplingInterval > 0) {
+		asmlog_warning("asm.ini: extensionbudget needs samplinginterval=0, ignored");
+		settings.extensionBudget = 0;
+	}
+
 	ival = g_key_file_get_integer(asm_ini, "ASM", "objectcountinterval0", &error);
 	if (error != NULL) {
 		asmlog_warning("asm.ini: %s", error->message);
@@ -27,6 +27,9 @@
 typedef struct {
 	int enableAPImonitoring;
 	int enableProfilePrefixSlotSelection;
+	int samplingInterval;
+	int historyInterval;
+	int extensionBudget;
 	char OCI0[SMALSTRINGSIZE];
 	char OCI1[SMALSTRINGSIZE];
 	char OCI2[SMALSTRINGSIZE];
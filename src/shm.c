@@ -0,0 +1,385 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "asi.h"
+#include "asm.h"
+#include "asmlog.h"
+#include "gettickcount.h"
+#include "shm.h"
+
+// How long to wait for another process to finish initializing the area
+#define SHM_INIT_WAIT_MS 1000
+
+static void sleep_ms(long ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+		;
+	}
+}
+
+// Fill in the header of a new area. MAGIC goes last, it marks the area as ready.
+static void init_header(struct ASM_SHM_HEADER *header)
+{
+	header->SCHEMA      = ASM_SHM_VERSION;
+	header->SLOT_COUNT  = ASM_MAX_SLOTS;
+	header->SLOT_STRIDE = ASM_SLOT_STRIDE;
+	header->SLOT_OFFSET = ASM_SLOT_OFFSET;
+	header->CAPACITY    = MAX_ARMA_INSTANCES;
+	__atomic_store_n(&header->MAGIC, ASM_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Wait for the creator of an existing area to initialize it, then check its layout
+static int check_header(const struct ASM_SHM_HEADER *header)
+{
+	int waited;
+
+	for (waited = 0; __atomic_load_n(&header->MAGIC, __ATOMIC_ACQUIRE) != ASM_SHM_MAGIC; waited += 10) {
+		if (waited >= SHM_INIT_WAIT_MS) {
+			asmlog_error("Shared memory object %s was never initialized, remove /dev/shm%s",
+			             ASM_SHM_NAME, ASM_SHM_NAME);
+			return 1;
+		}
+		sleep_ms(10);
+	}
+
+	if (header->SCHEMA != ASM_SHM_VERSION ||
+	    header->SLOT_COUNT != ASM_MAX_SLOTS ||
+	    header->SLOT_STRIDE != ASM_SLOT_STRIDE ||
+	    header->SLOT_OFFSET != ASM_SLOT_OFFSET) {
+		asmlog_error("Shared memory object %s has an incompatible layout "
+		             "(version %u, %u slots of %u bytes at %u, expected version %u, %u slots of %zu bytes at %zu)",
+		             ASM_SHM_NAME, header->SCHEMA, header->SLOT_COUNT, header->SLOT_STRIDE, header->SLOT_OFFSET,
+		             ASM_SHM_VERSION, ASM_MAX_SLOTS, ASM_SLOT_STRIDE, ASM_SLOT_OFFSET);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Create or open the shared memory area, and map it.
+ *
+ * Returns 0 on success.
+ */
+int asm_shm_open(struct asm_shm *shm)
+{
+	mode_t orig_umask;
+	struct stat filestat;
+	int waited;
+
+	memset(shm, 0, sizeof(*shm));
+
+	orig_umask = umask(0);
+	shm->fd = shm_open(ASM_SHM_NAME, O_CREAT|O_EXCL|O_RDWR, ASM_SHM_MODE);
+	if (shm->fd > -1) {
+		shm->created = 1;
+	} else if (errno == EEXIST) {
+		shm->fd = shm_open(ASM_SHM_NAME, O_RDWR, 0);
+	}
+	(void)umask(orig_umask);
+
+	if (shm->fd < 0) {
+		asmlog_error("Could not create shared memory object: %s", strerror(errno));
+		return 1;
+	}
+
+	if (shm->created) {
+		if (ftruncate(shm->fd, ASM_SHM_SIZE(MAX_ARMA_INSTANCES)) != 0) {
+			asmlog_error("Could not set shared memory object size: %s", strerror(errno));
+			asm_shm_close(shm);
+			return 1;
+		}
+	} else {
+		// The creator may not have resized it yet
+		for (waited = 0; ; waited += 10) {
+			memset(&filestat, 0, sizeof(filestat));
+			if (fstat(shm->fd, &filestat) != 0) {
+				asmlog_error("Could not fstat() the shared memory object: %s", strerror(errno));
+				asm_shm_close(shm);
+				return 1;
+			}
+			if ((size_t)filestat.st_size >= ASM_SHM_SIZE(MAX_ARMA_INSTANCES)) break;
+			if (filestat.st_size > 0 || waited >= SHM_INIT_WAIT_MS) {
+				asmlog_error("Shared memory object %s is %zd bytes, expected %zu - "
+				             "is an older version of asmdll or armaservermonitor running?",
+				             ASM_SHM_NAME, (ssize_t)filestat.st_size, ASM_SHM_SIZE(MAX_ARMA_INSTANCES));
+				asm_shm_close(shm);
+				return 1;
+			}
+			sleep_ms(10);
+		}
+	}
+
+	// Map room for all slots up front, so the mapping never moves when the
+	// object grows. Only the slots below CAPACITY may be touched.
+	shm->map = mmap(NULL, ASM_SHM_SIZE(ASM_MAX_SLOTS), PROT_READ|PROT_WRITE, MAP_SHARED, shm->fd, 0);
+	if (shm->map == MAP_FAILED) {
+		shm->map = NULL;
+		asmlog_error("Could not memory map the object: %s", strerror(errno));
+		asm_shm_close(shm);
+		return 1;
+	}
+
+	if (shm->created) {
+		// A new object is zero-filled, only the header needs setting up
+		init_header((struct ASM_SHM_HEADER *)shm->map);
+		asmlog_debug("shared memory %s initialized, %d slots of %zu bytes",
+		             ASM_SHM_NAME, MAX_ARMA_INSTANCES, ASM_SLOT_STRIDE);
+	} else if (check_header((const struct ASM_SHM_HEADER *)shm->map) != 0) {
+		asm_shm_close(shm);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Map an area that was opened by someone else, read-only, from a
+ * descriptor such as the one that ASM_REQUEST_SHM_FD hands out. The
+ * descriptor is closed by asm_shm_close().
+ *
+ * Returns 0 on success.
+ */
+int asm_shm_attach(struct asm_shm *shm, int fd)
+{
+	memset(shm, 0, sizeof(*shm));
+	shm->fd = fd;
+
+	shm->map = mmap(NULL, ASM_SHM_SIZE(ASM_MAX_SLOTS), PROT_READ, MAP_SHARED, fd, 0);
+	if (shm->map == MAP_FAILED) {
+		shm->map = NULL;
+		asmlog_error("Could not memory map the object: %s", strerror(errno));
+		asm_shm_close(shm);
+		return 1;
+	}
+	if (check_header((const struct ASM_SHM_HEADER *)shm->map) != 0) {
+		asm_shm_close(shm);
+		return 1;
+	}
+	return 0;
+}
+
+// Open the area once more, read-only, to hand out to local readers
+int asm_shm_open_readonly(void)
+{
+	return shm_open(ASM_SHM_NAME, O_RDONLY, 0);
+}
+
+void asm_shm_close(struct asm_shm *shm)
+{
+	if (shm->map != NULL) {
+		munmap(shm->map, ASM_SHM_SIZE(ASM_MAX_SLOTS));
+		shm->map = NULL;
+	}
+	if (shm->fd > -1) {
+		if (shm->created) {
+			shm_unlink(ASM_SHM_NAME);
+		}
+		close(shm->fd);
+	}
+	shm->fd = -1;
+	shm->created = 0;
+}
+
+static inline struct ASM_SHM_HEADER *header_of(const struct asm_shm *shm)
+{
+	return (struct ASM_SHM_HEADER *)shm->map;
+}
+
+struct ASM_SLOT *asm_shm_slot(const struct asm_shm *shm, uint32_t id)
+{
+	if (shm->map == NULL || id >= __atomic_load_n(&header_of(shm)->CAPACITY, __ATOMIC_ACQUIRE)) return NULL;
+
+	return (struct ASM_SLOT *)((unsigned char *)shm->map + ASM_SLOT_OFFSET + id * ASM_SLOT_STRIDE);
+}
+
+// The counter that changes whenever anything in the snapshot may have changed
+uint32_t *asm_shm_generation(const struct asm_shm *shm)
+{
+	return shm->map != NULL ? &header_of(shm)->GENERATION : NULL;
+}
+
+// The flag a reader sets before it waits for the generation to move
+uint32_t *asm_shm_waiting(const struct asm_shm *shm)
+{
+	return shm->map != NULL ? &header_of(shm)->WAITING : NULL;
+}
+
+static void touch(struct ASM_SHM_HEADER *header)
+{
+	asi_notify(&header->GENERATION, &header->WAITING);
+}
+
+/*
+ * The id of the first slot in use at or after id from, or -1 if there
+ * are none.
+ */
+int asm_shm_next(const struct asm_shm *shm, uint32_t from)
+{
+	const struct ASM_SHM_HEADER *header;
+	uint32_t capacity, bits;
+
+	if (shm->map == NULL) return -1;
+
+	header   = header_of(shm);
+	capacity = __atomic_load_n(&header->CAPACITY, __ATOMIC_ACQUIRE);
+	while (from < capacity) {
+		bits = __atomic_load_n(&header->OCCUPIED[from / 32], __ATOMIC_ACQUIRE) >> (from % 32);
+		if (bits != 0) {
+			from += __builtin_ctz(bits);
+			return from < capacity ? (int)from : -1;
+		}
+		from = (from / 32 + 1) * 32;
+	}
+	return -1;
+}
+
+// Back ASM_SLOT_GROWTH more slots with memory
+static int grow(struct asm_shm *shm, uint32_t capacity)
+{
+	struct ASM_SHM_HEADER *header = header_of(shm);
+	uint32_t wanted = capacity + ASM_SLOT_GROWTH;
+	int rv;
+
+	if (wanted > ASM_MAX_SLOTS) {
+		asmlog_error("All %d shared memory slots are in use", ASM_MAX_SLOTS);
+		return 1;
+	}
+	// Unlike ftruncate(), posix_fallocate() never shrinks the object, so
+	// racing with another process growing it further is harmless.
+	if ((rv = posix_fallocate(shm->fd, 0, ASM_SHM_SIZE(wanted))) != 0) {
+		asmlog_error("Could not grow the shared memory object to %u slots: %s", wanted, strerror(rv));
+		return 1;
+	}
+	// If this fails, another process has grown it already
+	if (__atomic_compare_exchange_n(&header->CAPACITY, &capacity, wanted, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		asmlog_debug("shared memory grown to %u slots", wanted);
+	}
+	return 0;
+}
+
+// A dead process may have left a sequence number odd
+static void reset_sequences(struct ASM_SLOT *slot)
+{
+	int writer;
+
+	for (writer = 0; writer < ASI_WRITERS; writer++) {
+		uint32_t seq = __atomic_load_n(&slot->INFO.SEQUENCE[writer], __ATOMIC_RELAXED);
+
+		if (seq & 1) {
+			__atomic_store_n(&slot->INFO.SEQUENCE[writer], seq + 1, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+/*
+ * Claim a slot for this process: a free one if there is one, else the
+ * slot of an instance that stopped reporting DEAD_TIMEOUT_NS ago, else
+ * one from a newly grown part of the object.
+ *
+ * Returns the slot and sets *id, or returns NULL if there is no room.
+ */
+struct ASM_SLOT *asm_shm_claim(struct asm_shm *shm, uint32_t *id)
+{
+	struct ASM_SHM_HEADER *header;
+	struct ASM_SLOT *slot;
+	uint32_t capacity, word, bits, valid, bit;
+	uint64_t now, updated;
+	int n;
+
+	if (shm->map == NULL) return NULL;
+	header = header_of(shm);
+
+	for (;;) {
+		capacity = __atomic_load_n(&header->CAPACITY, __ATOMIC_ACQUIRE);
+
+		for (word = 0; word * 32 < capacity; word++) {
+			valid = capacity - word * 32 >= 32 ? ~0U : (1U << (capacity - word * 32)) - 1;
+			bits  = __atomic_load_n(&header->OCCUPIED[word], __ATOMIC_RELAXED);
+			while ((~bits & valid) != 0) {
+				bit = __builtin_ctz(~bits & valid);
+				// On failure, bits is reloaded and we try the next free bit
+				if (__atomic_compare_exchange_n(&header->OCCUPIED[word], &bits, bits | (1U << bit),
+				                                0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+					*id  = word * 32 + bit;
+					slot = asm_shm_slot(shm, *id);
+					reset_sequences(slot);
+					touch(header);
+					return slot;
+				}
+			}
+		}
+
+		// Take over the slot of a dead instance. Whoever manages to move
+		// its UPDATED time forward owns it.
+		now = monotonic_ns();
+		for (n = asm_shm_next(shm, 0); n >= 0; n = asm_shm_next(shm, n + 1)) {
+			slot    = asm_shm_slot(shm, n);
+			updated = __atomic_load_n(&slot->INFO.UPDATED, __ATOMIC_RELAXED);
+			if (__atomic_load_n(&slot->INFO.PID, __ATOMIC_RELAXED) != 0 && updated + DEAD_TIMEOUT_NS < now &&
+			    __atomic_compare_exchange_n(&slot->INFO.UPDATED, &updated, now, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				*id = n;
+				reset_sequences(slot);
+				touch(header);
+				return slot;
+			}
+		}
+
+		if (grow(shm, capacity) != 0) {
+			return NULL;
+		}
+	}
+}
+
+// Claim a specific slot, whether it is in use or not
+struct ASM_SLOT *asm_shm_claim_id(struct asm_shm *shm, uint32_t id)
+{
+	struct ASM_SLOT *slot = asm_shm_slot(shm, id);
+
+	if (slot != NULL) {
+		__atomic_fetch_or(&header_of(shm)->OCCUPIED[id / 32], 1U << (id % 32), __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->INFO.PID, __ATOMIC_RELAXED) == 0 ||
+		    __atomic_load_n(&slot->INFO.UPDATED, __ATOMIC_RELAXED) + DEAD_TIMEOUT_NS < monotonic_ns()) {
+			reset_sequences(slot);
+		}
+		touch(header_of(shm));
+	}
+	return slot;
+}
+
+// Give up a slot. Its contents should have been cleared first.
+void asm_shm_release(struct asm_shm *shm, uint32_t id)
+{
+	if (asm_shm_slot(shm, id) == NULL) return;
+
+	__atomic_fetch_and(&header_of(shm)->OCCUPIED[id / 32], ~(1U << (id % 32)), __ATOMIC_RELEASE);
+	touch(header_of(shm));
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASMSHM_H_
+#define ASMSHM_H_
+
+#include "asm.h"
+
+/*
+ * The shared memory area shared by asmdll.so and armaservermonitor.
+ *
+ * Whichever process comes first creates and initializes the area, and
+ * removes it again when it exits. The others check that the header
+ * matches the layout they were built with before they use any slot.
+ *
+ * Each Arma server process claims a slot of its own, and releases it
+ * when it unloads the extension. Readers walk the occupied slots with
+ *
+ *     for (id = asm_shm_next(shm, 0); id >= 0; id = asm_shm_next(shm, id + 1))
+ */
+struct asm_shm
+{
+	int   fd;
+	int   created;
+	void *map;
+};
+
+int  asm_shm_open(struct asm_shm *shm);
+int  asm_shm_attach(struct asm_shm *shm, int fd);
+int  asm_shm_open_readonly(void);
+void asm_shm_close(struct asm_shm *shm);
+
+struct ASM_SLOT *asm_shm_slot(const struct asm_shm *shm, uint32_t id);
+int  asm_shm_next(const struct asm_shm *shm, uint32_t from);
+
+struct ASM_SLOT *asm_shm_claim(struct asm_shm *shm, uint32_t *id);
+struct ASM_SLOT *asm_shm_claim_id(struct asm_shm *shm, uint32_t id);
+void asm_shm_release(struct asm_shm *shm, uint32_t id);
+
+uint32_t *asm_shm_generation(const struct asm_shm *shm);
+uint32_t *asm_shm_waiting(const struct asm_shm *shm);
+
+#endif /* ASMSHM_H_ */
@@ -19,25 +19,180 @@
  */
 
 #include <ctype.h>
+#include <dirent.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "asm.h"
+#include "asi.h"
+#include "asmlog.h"
+#include "delta.h"
+#include "gettickcount.h"
+#include "rollup.h"
+#include "tsblock.h"
 
 #define SLEEP 5
 
+#define SEQLOCK_READERS 4
+#define SEQLOCK_SECONDS 2
+
+#define CLIENTS_ROUNDS 100
+
+#define DELTA_FRAMES    10000
+#define DELTA_KEYFRAME  60
+
+#define ARCHIVE_SAMPLES 86400
+#define ARCHIVE_FIELDS  18
+
+#define ROLLUP_VALUES   3600
+
 typedef void (*callextension)(char *output, int outputSize, const char *function);
+typedef int (*callextensionargs)(char *output, int outputSize, const char *function, const char **args, int argsCnt);
+
+static struct ASM_INSTANCE seqlock_slot;
+static volatile int seqlock_running;
+
+struct seqlock_reader {
+	pthread_t thread;
+	unsigned long reads;
+	unsigned long torn;
+	unsigned long failed;
+	int protected;
+};
 
-int main(void)
+/*
+ * Every update writes the same counter value into all fields, so a
+ * consistent snapshot has identical values everywhere.
+ */
+static int seqlock_torn(const struct ASM_INSTANCE *asi)
+{
+	uint32_t v = asi->PID;
+	int i;
+
+	if (asi->OBJ_COUNT_0 != v || asi->OBJ_COUNT_1 != v || asi->OBJ_COUNT_2 != v ||
+	    asi->PLAYER_COUNT != v || asi->AI_LOC_COUNT != v || asi->AI_REM_COUNT != v ||
+	    asi->SERVER_FPS != v || asi->SERVER_FPSMIN != v || asi->FSM_CE_FREQ != v ||
+	    asi->MEM != v || asi->UPDATED != v) {
+		return 1;
+	}
+	for (i = 0; i < SMALSTRINGSIZE - 1; i++) {
+		if (asi->MISSION[i] != (char)('a' + v % 26) || asi->PROFILE[i] != (char)('a' + v % 26)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void seqlock_update(struct ASM_INSTANCE *asi, uint32_t v)
+{
+	asi_write_begin(asi, ASI_WRITER_GAME);
+	asi->PID = asi->OBJ_COUNT_0 = asi->OBJ_COUNT_1 = asi->OBJ_COUNT_2 = v;
+	asi->PLAYER_COUNT = asi->AI_LOC_COUNT = asi->AI_REM_COUNT = v;
+	asi->SERVER_FPS = asi->SERVER_FPSMIN = asi->FSM_CE_FREQ = v;
+	asi->MEM = asi->UPDATED = v;
+	memset(asi->MISSION, 'a' + v % 26, SMALSTRINGSIZE - 1);
+	memset(asi->PROFILE, 'a' + v % 26, SMALSTRINGSIZE - 1);
+	asi_write_end(asi, ASI_WRITER_GAME);
+}
+
+static void *seqlock_writer(void *arg)
+{
+	uint32_t i;
+
+	(void)arg;
+	for (i = 1; seqlock_running; i++) {
+		seqlock_update(&seqlock_slot, i);
+	}
+	return NULL;
+}
+
+static void *seqlock_reader(void *arg)
+{
+	struct seqlock_reader *reader = arg;
+	struct ASM_INSTANCE copy;
+
+	while (seqlock_running) {
+		if (reader->protected) {
+			if (asi_read(&seqlock_slot, &copy) != 0) {
+				reader->failed++;
+				continue;
+			}
+		} else {
+			memcpy(&copy, (const void *)&seqlock_slot, sizeof(copy));
+		}
+		reader->reads++;
+		reader->torn += seqlock_torn(&copy);
+	}
+	return NULL;
+}
+
+/*
+ * Contention test: one writer updating a slot in a tight loop while
+ * several readers take snapshots. Readers using asi_read() must never
+ * see a torn snapshot. A reader doing a plain memcpy() is run alongside
+ * to show that the test is able to detect tearing at all.
+ */
+static int test_seqlock(void)
+{
+	struct seqlock_reader readers[SEQLOCK_READERS + 1];
+	pthread_t writer;
+	unsigned long reads = 0, torn = 0, failed = 0;
+	int i;
+
+	memset(&seqlock_slot, 0, sizeof(seqlock_slot));
+	seqlock_update(&seqlock_slot, 0);
+	memset(readers, 0, sizeof(readers));
+	seqlock_running = 1;
+
+	for (i = 0; i <= SEQLOCK_READERS; i++) {
+		readers[i].protected = i < SEQLOCK_READERS;
+		pthread_create(&readers[i].thread, NULL, seqlock_reader, &readers[i]);
+	}
+	pthread_create(&writer, NULL, seqlock_writer, NULL);
+
+	sleep(SEQLOCK_SECONDS);
+	seqlock_running = 0;
+
+	pthread_join(writer, NULL);
+	for (i = 0; i <= SEQLOCK_READERS; i++) {
+		pthread_join(readers[i].thread, NULL);
+	}
+
+	for (i = 0; i < SEQLOCK_READERS; i++) {
+		reads  += readers[i].reads;
+		torn   += readers[i].torn;
+		failed += readers[i].failed;
+	}
+	printf("seqlock: %d readers, %lu snapshots, %lu torn, %lu gave up\n",
+			SEQLOCK_READERS, reads, torn, failed);
+	printf("memcpy:  1 reader,  %lu snapshots, %lu torn\n",
+			readers[SEQLOCK_READERS].reads, readers[SEQLOCK_READERS].torn);
+
+	return torn == 0 ? 0 : 1;
+}
+
+/*
+ * Load the extension library and look up RVExtension()
+ *
+ * Returns the dlopen() handle, or NULL on failure.
+ */
+static void *load_extension(callextension *RVExtension)
 {
-	char output[OUTPUTSIZE];
-	int instance = -1;
 	char *error;
 	void *handle = NULL;
-	callextension RVExtension = NULL;
 
+	*RVExtension = NULL;
 	dlerror();
 
 #if __x86_64__
@@ -54,22 +209,38 @@ int main(void)
 
 	if (handle == NULL) {
 		fprintf(stderr, "Could not open the ASM library: %s\n", dlerror());
-		return -1;
+		return NULL;
 	}
 
 	dlerror();
 
-	RVExtension = (callextension)dlsym(handle, "RVExtension");
+	*RVExtension = (callextension)dlsym(handle, "RVExtension");
 	if ((error = dlerror()) != 0L)
 	{
 		perror(error);
-		goto close;
+		dlclose(handle);
+		return NULL;
 	}
 
-	if (RVExtension == NULL)
+	if (*RVExtension == NULL)
 	{
 		fprintf(stderr, "Could not load function\n");
-		goto close;
+		dlclose(handle);
+		return NULL;
+	}
+
+	return handle;
+}
+
+static int test_extension(void)
+{
+	char output[OUTPUTSIZE];
+	int instance = -1;
+	void *handle = NULL;
+	callextension RVExtension = NULL;
+
+	if ((handle = load_extension(&RVExtension)) == NULL) {
+		return -1;
 	}
 
 	RVExtension(output, OUTPUTSIZE, "version");
@@ -114,9 +285,646 @@ int main(void)
 	sleep(SLEEP);
 	printf("Instance %d: sleep done.\n", instance);
 
-close:
 	dlclose(handle);
 
 	printf("All done\n");
 	return 0;
 }
+
+static double elapsed_ns(const struct timespec *t0, const struct timespec *t1)
+{
+	return 1e9 * (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec);
+}
+
+/*
+ * The "0:" - "6:" commands of RVExtension() as they were before the
+ * table-driven dispatch, as the baseline for "test bench". Copied as is,
+ * but for the slot, which is a page of its own here, and for "9:" init
+ * and the "version" and "id" queries, which the bench does not time.
+ */
+static void *FileMap = NULL;
+static struct ARMA_SERVER_INFO *ArmaServerInfo = NULL;
+static struct timespec T0;
+static long pagesize;
+
+static void baseline_RVExtension(char *output, int outputSize, const char *function)
+{
+	char *stopstring;
+	size_t funlen;
+
+	if (output == NULL || outputSize <= 0 || function == NULL) return;
+	funlen = strnlen(function, FUNCTIONSIZE + 2);	// "<n>:<OCCx string>"
+	if (funlen == 0) return;
+	if (funlen == FUNCTIONSIZE + 2) return;
+
+	*output = '\0';
+
+	//asmlog_debug("RVExtension(%p, %d, \"%s\")", output, outputSize, function);
+	if (!isdigit(*function)) {
+		return;
+	} else {
+		// function is supposed to be <digit>:<data>
+		if (function[1] != ':' || funlen < 3) {
+			return;
+		}
+	}
+
+	if (!FileMap) {
+	   asmlog_error("no FileMap");
+	   return;
+	}
+
+	switch (*function) {
+		case '0': // FPS update
+			if (ArmaServerInfo != NULL) {
+					unsigned FPS,FPSMIN;
+
+					FPS = strtol(&function[2], &stopstring, 10);
+					FPSMIN = strtol(&stopstring[1], &stopstring, 10);
+					ArmaServerInfo->SERVER_FPS    =	FPS;
+					ArmaServerInfo->SERVER_FPSMIN =	FPSMIN;
+					ArmaServerInfo->TICK_COUNT    = gettickcount();
+
+					asmlog_debug("0: FPS update");
+			}
+			break;
+
+		case '1': // CPS update
+			if (ArmaServerInfo != NULL) {
+					struct timespec T1;
+					double tnsec;
+					unsigned conditionNo;
+
+					memset(&T1, 0, sizeof(T1));
+					clock_gettime(CLOCK_MONOTONIC, &T1);
+					tnsec = (1e9 * (T1.tv_sec - T0.tv_sec) + (T1.tv_nsec - T0.tv_nsec)) / 1e9;
+					conditionNo = strtol(&function[2], &stopstring, 10);
+					ArmaServerInfo->FSM_CE_FREQ = floor(conditionNo * 1000 / tnsec + 0.5);
+
+					T0 = T1;
+					asmlog_debug("1: CPS update");
+			}
+			break;
+
+		case '2': // GEN update
+			if (ArmaServerInfo != NULL) {
+				unsigned players, ail, air;
+				FILE* f = NULL;
+				long rss = 0L;
+
+				players = strtol(&function[2],   &stopstring, 10);
+				ail		= strtol(&stopstring[1], &stopstring, 10);
+				air		= strtol(&stopstring[1], &stopstring, 10);
+				ArmaServerInfo->PLAYER_COUNT = players;
+				ArmaServerInfo->AI_LOC_COUNT = ail;
+				ArmaServerInfo->AI_REM_COUNT = air;
+
+				// ASMdll.dll for Windows gets the "Commit Charge" value here,
+				// the total memory that the memory manager has committed
+				// for a running process. (unit: bytes)
+				if ((f = fopen("/proc/self/statm", "r")) != NULL) {
+					// The second number in statm is the size of the in-memory
+					// working set (RSS). TODO: is this the value we want?
+					if (fscanf(f, "%*s%8ld", &rss) != 1) {
+						rss = 0L;
+					}
+					fclose(f);
+				}
+				ArmaServerInfo->MEM = rss * pagesize;
+				asmlog_debug("2: GEN update");
+			}
+			break;
+
+		case '3': // MISSION update
+			if (ArmaServerInfo != NULL) {
+				memset(ArmaServerInfo->MISSION, 0, SMALSTRINGSIZE);
+				strncpy(ArmaServerInfo->MISSION, &function[2], SMALSTRINGSIZE);
+				ArmaServerInfo->MISSION[SMALSTRINGSIZE-1] = 0;
+				asmlog_debug("3: MISSION update");
+			}
+			break;
+
+		case '4': // OBJ_COUNT_0 update
+			if (ArmaServerInfo != NULL) {
+				unsigned obj;
+				obj = strtol(&function[2], &stopstring, 10);
+				ArmaServerInfo->OBJ_COUNT_0 = obj;
+				asmlog_debug("4: OBJ_COUNT_0 update");
+			}
+			break;
+
+		case '5': // OBJ_COUNT_1 update
+			if (ArmaServerInfo != NULL) {
+				unsigned obj;
+				obj = strtol(&function[2], &stopstring, 10);
+				ArmaServerInfo->OBJ_COUNT_1 = obj;
+				asmlog_debug("5: OBJ_COUNT_1 update");
+			}
+			break;
+
+		case '6': // OBJ_COUNT_2 update
+			if (ArmaServerInfo != NULL) {
+				unsigned obj;
+				obj = strtol(&function[2], &stopstring, 10);
+				ArmaServerInfo->OBJ_COUNT_2 = obj;
+				asmlog_debug("6: OBJ_COUNT_2 update");
+			}
+			break;
+
+		default: // 7,8 are not implemented
+			return;
+	}
+	if (ArmaServerInfo != NULL) {
+		if (msync(ArmaServerInfo, pagesize, MS_ASYNC|MS_INVALIDATE) != 0) {
+			asmlog_error("msync(): %s", strerror(errno));
+		}
+	}
+	return;
+}
+
+// Time iterations calls of a command, after a warm-up. Returns the total in ns.
+static double bench_command(callextension call, const char *command, int iterations)
+{
+	char output[OUTPUTSIZE];
+	struct timespec t0, t1;
+	int i;
+
+	for (i = 0; i < iterations / 10; i++) {
+		call(output, OUTPUTSIZE, command);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < iterations; i++) {
+		call(output, OUTPUTSIZE, command);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return elapsed_ns(&t0, &t1);
+}
+
+/*
+ * Measure the cost of the update commands, in nanoseconds per call,
+ * as seen from the calling (Arma server) thread, against the switch and
+ * strtol() dispatch of baseline_RVExtension().
+ */
+static int test_bench(int iterations)
+{
+	static const char *commands[] = {
+		"0:49876:31250",
+		"1:10",
+		"2:8:100:50",
+		"3:asmtest",
+		"4:4000",
+		"5:500",
+		"6:60",
+		NULL
+	};
+	static const char *batch[] = {"49876", "31250", "10", "8", "100", "50", "4000", "500", "60"};
+	char output[OUTPUTSIZE];
+	void *handle = NULL;
+	callextension RVExtension = NULL;
+	callextensionargs RVExtensionArgs = NULL;
+	struct timespec t0, t1;
+	double ns, baseline, total = 0, total_baseline = 0, frame = 0;
+	int c, i;
+
+	if ((handle = load_extension(&RVExtension)) == NULL) {
+		return -1;
+	}
+
+	RVExtension(output, OUTPUTSIZE, "9:bench");
+	printf("init: %s\n", output);
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	FileMap = mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (FileMap == MAP_FAILED) {
+		perror("mmap");
+		dlclose(handle);
+		return -1;
+	}
+	ArmaServerInfo = FileMap;
+	clock_gettime(CLOCK_MONOTONIC, &T0);
+
+	printf("%-16s %10s %10s ns/call\n", "", "baseline", "now");
+	for (c = 0; commands[c] != NULL; c++) {
+		baseline = bench_command(baseline_RVExtension, commands[c], iterations);
+		ns       = bench_command(RVExtension, commands[c], iterations);
+		printf("%-16s %10.1f %10.1f\n", commands[c], baseline / iterations, ns / iterations);
+		total_baseline += baseline;
+		total          += ns;
+		if (commands[c][0] != '3') {
+			frame += ns;
+		}
+	}
+	printf("%-16s %10.1f %10.1f\n", "average",
+		total_baseline / (c * (double)iterations), total / (c * (double)iterations));
+	munmap(FileMap, pagesize);
+	FileMap = ArmaServerInfo = NULL;
+
+	// One update cycle of the mission: separate calls vs one batched call
+	RVExtensionArgs = (callextensionargs)dlsym(handle, "RVExtensionArgs");
+	if (RVExtensionArgs != NULL) {
+		for (i = 0; i < iterations / 10; i++) {
+			RVExtensionArgs(output, OUTPUTSIZE, "update", batch, 9);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < iterations; i++) {
+			RVExtensionArgs(output, OUTPUTSIZE, "update", batch, 9);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		printf("%-16s %10.1f ns/update\n", "separate 0-2,4-6", frame / iterations);
+		printf("%-16s %10.1f ns/update\n", "batched update", elapsed_ns(&t0, &t1) / iterations);
+	}
+
+	dlclose(handle);
+	return 0;
+}
+
+/*
+ * A dashboard connection for test_clients(). A snapshot reply has no
+ * length field: each of the MAX_ARMA_INSTANCES records is a zero PID
+ * (2 bytes) or a full ASI_WIRE_SIZE record.
+ */
+struct bench_client {
+	int           fd;
+	int           record;
+	int           got;
+	unsigned char buf[ASI_WIRE_SIZE];
+	struct timespec sent;
+};
+
+// Returns 1 when the whole snapshot has been received, -1 on error
+static int bench_receive(struct bench_client *b)
+{
+	int want, rv;
+
+	for (;;) {
+		want = b->got < 2 || (b->buf[0] == 0 && b->buf[1] == 0) ? 2 : ASI_WIRE_SIZE;
+		if (b->got == want) {
+			b->got = 0;
+			if (++b->record == MAX_ARMA_INSTANCES) return 1;
+			continue;
+		}
+		rv = recv(b->fd, b->buf + b->got, want - b->got, MSG_DONTWAIT);
+		if (rv == 0) return -1;
+		if (rv == -1) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		b->got += rv;
+	}
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Add up the resident and proportional set sizes, in kB, of a process
+ * and its children (the forking server has one child per client)
+ */
+static void bench_memory(pid_t pid, unsigned long *rss, unsigned long *pss)
+{
+	char path[64], line[256];
+	DIR *proc;
+	struct dirent *d;
+	FILE *f;
+	unsigned long kb;
+	int ppid;
+	pid_t p;
+
+	*rss = *pss = 0;
+	if ((proc = opendir("/proc")) == NULL) return;
+	while ((d = readdir(proc)) != NULL) {
+		if ((p = atoi(d->d_name)) <= 0) continue;
+		if (p != pid) {
+			snprintf(path, sizeof(path), "/proc/%d/stat", p);
+			if ((f = fopen(path, "r")) == NULL) continue;
+			if (fgets(line, sizeof(line), f) == NULL || sscanf(strrchr(line, ')') + 1, " %*c %d", &ppid) != 1) ppid = 0;
+			fclose(f);
+			if (ppid != pid) continue;
+		}
+		snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", p);
+		if ((f = fopen(path, "r")) == NULL) continue;
+		while (fgets(line, sizeof(line), f) != NULL) {
+			if (sscanf(line, "Rss: %lu kB", &kb) == 1) *rss += kb;
+			if (sscanf(line, "Pss: %lu kB", &kb) == 1) *pss += kb;
+		}
+		fclose(f);
+	}
+	closedir(proc);
+}
+
+/*
+ * Connect n dashboards to the daemon on localhost:port, then let all of
+ * them request a snapshot at the same time, CLIENTS_ROUNDS times over.
+ * Reports the request latency and, given the daemon's pid, its memory.
+ */
+static int test_clients(int n, const char *port, pid_t pid)
+{
+	struct addrinfo hints, *ai;
+	struct bench_client *clients;
+	struct pollfd *fds;
+	struct timespec t1;
+	double *latency;
+	unsigned long rss = 0, pss = 0;
+	unsigned char req[4] = {0, 0, 0, 0};
+	int i, round, pending, count = 0, status = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo("localhost", port, &hints, &ai) != 0) {
+		fprintf(stderr, "localhost:%s: no such address\n", port);
+		return 1;
+	}
+
+	clients = calloc(n, sizeof(*clients));
+	fds     = calloc(n, sizeof(*fds));
+	latency = calloc(n * CLIENTS_ROUNDS, sizeof(*latency));
+	if (clients == NULL || fds == NULL || latency == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		clients[i].fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (clients[i].fd == -1 || connect(clients[i].fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+			fprintf(stderr, "client %d: connect, %s\n", i, strerror(errno));
+			n = i;
+			status = 1;
+			break;
+		}
+		fds[i].fd     = clients[i].fd;
+		fds[i].events = POLLIN;
+	}
+	freeaddrinfo(ai);
+
+	for (round = 0; status == 0 && round < CLIENTS_ROUNDS; round++) {
+		for (i = 0; i < n; i++) {
+			clients[i].record = clients[i].got = 0;
+			clock_gettime(CLOCK_MONOTONIC, &clients[i].sent);
+			if (send(clients[i].fd, req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)) {
+				fprintf(stderr, "client %d: send, %s\n", i, strerror(errno));
+				status = 1;
+			}
+			fds[i].fd = clients[i].fd;
+		}
+		for (pending = n; status == 0 && pending > 0; ) {
+			if (poll(fds, n, 5000) <= 0) {
+				fprintf(stderr, "round %d: %d clients got no reply\n", round, pending);
+				status = 1;
+				break;
+			}
+			for (i = 0; i < n; i++) {
+				if (fds[i].fd < 0 || fds[i].revents == 0) continue;
+				switch (bench_receive(&clients[i])) {
+					case 1:
+						clock_gettime(CLOCK_MONOTONIC, &t1);
+						latency[count++] = elapsed_ns(&clients[i].sent, &t1) / 1000;
+						fds[i].fd = -1;
+						pending--;
+						break;
+					case -1:
+						fprintf(stderr, "client %d: disconnected\n", i);
+						status = 1;
+						break;
+				}
+			}
+		}
+		if (round == 0 && pid > 0) {
+			bench_memory(pid, &rss, &pss);
+		}
+	}
+
+	if (count > 0) {
+		qsort(latency, count, sizeof(*latency), compare_double);
+		printf("%5d clients  %7d requests  p50 %8.1f us  p99 %8.1f us  max %8.1f us",
+				n, count, latency[count / 2], latency[count * 99 / 100], latency[count - 1]);
+		if (pid > 0) {
+			printf("  rss %7lu kB  pss %7lu kB", rss, pss);
+		}
+		printf("\n");
+	}
+
+	for (i = 0; i < n; i++) {
+		close(clients[i].fd);
+	}
+	free(latency);
+	free(fds);
+	free(clients);
+	return status;
+}
+
+/*
+ * Encode a simulated stream of snapshots, with a few busy instances whose
+ * counters move a little every second, and check that decoding gives
+ * back every snapshot. Reports the average size of the full and the
+ * delta-encoded snapshots.
+ */
+static int test_delta(void)
+{
+	struct ARMA_SERVER_INFO asi[MAX_ARMA_INSTANCES];
+	unsigned char records[MAX_ARMA_INSTANCES * ASI_WIRE_SIZE];
+	unsigned char frame[ASM_DELTA_MAX_SIZE];
+	struct asm_delta encoder, decoder;
+	size_t len, full = 0, delta = 0;
+	int frames, instance, live, failed = 0;
+
+	_Static_assert(sizeof(struct ARMA_SERVER_INFO) == ASI_WIRE_SIZE, "ARMA_SERVER_INFO layout");
+	memset(asi, 0, sizeof(asi));
+	asm_delta_init(&encoder);
+	asm_delta_init(&decoder);
+	srand(1);
+
+	for (frames = 0; frames < DELTA_FRAMES; frames++) {
+		live = 0;
+		for (instance = 0; instance < 6; instance++) {
+			struct ARMA_SERVER_INFO *a = &asi[instance];
+
+			if (frames == 0) {
+				a->PID = 1000 + instance;
+				snprintf(a->PROFILE, SMALSTRINGSIZE, "server%d", instance);
+			}
+			if (frames % 2000 == instance * 100) {
+				snprintf(a->MISSION, SMALSTRINGSIZE, "mission%d.Altis", rand() % 100);
+			}
+			a->SERVER_FPS    = 45000 + rand() % 5000;
+			a->SERVER_FPSMIN = a->SERVER_FPS - rand() % 20000;
+			a->FSM_CE_FREQ   = rand() % 200;
+			a->PLAYER_COUNT  = 40 + (frames / 50 + instance) % 20;
+			a->AI_LOC_COUNT += rand() % 3 - 1;
+			a->OBJ_COUNT_0  += rand() % 5 - 2;
+			a->MEM           = 2000000 + (frames % 100 == 0 ? (uint32_t)rand() % 1000 : a->MEM % 1000);
+			a->NET_RECV      = rand() % 4096;
+			a->NET_SEND      = rand() % 65536;
+			a->TICK_COUNT   += 1000;
+			live++;
+		}
+
+		full += live * ASI_WIRE_SIZE + (MAX_ARMA_INSTANCES - live) * 2;
+		memcpy(records, asi, sizeof(records));
+		len = asm_delta_encode(&encoder, records, frames % DELTA_KEYFRAME == 0, frame);
+		delta += len;
+		if (asm_delta_decode(&decoder, frame, len) != 0 ||
+		    memcmp(decoder.records, records, sizeof(records)) != 0) {
+			failed++;
+		}
+	}
+
+	printf("delta: %d frames, %d failed, full %.1f bytes/snapshot, delta %.1f bytes/snapshot (keyframe every %d)\n",
+			DELTA_FRAMES, failed, (double)full / DELTA_FRAMES, (double)delta / DELTA_FRAMES, DELTA_KEYFRAME);
+	return failed == 0 ? 0 : 1;
+}
+
+/*
+ * Compress a simulated day of one-second samples of a busy instance into
+ * archive blocks, with a little jitter in the times, and check that the
+ * blocks decode to the same samples: all fields, every other field, and
+ * a range in the middle of each block. Reports the size per sample.
+ */
+static int test_archive(void)
+{
+	static uint64_t times[ARCHIVE_SAMPLES], values[ARCHIVE_SAMPLES][ARCHIVE_FIELDS];
+	static unsigned char out[ASM_TSBLOCK_MAX_SIZE];
+	static struct asm_tsblock block;
+	uint64_t got_times[ASM_TSBLOCK_SAMPLES], got[ASM_TSBLOCK_SAMPLES * ARCHIVE_FIELDS];
+	const uint32_t all = ((1u << ARCHIVE_FIELDS) - 1) << 1, odd = all & 0x55555555;
+	size_t bytes = 0, len;
+	int i, first = 0, n, field, j, blocks = 0, failed = 0;
+
+	srand(1);
+	for (i = 0; i < ARCHIVE_SAMPLES; i++) {
+		times[i] = 1790000000000ULL + i * 1000ULL + rand() % 3;
+		for (field = 0; field < ARCHIVE_FIELDS; field++) {
+			values[i][field] = i == 0 ? 0 : values[i - 1][field];
+		}
+		values[i][0]  = 4242;                             // PID
+		values[i][3]  = 1000 + (i / 30) % 200;            // OBJ_COUNT_2
+		values[i][4]  = 40 + (i / 600) % 20;              // PLAYER_COUNT
+		values[i][5] += rand() % 3 - 1;                   // AI_LOC_COUNT
+		values[i][7]  = 45000 + rand() % 5000;            // SERVER_FPS
+		values[i][8]  = values[i][7] - rand() % 20000;    // SERVER_FPSMIN
+		values[i][9]  = rand() % 200;                     // FSM_CE_FREQ
+		values[i][10] = rand() % 10000;                   // CPU_LOAD
+		values[i][11] = 2000000000ULL + (i % 60 == 0 ? (uint64_t)rand() % 1000000 : values[i][11] % 1000000);
+		values[i][16] += rand() % 65536;                  // IO_READ
+	}
+
+	asm_tsblock_init(&block, all);
+	for (i = 0; i < ARCHIVE_SAMPLES; i++) {
+		if (!asm_tsblock_append(&block, times[i], values[i]) && i < ARCHIVE_SAMPLES - 1) continue;
+
+		len = asm_tsblock_write(&block, out);
+		bytes += len;
+		blocks++;
+		n = i + 1 - first;
+		if (asm_tsblock_check(out, len) != len ||
+		    asm_tsblock_decode(out, all, 0, UINT64_MAX, got_times, got, n) != n) {
+			failed++;
+		} else {
+			for (j = 0; j < n; j++) {
+				if (got_times[j] != times[first + j] ||
+				    memcmp(&got[j * ARCHIVE_FIELDS], values[first + j], sizeof(values[0])) != 0) {
+					failed++;
+					break;
+				}
+			}
+		}
+		// Every other field, from the eleventh to the twentieth sample of the block
+		if (asm_tsblock_decode(out, odd, times[first + 10], times[first + 19], got_times, got, n) != 10) {
+			failed++;
+		} else {
+			for (j = 0; j < 10; j++) {
+				for (field = 0; field < ARCHIVE_FIELDS / 2; field++) {
+					if (got[j * (ARCHIVE_FIELDS / 2) + field] != values[first + 10 + j][2 * field + 1]) failed++;
+				}
+			}
+		}
+		asm_tsblock_init(&block, all);
+		first = i + 1;
+	}
+
+	printf("archive: %d samples in %d blocks, %d failed, %.1f bytes/sample (%d bytes raw)\n",
+			ARCHIVE_SAMPLES, blocks, failed, (double)bytes / ARCHIVE_SAMPLES, 8 * (1 + ARCHIVE_FIELDS));
+	return failed == 0 ? 0 : 1;
+}
+
+/*
+ * Time the min, max and sum reductions of the rollups with each set of
+ * kernels the CPU can run, over n passes of an hour of samples, and check
+ * that they agree with the scalar ones. Some of the numbers have their
+ * top bit set, which the signed compares of SSE2 and AVX2 must not be
+ * fooled by, and the lengths cover the tails after the last full vector.
+ */
+static int test_rollup(int passes)
+{
+	static const char *names[] = { "scalar", "sse2", "avx2" };
+	static uint64_t v[ROLLUP_VALUES];
+	const struct asm_rollup_kernels *scalar = asm_rollup_kernels("scalar"), *k;
+	struct timespec t0, t1;
+	volatile uint64_t sink = 0;
+	size_t n;
+	int i, pass, failed = 0;
+
+	srand(1);
+	for (i = 0; i < ROLLUP_VALUES; i++) {
+		v[i] = (uint64_t)rand() << 32 | (uint64_t)rand();
+		if (i % 7 == 0) v[i] |= 1ULL << 63;
+	}
+
+	for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+		if ((k = asm_rollup_kernels(names[i])) == NULL) {
+			printf("rollup: %-8s not supported by this CPU\n", names[i]);
+			continue;
+		}
+		for (n = 0; n <= 67; n++) {
+			if (k->min(v + 1, n) != scalar->min(v + 1, n) ||
+			    k->max(v + 1, n) != scalar->max(v + 1, n) ||
+			    k->sum(v + 1, n) != scalar->sum(v + 1, n)) {
+				failed++;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (pass = 0; pass < passes; pass++) {
+			sink += k->min(v, ROLLUP_VALUES) + k->max(v, ROLLUP_VALUES) + k->sum(v, ROLLUP_VALUES);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		printf("rollup: %-8s %8.1f M values/s (min, max and sum)\n", k->name,
+				3.0 * passes * ROLLUP_VALUES / elapsed_ns(&t0, &t1) * 1000);
+	}
+
+	printf("rollup: best is %s, %d failed\n", asm_rollup_kernels(NULL)->name, failed);
+	return failed == 0 ? 0 : 1;
+}
+
+/*
+ * test            - load the extension and simulate an Arma server instance
+ * test seqlock    - run the slot publication contention test
+ * test bench [n]  - time n calls of each RVExtension() update command
+ * test delta      - check the delta encoding of snapshots, and its size
+ * test archive    - check the compression of archived samples, and its size
+ * test rollup [n] - time n passes of each set of rollup kernels, and check them
+ * test clients n [port [pid]]
+ *                 - time snapshot requests from n concurrent dashboards,
+ *                   and the memory used by the daemon with that pid
+ */
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "seqlock") == 0) {
+		return test_seqlock();
+	}
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		return test_bench(argc > 2 ? atoi(argv[2]) : 1000000);
+	}
+	if (argc > 1 && strcmp(argv[1], "delta") == 0) {
+		return test_delta();
+	}
+	if (argc > 1 && strcmp(argv[1], "archive") == 0) {
+		return test_archive();
+	}
+	if (argc > 1 && strcmp(argv[1], "rollup") == 0) {
+		return test_rollup(argc > 2 ? atoi(argv[2]) : 10000);
+	}
+	if (argc > 2 && strcmp(argv[1], "clients") == 0) {
+		return test_clients(atoi(argv[2]), argc > 3 ? argv[3] : "24000", argc > 4 ? atoi(argv[4]) : 0);
+	}
+
+	return test_extension();
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "tsblock.h"
+
+// Bits of a delta of delta after a prefix of 1, 2, 3 or 4 ones
+static const int dod_bits[] = { 0, 7, 9, 12, 64 };
+
+struct bitreader
+{
+	const unsigned char *buf;
+	size_t               bits;
+	size_t               end;   // bits in buf
+};
+
+// Append the low n bits of v, 1 <= n <= 64
+static void put_bits(unsigned char *buf, size_t *bits, uint64_t v, int n)
+{
+	int used, take;
+
+	while (n > 0) {
+		used = *bits % 8;
+		take = n < 8 - used ? n : 8 - used;
+		if (used == 0) buf[*bits / 8] = 0;
+		buf[*bits / 8] |= ((v >> (n - take)) & ((1u << take) - 1)) << (8 - used - take);
+		*bits += take;
+		n -= take;
+	}
+}
+
+// Returns 1 if the column ends before n more bits
+static int get_bits(struct bitreader *r, int n, uint64_t *v)
+{
+	int used, take;
+
+	if (r->bits + n > r->end) return 1;
+	*v = 0;
+	while (n > 0) {
+		used = r->bits % 8;
+		take = n < 8 - used ? n : 8 - used;
+		*v = (*v << take) | ((r->buf[r->bits / 8] >> (8 - used - take)) & ((1u << take) - 1));
+		r->bits += take;
+		n -= take;
+	}
+	return 0;
+}
+
+// Count the leading one bits, up to max, and skip the zero after them
+static int get_prefix(struct bitreader *r, int max, int *ones)
+{
+	uint64_t bit;
+
+	for (*ones = 0; *ones < max; (*ones)++) {
+		if (get_bits(r, 1, &bit) != 0) return 1;
+		if (bit == 0) break;
+	}
+	return 0;
+}
+
+// A signed n-bit number, in the range -2^(n-1)+1 ... 2^(n-1)
+static int64_t signed_bits(uint64_t v, int n)
+{
+	return v > (1ULL << (n - 1)) ? (int64_t)v - (int64_t)(1ULL << n) : (int64_t)v;
+}
+
+static int popcount(uint32_t v)
+{
+	return __builtin_popcount(v);
+}
+
+void asm_tsblock_init(struct asm_tsblock *block, uint32_t mask)
+{
+	block->mask   = mask;
+	block->fields = popcount(mask);
+	block->count  = 0;
+	memset(block->bits, 0, sizeof(block->bits));
+}
+
+static void put_delta_of_delta(struct asm_tsblock *block, int64_t dod)
+{
+	unsigned char *column = block->columns[0];
+	size_t *bits = &block->bits[0];
+
+	if (dod == 0) {
+		put_bits(column, bits, 0x0, 1);
+	} else if (dod >= -63 && dod <= 64) {
+		put_bits(column, bits, 0x2, 2);
+		put_bits(column, bits, dod, 7);
+	} else if (dod >= -255 && dod <= 256) {
+		put_bits(column, bits, 0x6, 3);
+		put_bits(column, bits, dod, 9);
+	} else if (dod >= -2047 && dod <= 2048) {
+		put_bits(column, bits, 0xe, 4);
+		put_bits(column, bits, dod, 12);
+	} else {
+		put_bits(column, bits, 0xf, 4);
+		put_bits(column, bits, dod, 64);
+	}
+}
+
+static void put_value(struct asm_tsblock *block, int field, uint64_t value)
+{
+	unsigned char *column = block->columns[1 + field];
+	size_t *bits = &block->bits[1 + field];
+	uint64_t x = value ^ block->prev[field];
+	int leading, trailing;
+
+	block->prev[field] = value;
+	if (x == 0) {
+		put_bits(column, bits, 0x0, 1);
+		return;
+	}
+	leading  = __builtin_clzll(x);
+	trailing = __builtin_ctzll(x);
+	if (block->leading[field] >= 0 && leading >= block->leading[field] && trailing >= block->trailing[field]) {
+		put_bits(column, bits, 0x2, 2);
+		put_bits(column, bits, x >> block->trailing[field], 64 - block->leading[field] - block->trailing[field]);
+		return;
+	}
+	put_bits(column, bits, 0x3, 2);
+	put_bits(column, bits, leading, 6);
+	put_bits(column, bits, 64 - leading - trailing - 1, 6);
+	put_bits(column, bits, x >> trailing, 64 - leading - trailing);
+	block->leading[field]  = leading;
+	block->trailing[field] = trailing;
+}
+
+/*
+ * Add a sample, with one value for each field in the block's mask. The
+ * time must not be before the last one. Returns 1 once the block is
+ * full, and it must then be written out and started over.
+ */
+int asm_tsblock_append(struct asm_tsblock *block, uint64_t time, const uint64_t *values)
+{
+	int field;
+
+	if (block->count == 0) {
+		block->first = block->last = time;
+		block->delta = 0;
+		for (field = 0; field < block->fields; field++) {
+			block->prev[field]     = values[field];
+			block->leading[field]  = -1;
+			block->trailing[field] = -1;
+			put_bits(block->columns[1 + field], &block->bits[1 + field], values[field], 64);
+		}
+	} else {
+		put_delta_of_delta(block, (int64_t)(time - block->last) - block->delta);
+		block->delta = time - block->last;
+		block->last  = time;
+		for (field = 0; field < block->fields; field++) {
+			put_value(block, field, values[field]);
+		}
+	}
+	return ++block->count >= ASM_TSBLOCK_SAMPLES;
+}
+
+// Write the block into out, which must have room for ASM_TSBLOCK_MAX_SIZE bytes
+size_t asm_tsblock_write(const struct asm_tsblock *block, unsigned char *out)
+{
+	unsigned char *p = out + ASM_TSBLOCK_HEADER;
+	size_t len;
+	int column;
+
+	for (column = 0; column <= block->fields; column++) {
+		*((unsigned short *)p) = (block->bits[column] + 7) / 8; p += sizeof(unsigned short);
+	}
+	for (column = 0; column <= block->fields; column++) {
+		len = (block->bits[column] + 7) / 8;
+		memcpy(p, block->columns[column], len);
+		p += len;
+	}
+	*((unsigned int *)out)          = p - out;
+	*((unsigned int *)(out + 4))    = block->mask;
+	*((uint64_t *)(out + 8))        = block->first;
+	*((uint64_t *)(out + 16))       = block->last;
+	*((unsigned short *)(out + 24)) = block->count;
+	*((unsigned short *)(out + 26)) = 1 + block->fields;
+	return p - out;
+}
+
+/*
+ * Returns the size of the block at in, or 0 if there is no whole,
+ * well-formed block in the len bytes there
+ */
+size_t asm_tsblock_check(const unsigned char *in, size_t len)
+{
+	size_t size, sum;
+	int count, columns, column;
+
+	if (len < ASM_TSBLOCK_HEADER) return 0;
+	size    = *((const unsigned int *)in);
+	count   = *((const unsigned short *)(in + 24));
+	columns = *((const unsigned short *)(in + 26));
+	if (size > len || count < 1 || count > ASM_TSBLOCK_SAMPLES ||
+	    columns != 1 + popcount(*((const unsigned int *)(in + 4))) || columns > 1 + ASM_TSBLOCK_MAX_FIELDS ||
+	    size < ASM_TSBLOCK_HEADER + 2 * (size_t)columns) {
+		return 0;
+	}
+	sum = ASM_TSBLOCK_HEADER + 2 * columns;
+	for (column = 0; column < columns; column++) {
+		sum += *((const unsigned short *)(in + ASM_TSBLOCK_HEADER + 2 * column));
+	}
+	return sum == size ? size : 0;
+}
+
+/*
+ * Decode the samples of a block, checked with asm_tsblock_check(), that
+ * are from ... to ms, up to max of them. For each sample, times gets the
+ * time and values one value for each field in mask, in field order; 0
+ * for the fields that are not in the block. Only the columns of those
+ * fields are decoded. Returns the number of samples, or -1 if a column
+ * is cut short.
+ */
+int asm_tsblock_decode(const unsigned char *in, uint32_t mask, uint64_t from, uint64_t to,
+                       uint64_t *times, uint64_t *values, int max)
+{
+	struct bitreader readers[1 + ASM_TSBLOCK_MAX_FIELDS];
+	struct bitreader *wanted[ASM_TSBLOCK_MAX_FIELDS];
+	uint64_t prev[ASM_TSBLOCK_MAX_FIELDS];
+	int leading[ASM_TSBLOCK_MAX_FIELDS], trailing[ASM_TSBLOCK_MAX_FIELDS];
+	const uint32_t block_mask = *((const unsigned int *)(in + 4));
+	const int count   = *((const unsigned short *)(in + 24));
+	const int columns = *((const unsigned short *)(in + 26));
+	const int fields  = popcount(mask);
+	const unsigned char *p = in + ASM_TSBLOCK_HEADER + 2 * columns;
+	uint64_t time = *((const uint64_t *)(in + 8)), v;
+	int64_t delta = 0;
+	int column, field, bit, sample, ones, n = 0;
+
+	if (time > to || *((const uint64_t *)(in + 16)) < from || fields > ASM_TSBLOCK_MAX_FIELDS) {
+		return 0;
+	}
+	for (column = 0; column < columns; column++) {
+		readers[column].buf  = p;
+		readers[column].bits = 0;
+		readers[column].end  = 8 * (size_t)*((const unsigned short *)(in + ASM_TSBLOCK_HEADER + 2 * column));
+		p += readers[column].end / 8;
+	}
+	for (bit = 0, field = 0; bit < 32; bit++) {
+		if (!(mask & (1u << bit))) continue;
+		wanted[field] = NULL;
+		if (block_mask & (1u << bit)) {
+			wanted[field] = &readers[1 + popcount(block_mask & ((1u << bit) - 1))];
+		}
+		prev[field]    = 0;
+		leading[field] = trailing[field] = 0;
+		field++;
+	}
+
+	for (sample = 0; sample < count && n < max; sample++) {
+		if (sample > 0) {
+			if (get_prefix(&readers[0], 4, &ones) != 0) return -1;
+			if (ones > 0) {
+				if (get_bits(&readers[0], dod_bits[ones], &v) != 0) return -1;
+				delta += ones < 4 ? signed_bits(v, dod_bits[ones]) : (int64_t)v;
+			}
+			time  += delta;
+		}
+		if (time > to) break;
+
+		for (field = 0; field < fields; field++) {
+			struct bitreader *r = wanted[field];
+
+			if (r == NULL) continue;
+			if (sample == 0) {
+				if (get_bits(r, 64, &prev[field]) != 0) return -1;
+				continue;
+			}
+			if (get_prefix(r, 2, &ones) != 0) return -1;
+			if (ones == 0) continue;
+			if (ones == 2) {
+				if (get_bits(r, 6, &v) != 0) return -1;
+				leading[field] = v;
+				if (get_bits(r, 6, &v) != 0) return -1;
+				trailing[field] = 64 - leading[field] - (v + 1);
+			}
+			if (get_bits(r, 64 - leading[field] - trailing[field], &v) != 0) return -1;
+			prev[field] ^= v << trailing[field];
+		}
+
+		if (time < from) continue;
+		times[n] = time;
+		for (field = 0; field < fields; field++) {
+			values[n * fields + field] = prev[field];
+		}
+		n++;
+	}
+	return n;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2026 Killswitch
+ *
+ * This file is part of Arma Server Monitor for Linux.
+ *
+ * Arma Server Monitor for Linux is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Arma Server Monitor for Linux is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Arma Server Monitor for Linux; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASMTSBLOCK_H_
+#define ASMTSBLOCK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compressed blocks of time series samples, for the archive (archive.h).
+ *
+ * A block holds up to ASM_TSBLOCK_SAMPLES samples of a set of fields, as
+ * one bit stream per column, so that a reader only decodes the columns
+ * it wants. In the same byte order as the rest of the protocol:
+ *
+ *   uint32  size of the block, header included
+ *   uint32  mask of the fields, bit n for field n
+ *   uint64  time of the first sample, ms since the epoch
+ *   uint64  time of the last sample
+ *   uint16  number of samples
+ *   uint16  number of columns: the times, then each field in the mask
+ *   uint16  for each column, its size in bytes
+ *   the columns, one after the other
+ *
+ * The columns are compressed as in Facebook's Gorilla: the times column
+ * holds the delta of the delta to the previous time, from the second
+ * sample on, as '0' for 0, '10' and 7 bits, '110' and 9 bits, '1110' and
+ * 12 bits or '1111' and 64 bits. A field column holds the first value in
+ * 64 bits, then each value XORed with the one before it: '0' if it is
+ * the same, '10' and the meaningful bits if they fit into the window of
+ * the previous XOR, or '11', 6 bits of leading zeros, 6 bits of length
+ * minus one and the meaningful bits. Bits are stored most significant
+ * first.
+ */
+#define ASM_TSBLOCK_SAMPLES    60
+#define ASM_TSBLOCK_MAX_FIELDS 24
+#define ASM_TSBLOCK_HEADER     28
+// Worst case size of a column: 64 bits, then 78 bits per sample
+#define ASM_TSBLOCK_COLUMN_SIZE ((64 + ASM_TSBLOCK_SAMPLES * 78 + 7) / 8)
+#define ASM_TSBLOCK_MAX_SIZE   (ASM_TSBLOCK_HEADER + (1 + ASM_TSBLOCK_MAX_FIELDS) * (2 + ASM_TSBLOCK_COLUMN_SIZE))
+
+// A block being filled
+struct asm_tsblock
+{
+	uint32_t      mask;
+	int           fields;   // bits set in mask
+	int           count;    // samples so far
+	uint64_t      first;
+	uint64_t      last;
+	int64_t       delta;    // between the last two times
+	uint64_t      prev[ASM_TSBLOCK_MAX_FIELDS];
+	int           leading[ASM_TSBLOCK_MAX_FIELDS];  // window of the last XOR
+	int           trailing[ASM_TSBLOCK_MAX_FIELDS];
+	size_t        bits[1 + ASM_TSBLOCK_MAX_FIELDS];
+	unsigned char columns[1 + ASM_TSBLOCK_MAX_FIELDS][ASM_TSBLOCK_COLUMN_SIZE];
+};
+
+void   asm_tsblock_init(struct asm_tsblock *block, uint32_t mask);
+int    asm_tsblock_append(struct asm_tsblock *block, uint64_t time, const uint64_t *values);
+size_t asm_tsblock_write(const struct asm_tsblock *block, unsigned char *out);
+size_t asm_tsblock_check(const unsigned char *in, size_t len);
+int    asm_tsblock_decode(const unsigned char *in, uint32_t mask, uint64_t from, uint64_t to,
+                          uint64_t *times, uint64_t *values, int max);
+
+#endif /* ASMTSBLOCK_H_ */